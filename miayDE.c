@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <X11/Xlib.h>
+#include <X11/Xlibint.h>
 #include <sys/stat.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
@@ -18,51 +20,444 @@
 #include <signal.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <dbus/dbus.h>
 #include <errno.h>
 #include <time.h>
 #include <fcntl.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <limits.h>
+#include <strings.h>
+#include <stdint.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/Xft/Xft.h>
+#include <X11/extensions/Xrandr.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <stddef.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <sys/mman.h>
+#include <sys/fsuid.h>
+#include <setjmp.h>
+#include <png.h>
+#include <jpeglib.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#define MAX_USERS 20
-#define AVATAR_SIZE 80
-#define SESSION_NAME_MAX 32
-#define FPS 60
+#define USER_LOAD_BATCH 256
+#define SESSION_NAME_MAX 64
+#define MAX_SESSION_THREADS 4
+#define SESSION_FILES_PER_THREAD 4
+#define CACHE_DIR "/var/cache/miayDE"
+#define SESSION_CACHE_PATH CACHE_DIR "/sessions.cache"
+#define SESSION_CACHE_MAGIC "MIAYSES1"
+#define MAX_DIRTY_RECTS 16
+#define NOTIFY_TIMEOUT 5
+#define MAX_GRADIENT_STOPS 8
+#define GRADIENT_LUT_SIZE 1024
+
+#define MAX_TIMELINE_EVENTS 32
+#define AUTH_TEXT_MAX 256
+#define SESSION_CHILD_ARG "--session-child"
+#define SPINNER_DOTS 8
+#define SPINNER_INTERVAL_MS 100
+#define STARTUP_TIMEOUT_MS 10000
+#define STATS_DIR "/run/miayDE"
+#define STATS_PATH STATS_DIR "/stats.json"
+#define FRAME_HISTOGRAM_BUCKETS 12
+#define BENCH_REPEAT_DEPTH 8
+#define GLYPH_FIRST 32
+#define GLYPH_COUNT 95
+#define CURSOR_SIZE 21
+#define TEXT_CACHE_SIZE 256
+#define TEXT_CACHE_BUCKETS 512
+#define MAX_OUTPUTS 8
+#define BUFFER_SIZE_CLASS 256
+#define BUFFER_POOL_SIZE 3
+#define CURSOR_HOTSPOT 10
+#define CONFIG_PATH "/etc/miayDE/miayDE.conf"
+#define MAX_AVATARS 256
+#define AVATAR_CACHE_DIR CACHE_DIR "/avatars"
+#define AVATAR_CACHE_MAGIC "MIAYAVT1"
+#define AVATAR_HEADER_SIZE 16
+#define AVATAR_FILE_MAX (4 << 20)
+#define AVATAR_DECODE_MAX 8192
+#define ACCOUNTS_ICON_DIR "/var/lib/AccountsService/icons"
+#define FNV64_BASIS 14695981039346656037ULL
+#define SPLASH_CACHE_PATH CACHE_DIR "/splash.cache"
+#define SPLASH_CACHE_MAGIC "MIAYSPL1"
+#define SPLASH_SEAT_PATH CACHE_DIR "/splash-%s.cache"
+#define MAX_SEATS 16
+#define SEATS_DIR "/run/systemd/seats"
+#define XDMCP_PORT 177
+#define XDMCP_PACKET_MAX 1024
+#define XDMCP_PENDING_MAX 16
+#define XDMCP_PENDING_TIMEOUT 30
+#define XDMCP_COOKIE_NAME "MIT-MAGIC-COOKIE-1"
+#define XDMCP_COOKIE_SIZE 16
+#define XDMCP_ALLOW_MAX 32
+#define XDMCP_CONNECT_TIMEOUT_MS 10000
+#define X_TCP_PORT 6000
+#define THEME_CACHE_PATH CACHE_DIR "/theme.cache"
+#define THEME_CACHE_MAGIC "MIAYTHM1"
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BYTE_ORDER MSBFirst
+#else
+#define HOST_BYTE_ORDER LSBFirst
+#endif
 
 typedef struct {
     char username[32];
     char display_name[64];
     int uid;
-    int selected;
 } User;
 
 typedef struct {
+    char key[64];
+    int user;
+} UserIndexEntry;
+
+typedef struct {
+    User *users;
+    int count;
+    int capacity;
+    UserIndexEntry *index;
+    int index_count;
+    int loading;
+} UserDirectory;
+
+typedef struct {
+    char id[64];
     char name[SESSION_NAME_MAX];
-    char exec[64];
+    char exec[256];
+    char desktop_names[64];
 } Session;
 
+// Куда открывается сессия: дисплей, место logind, VT и для XDMCP - адрес терминала и cookie
+typedef struct {
+    const char *display;
+    const char *seat;                 // NULL - не место logind (--display, XDMCP)
+    int vt;                           // 0 - без VT
+    const char *remote_host;          // PAM_RHOST
+    const unsigned char *cookie;      // MIT-MAGIC-COOKIE-1 удалённого X
+    int exec_fd;                      // канал к приветствию: EOF - exec сессии прошёл, int - errno; -1 - без замера
+} SessionTarget;
+
+// SessionTarget для помощника сессии: строки вместо указателей, пустая - NULL
+typedef struct {
+    Session session;
+    char display[64];
+    char seat[32];
+    int vt;
+    char remote_host[64];
+    unsigned char cookie[XDMCP_COOKIE_SIZE];
+    int has_cookie;
+} SessionRequest;
+
+typedef struct {
+    int x, y, width, height;
+} Rect;
+
+typedef struct {
+    double position;
+    unsigned long color;
+} GradientStop;
+
+// Градиент из нескольких опорных точек; angle в градусах, 0 - вертикальный сверху вниз
+typedef struct {
+    GradientStop stops[MAX_GRADIENT_STOPS];
+    int stop_count;
+    double angle;
+    uint32_t lut[GRADIENT_LUT_SIZE];  // заполняется gradient_build_lut() после добавления точек
+} Gradient;
+
+// Клиентский кадровый буфер в разделяемой памяти MIT-SHM
+typedef struct {
+    XImage *image;
+    XShmSegmentInfo shm;
+    uint32_t *pixels;
+    int stride;
+    int width, height;
+    Rect clip;
+    uint32_t *background;
+    uint8_t *coverage;
+    uint8_t *glyphs;
+    int glyph_cell;
+    int glyph_origin;
+    int glyph_ascent;
+    int glyph_height;
+    int glyph_advance[GLYPH_COUNT];
+    int capacity_width, capacity_height;
+} Framebuffer;
+
+typedef struct {
+    const char *name;
+    double ms;
+} TimelineEvent;
+
+// Сообщения между помощником сессии и интерфейсом
+enum {
+    AUTH_MSG_PROMPT_ECHO_OFF,
+    AUTH_MSG_PROMPT_ECHO_ON,
+    AUTH_MSG_INFO,
+    AUTH_MSG_ERROR,
+    AUTH_MSG_RESULT,
+    AUTH_MSG_ANSWER
+};
+
+typedef struct {
+    int type;
+    int result;
+    double ms;           // в AUTH_MSG_RESULT - время pam_authenticate
+    char text[AUTH_TEXT_MAX];
+} AuthMessage;
+
+// Первое сообщение помощнику сессии; fd он заполняет сам. Настройки едут с запросом:
+// конфиг помощник не читает
+typedef struct {
+    int fd;
+    char username[32];
+    char password[64];
+    int password_used;
+    int autologin;          // без пароля, только pam_acct_mgmt; сессия следом без RESULT
+    char pam_service[64];
+    int session_profile;
+} AuthRequest;
+
+// Накопленные за итерацию цикла "грязные" области экрана
+typedef struct {
+    Rect rects[MAX_DIRTY_RECTS];
+    int count;
+} DamageRegion;
+
+// Узлы сцены; порядок перечисления - порядок отрисовки
+typedef enum {
+    WIDGET_USER_LIST,
+    WIDGET_STATUS,
+    WIDGET_USER_CARD,
+    WIDGET_LOGIN_PANEL,
+    WIDGET_PROMPT,
+    WIDGET_PASSWORD_FIELD,
+    WIDGET_SPINNER,
+    WIDGET_SESSION_BUTTON,
+    WIDGET_SESSION_LIST,
+    WIDGET_SESSION_ITEM,
+    WIDGET_NOTIFICATION
+} WidgetType;
+
+typedef struct {
+    WidgetType type;
+    int index;
+    int parent;
+    int interactive;
+    Rect bounds;
+} Widget;
+
+typedef struct {
+    Rect bounds;
+    int left, right;
+    int widget;
+} BvhNode;
+
+typedef struct {
+    Widget *widgets;
+    int count;
+    int capacity;
+    Widget *previous;
+    int previous_count;
+    int previous_capacity;
+    BvhNode *bvh;
+    int *bvh_items;
+    int bvh_count;
+    int bvh_capacity;
+    int bvh_axis;
+    int valid;
+} Scene;
+
+// Строка в кеше текста: ширина и (лениво) маска покрытия для программного рендерера
+typedef struct {
+    uint32_t hash;
+    char *text;
+    int length;
+    int width;
+    uint8_t *mask;
+    int mask_x, mask_y;       // смещение начала строки внутри маски
+    int mask_width, mask_height;
+    unsigned long last_used;
+    int next;
+} TextRun;
+
+typedef struct {
+    XftFont *xft;             // NULL - серверный шрифт
+    TextRun runs[TEXT_CACHE_SIZE];
+    int count;
+    int buckets[TEXT_CACHE_BUCKETS];
+    unsigned long clock;
+} TextCache;
+
+// Аватар пользователя: ARGB с предумноженной альфой, уже обрезанный по кругу.
+// Поток декодирования переводит запись из PENDING в DECODED, остальное делает цикл событий
+typedef enum {
+    AVATAR_PENDING,
+    AVATAR_DECODED,
+    AVATAR_READY,
+    AVATAR_MISSING
+} AvatarState;
+
+typedef struct {
+    char username[32];
+    AvatarState state;
+    int ready;             // пишет только цикл событий, читает отрисовка
+    int size;
+    uint32_t *pixels;
+    size_t mapped;         // длина отображения файла кеша; 0 - pixels из malloc
+    Pixmap pixmap;         // путь через Xlib: загружается на сервер один раз
+    Pixmap mask;
+    GC gc;
+} Avatar;
+
+typedef struct {
+    Avatar items[MAX_AVATARS];
+    int count;
+    int next_job;          // записи [next_job, count) ждут потока
+    int size;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int started;
+    int stop;              // место убрано: поток сам освобождает кеш и выходит
+    int event_fd;          // поток сообщает о готовых аватарах
+} AvatarCache;
+
+typedef struct {
+    Pixmap pixmap;
+    int width, height;
+    unsigned long last_used;
+} PooledBuffer;
+
+typedef struct {
+    PooledBuffer entries[BUFFER_POOL_SIZE];
+    int count;
+    unsigned long clock;
+} BufferPool;
+
+// Дополнительный монитор: окно с фоном, который перерисовывает сервер
+typedef struct {
+    Rect bounds;
+    Window window;
+    Pixmap background;
+} Output;
+
+// Куда рисует кадр: drawable с его GC и областью отсечения либо программный буфер.
+// Создаётся на стеке на каждый кадр вместо копии всего состояния
+typedef struct {
+    Display *display;
+    Drawable drawable;
+    GC gc;
+    Rect clip;
+    Framebuffer *fb;
+    XftDraw *xft;
+    TextCache *text;
+    XFontStruct *font;
+} RenderTarget;
+
+// Источники пробуждения общего epoll; по тегу видно, чей это дескриптор
+typedef enum {
+    WATCH_X,
+    WATCH_X_READY,
+    WATCH_AUTH,
+    WATCH_TIMER,
+    WATCH_SESSION,
+    WATCH_AVATARS,
+    WATCH_EXEC,
+    WATCH_CONNECT,
+    WATCH_SEAT_COUNT,
+    WATCH_PASSWD = WATCH_SEAT_COUNT,
+    WATCH_SEATS,
+    WATCH_XDMCP
+} WatchType;
+
+struct DisplayManager;
+
+typedef struct {
+    WatchType type;
+    struct DisplayManager *dm;  // NULL - общий дескриптор менеджера мест
+    int fd;
+} Watch;
+
+// Обратный отсчёт автовхода: своё соединение и окно до открытия приветствия;
+// ведут его события X и timerfd места в общем epoll
 typedef struct {
+    Display *display;
+    Window window;
+    GC gc;
+    XFontStruct *font;
+    int width, height;
+    struct timespec start;
+    int shown;                  // показанное число секунд, -1 - перерисовать
+} Countdown;
+
+typedef struct DisplayManager {
+    char seat[32];              // место logind; пусто - единственный дисплей из --display
+    char display_name[64];
+    int vt;                     // 0 - место без своего VT
+    int attached;               // чужой сервер (--display): X не запускаем и не останавливаем
+    int opened;                 // окно приветствия создано
+    int removed;                // место убрано, структура освободится после пачки событий
+    int remote;                 // дисплей XDMCP: медленная линия, без SHM, заставки и движений мыши
+    int io_error;               // соединение с X потеряно - место нужно убрать
+    uint32_t xdmcp_session;
+    char remote_host[64];
+    struct sockaddr_in xdmcp_peer;  // кому ответить Failed, если дисплей не откроется
+    int connect_fd;             // неблокирующий connect к X терминала; -1 - не идёт
+    unsigned char cookie[XDMCP_COOKIE_SIZE];
+    int has_cookie;
+    int wake;                   // были события - место нужно обработать в этом проходе
+    Countdown countdown;
+    Watch watches[WATCH_SEAT_COUNT];
+    int x_ready_fd;
+    char x_ready[32];
+    size_t x_ready_len;
+    struct timespec x_started;
     Display *display;
     Window window;
     GC gc;
     int screen;
     int width, height;
-    User users[MAX_USERS];
-    int user_count;
+    UserDirectory *users;       // общий каталог всех мест
+    int *visible_users;
+    int visible_count;
+    int first_visible;
+    char search[32];
     int selected_user;
+    char selected_username[32];
     char password[64];
     int password_active;
     XFontStruct *font;
-    Session sessions[20];
+    Session *sessions;
     int session_count;
     int selected_session;
     int show_sessions;
     pid_t xserver_pid;
-    pid_t dbus_pid;
     int mouse_x;
     int mouse_y;
     int mouse_buttons;
-    char dbus_address[256];
     char error_message[256];
     char warning_message[256];
     time_t error_time;
@@ -70,23 +465,461 @@ typedef struct {
     int show_error;
     int show_warning;
     int password_focus;
+    int blink_visible;
+    DamageRegion damage;
+    Scene scene;
+    Gradient gradient;
+    Pixmap background;
+    Framebuffer *fb;
+    TextCache *text;
+    AvatarCache *avatars;
+    XftDraw *buffer_draw;
+    BufferPool buffers;
+    int background_stale;
+    int randr_event_base;
+    Rect primary_output;
+    Output outputs[MAX_OUTPUTS];
+    int output_count;
+    int first_frame_done;
+    Pixmap splash;
+    int splash_saved;
+    Pixmap buffer;
+    GC buffer_gc;
+    Cursor cursor;
+    int software_cursor;
+    int cursor_x, cursor_y;
+    int timer_fd;
+    int auth_fd;
+    pid_t auth_pid;             // помощник сессии; после входа он же лидер сессии
+    int auth_prompting;
+    int auth_prompt_echo;
+    char auth_prompt[AUTH_TEXT_MAX];
+    int spinner_phase;
+    struct timespec spinner_time;
+    pid_t session_pid;
+    int session_fd;
+    int session_fd_is_signalfd;
+    struct timespec submitted;      // Return в поле пароля - начало замера до exec сессии
+    int exec_fd;                    // канал помощника после входа: замер exec сессии, -1 - замер не идёт
 } DisplayManager;
 
-// Градиентные цвета
-#define COLOR_BG1 0xf61a2e
-#define COLOR_BG2 0x16213e
-#define COLOR_ACCENT1 0x0f3460
-#define COLOR_ACCENT2 0xe94560
-#define COLOR_TEXT 0xf0f0f0
-#define COLOR_HIGHLIGHT 0x4cc9f0
-#define COLOR_USER_BG 0x2d2d4d
-#define COLOR_USER_SELECTED 0x4a4a8a
-#define COLOR_PASS_BG 0x3d3d6d
-#define COLOR_PASS_FOCUS 0x5a5a9a
-
-// PAM conversation function
+// Общий для всех мест фон программного рендерера; места с одним разрешением делят пиксели
+typedef struct {
+    int width, height;
+    int refs;
+    uint32_t *pixels;
+} SharedBackground;
+
+// Все места в одном процессе: общий epoll и общие данные только для чтения -
+// каталог пользователей, список сессий и фон; тема (plan) общая и так
+typedef struct {
+    int epoll_fd;
+    DisplayManager *seats[MAX_SEATS];
+    int count;
+    UserDirectory users;
+    UserDirectory users_pending;
+    Watch passwd_watch;
+    Watch seats_watch;          // /run/systemd/seats: места появляются и исчезают
+    Session *sessions;
+    int session_count;
+    SharedBackground backgrounds[MAX_SEATS];
+    pid_t orphans[MAX_SEATS * 2];  // X и сессии убранных мест, отменённые помощники входа - ждут waitpid
+    int orphan_count;
+    int shared_loaded;
+    int autologin_done;
+} SeatManager;
+
+static SeatManager seats = { .epoll_fd = -1, .passwd_watch = { WATCH_PASSWD, NULL, -1 },
+                             .seats_watch = { WATCH_SEATS, NULL, -1 } };
+
+// Принятый Request, для которого терминал ещё не прислал Manage
+typedef struct {
+    uint32_t session_id;
+    int display_number;
+    char host[64];
+    struct sockaddr_in peer;
+    unsigned char cookie[XDMCP_COOKIE_SIZE];
+    int has_cookie;
+    time_t created;
+} XdmcpPending;
+
+// Сеть, которой разрешено пользоваться XDMCP; адрес и маска в порядке хоста
+typedef struct {
+    uint32_t address;
+    uint32_t mask;
+} XdmcpNet;
+
+// Сервер XDMCP: один UDP сокет в общем epoll, удалённые дисплеи становятся местами
+typedef struct {
+    Watch watch;
+    XdmcpNet allow[XDMCP_ALLOW_MAX];  // как Xaccess у xdm: остальным не отвечаем
+    int allow_count;
+    int max_displays;           // ожидающие Manage и открытые вместе; сверх - Unwilling/Decline
+    XdmcpPending pending[XDMCP_PENDING_MAX];
+    int pending_count;
+    char hostname[64];
+} Xdmcp;
+
+static Xdmcp xdmcp = { .watch = { WATCH_XDMCP, NULL, -1 } };
+
+// Параметры запуска; по умолчанию - обычная загрузка со своим X на :0
+typedef struct {
+    const char *display;      // подключиться к готовому серверу (Xvfb, Xephyr), X не запускать
+    const char *pam_service;  // например тестовая служба с pam_permit.so; по умолчанию из конфига или login
+    const char *bench_script;
+    const char *config_path;
+    const char *autologin_user;     // вход без окна приветствия (киоски, фермы рендеринга)
+    const char *autologin_session;  // id .desktop файла; по умолчанию первая найденная сессия
+    int autologin_timeout;          // секунды обратного отсчёта; любая клавиша - обычный вход
+    int xdmcp;                      // 1 - ещё и XDMCP, 2 - только XDMCP, без локальных мест
+} Options;
+
+static Options options = { NULL, NULL, NULL, CONFIG_PATH, NULL, NULL, 0, 0 };
+
+typedef enum {
+    BENCH_MOVE,
+    BENCH_SWEEP,
+    BENCH_CLICK,
+    BENCH_TYPE,
+    BENCH_KEY,
+    BENCH_RESIZE,
+    BENCH_STORM,
+    BENCH_WAIT
+} BenchOp;
+
+typedef struct {
+    BenchOp op;
+    int args[5];
+    char text[64];
+} BenchStep;
+
+typedef struct {
+    BenchStep *steps;
+    int count;
+    int capacity;
+    int current;
+    int progress;             // позиция внутри шага: точка протяжки, символ текста
+    int pending;              // ввод подан, кадр ещё не выведен
+    struct timespec injected;
+    struct timespec resume;
+    double *latencies;
+    int latency_count;
+    int latency_capacity;
+    int no_frame;
+    struct timespec started;
+    int done;
+} Bench;
+
+// Тема: цвета и метрики раскладки. Значения по умолчанию - в theme_defaults(),
+// переопределяются в CONFIG_PATH
+typedef struct {
+    unsigned long bg1;
+    unsigned long bg2;
+    unsigned long accent1;
+    unsigned long accent2;
+    unsigned long text;
+    unsigned long highlight;
+    unsigned long user_bg;
+    unsigned long user_selected;
+    unsigned long pass_bg;
+    unsigned long pass_focus;
+} ThemeColors;
+
+typedef struct {
+    int avatar_size;
+    int list_x;
+    int list_width;
+    int card_top;
+    int card_height;
+    int card_spacing;
+    int panel_width;
+    int notification_width;
+} ThemeLayout;
+
+// Скомпилированная тема: плоская структура без указателей, в кеш пишется как есть
+typedef struct {
+    ThemeColors colors;
+    ThemeLayout layout;
+    Gradient background;
+    char font[128];        // шаблон Xft
+    char core_font[160];   // XLFD для серверных шрифтов
+} RenderPlan;
+
+static RenderPlan plan;
+
+// Настройки демона из того же конфига: к отрисовке отношения не имеют, поэтому
+// не в RenderPlan; параметры командной строки (Options) важнее
+typedef struct {
+    char pam_service[64];
+    char autologin_user[32];
+    char autologin_session[64];
+    int autologin_timeout;
+    int session_profile;   // 1 - запуск сессии через login shell с профилями
+    int xdmcp;             // 1 - принимать удалённые X терминалы
+    int xdmcp_port;
+    int xdmcp_max_displays;
+    char xdmcp_allow[256];  // "192.168.1.0/24 10.0.0.5"; пусто - loopback и сети своих интерфейсов
+} DaemonConfig;
+
+static DaemonConfig config;
+
+// Хронология запуска: монотонные отметки от старта процесса
+static struct timespec timeline_origin;
+static TimelineEvent timeline[MAX_TIMELINE_EVENTS];
+static int timeline_count;
+
+double elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1000000.0;
+}
+
+void timeline_mark(const char *name) {
+    if (timeline_count == 0 && timeline_origin.tv_sec == 0 && timeline_origin.tv_nsec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &timeline_origin);
+    }
+    if (timeline_count < MAX_TIMELINE_EVENTS) {
+        timeline[timeline_count].name = name;
+        timeline[timeline_count].ms = elapsed_ms(&timeline_origin);
+        timeline_count++;
+    }
+}
+
+void timeline_print(FILE *out) {
+    fprintf(out, "Startup timeline:\n");
+    for (int i = 0; i < timeline_count; i++) {
+        double delta = i > 0 ? timeline[i].ms - timeline[i - 1].ms : 0.0;
+        fprintf(out, "  %8.1f ms  (+%7.1f)  %s\n", timeline[i].ms, delta, timeline[i].name);
+    }
+}
+
+// Статистика: длительность фаз, кадры и трафик протокола X.
+// Пишется в STATS_PATH по SIGUSR1 и при выходе, чтобы сравнивать сборки между машинами
+typedef enum {
+    STAT_STARTUP,
+    STAT_GET_USERS,
+    STAT_GET_SESSIONS,
+    STAT_AUTHENTICATE,
+    STAT_LAYOUT,
+    STAT_DRAW,
+    STAT_PRESENT,
+    STAT_FRAME,
+    STAT_SESSION_EXEC,
+    STAT_PHASE_COUNT
+} StatPhase;
+
+static const char *stat_phase_names[STAT_PHASE_COUNT] = {
+    "startup", "get_users", "get_sessions", "authenticate", "layout", "draw", "present", "frame", "session_exec"
+};
+
+// Верхние границы корзин гистограммы времени кадра, мс; последняя корзина - всё остальное
+static const double frame_buckets_ms[FRAME_HISTOGRAM_BUCKETS - 1] = {
+    0.5, 1, 2, 4, 8, 16.7, 33.3, 50, 100, 250, 1000
+};
+
+typedef struct {
+    unsigned long count;
+    double total_ms;
+    double max_ms;
+} SpanStat;
+
+typedef struct {
+    pthread_mutex_t lock;
+    SpanStat spans[STAT_PHASE_COUNT];
+    unsigned long frame_histogram[FRAME_HISTOGRAM_BUCKETS];
+    unsigned long frames;
+    unsigned long x_requests;
+    unsigned long max_requests_per_frame;
+    unsigned long x_bytes_flushed;
+    unsigned long x_flushes;
+    unsigned long x_round_trips;
+    unsigned long frame_request_base;
+    const char *renderer;
+    double first_pixel_ms;  // заставка или первый живой кадр - что раньше
+} Stats;
+
+static Stats stats = { .lock = PTHREAD_MUTEX_INITIALIZER, .renderer = "none" };
+static volatile sig_atomic_t stats_dump_requested;
+
+void stats_begin(struct timespec *start) {
+    clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+// Готовое время: аутентификацию помощник сессии замеряет у себя и присылает число
+void stats_record(StatPhase phase, double ms) {
+    pthread_mutex_lock(&stats.lock);
+    SpanStat *span = &stats.spans[phase];
+    span->count++;
+    span->total_ms += ms;
+    if (ms > span->max_ms) {
+        span->max_ms = ms;
+    }
+    pthread_mutex_unlock(&stats.lock);
+}
+
+double stats_end(StatPhase phase, const struct timespec *start) {
+    double ms = elapsed_ms(start);
+    stats_record(phase, ms);
+    return ms;
+}
+
+// Синхронный запрос к серверу (XSync, XGetImage)
+void stats_round_trip(void) {
+    stats.x_round_trips++;
+}
+
+// Xlib зовёт этот хук перед каждой отправкой буфера на сервер
+static void stats_before_flush(Display *display, XExtCodes *codes, const char *data, long len) {
+    stats.x_bytes_flushed += len;
+    stats.x_flushes++;
+}
+
+void stats_attach(Display *display) {
+    XExtCodes *codes = XAddExtension(display);
+    if (codes) {
+        XESetBeforeFlush(display, codes->extension, stats_before_flush);
+    }
+    stats.frame_request_base = NextRequest(display);
+}
+
+void stats_frame_begin(Display *display) {
+    // Запросы между кадрами (события, загрузка шрифтов) тоже считаются
+    unsigned long next = NextRequest(display);
+    stats.x_requests += next - stats.frame_request_base;
+    stats.frame_request_base = next;
+}
+
+void stats_frame_end(Display *display, const struct timespec *start) {
+    double ms = stats_end(STAT_FRAME, start);
+
+    unsigned long next = NextRequest(display);
+    unsigned long requests = next - stats.frame_request_base;
+    stats.x_requests += requests;
+    stats.frame_request_base = next;
+    if (requests > stats.max_requests_per_frame) {
+        stats.max_requests_per_frame = requests;
+    }
+
+    int bucket = 0;
+    while (bucket < FRAME_HISTOGRAM_BUCKETS - 1 && ms > frame_buckets_ms[bucket]) {
+        bucket++;
+    }
+    stats.frame_histogram[bucket]++;
+    stats.frames++;
+}
+
+// Первый видимый пиксель окна входа
+void stats_first_pixel(const char *name) {
+    timeline_mark(name);
+    if (stats.first_pixel_ms == 0.0) {
+        stats.first_pixel_ms = elapsed_ms(&timeline_origin);
+    }
+}
+
+static void stats_write(FILE *out) {
+    fprintf(out, "{\n  \"version\": 1,\n  \"pid\": %d,\n  \"uptime_ms\": %.3f,\n  \"renderer\": \"%s\",\n"
+            "  \"first_pixel_ms\": %.3f,\n",
+            (int)getpid(), elapsed_ms(&timeline_origin), stats.renderer, stats.first_pixel_ms);
+
+    fprintf(out, "  \"timeline\": [");
+    for (int i = 0; i < timeline_count; i++) {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"ms\": %.3f}", i ? "," : "", timeline[i].name, timeline[i].ms);
+    }
+    fprintf(out, "\n  ],\n  \"spans\": {");
+
+    pthread_mutex_lock(&stats.lock);
+    for (int i = 0; i < STAT_PHASE_COUNT; i++) {
+        const SpanStat *span = &stats.spans[i];
+        fprintf(out, "%s\n    \"%s\": {\"count\": %lu, \"total_ms\": %.3f, \"max_ms\": %.3f}",
+                i ? "," : "", stat_phase_names[i], span->count, span->total_ms, span->max_ms);
+    }
+    pthread_mutex_unlock(&stats.lock);
+
+    fprintf(out, "\n  },\n  \"x\": {\"requests\": %lu, \"max_requests_per_frame\": %lu, "
+            "\"bytes_flushed\": %lu, \"flushes\": %lu, \"round_trips\": %lu},\n",
+            stats.x_requests, stats.max_requests_per_frame,
+            stats.x_bytes_flushed, stats.x_flushes, stats.x_round_trips);
+
+    fprintf(out, "  \"frames\": {\"count\": %lu, \"histogram\": [", stats.frames);
+    for (int i = 0; i < FRAME_HISTOGRAM_BUCKETS; i++) {
+        if (i < FRAME_HISTOGRAM_BUCKETS - 1) {
+            fprintf(out, "%s{\"le_ms\": %g, \"count\": %lu}", i ? ", " : "", frame_buckets_ms[i], stats.frame_histogram[i]);
+        } else {
+            fprintf(out, ", {\"le_ms\": null, \"count\": %lu}", stats.frame_histogram[i]);
+        }
+    }
+    fprintf(out, "]}\n}\n");
+}
+
+// Пишем во временный файл и переименовываем, чтобы читатель не увидел половину
+void stats_dump(void) {
+    mkdir(STATS_DIR, 0755);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", STATS_PATH, (int)getpid());
+    FILE *out = fopen(tmp_path, "w");
+    if (!out) {
+        fprintf(stderr, "Cannot write stats to %s: %s\n", tmp_path, strerror(errno));
+        return;
+    }
+    stats_write(out);
+    if (fclose(out) != 0 || rename(tmp_path, STATS_PATH) != 0) {
+        fprintf(stderr, "Cannot write stats to %s: %s\n", STATS_PATH, strerror(errno));
+        unlink(tmp_path);
+    }
+}
+
+void stats_signal_handler(int sig) {
+    stats_dump_requested = 1;
+}
+
+// Дочерний процесс (X, лидер сессии) начинает с обычными сигналами: маска переживает
+// exec, и заблокированный ради signalfd SIGCHLD достался бы рабочему столу
+void child_reset_signals(void) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+}
+
+// Отправка сообщения из помощника сессии в интерфейс
+static int auth_send(AuthRequest *req, int type, int result, const char *text) {
+    AuthMessage message;
+    memset(&message, 0, sizeof(message));
+    message.type = type;
+    message.result = result;
+    if (text) {
+        snprintf(message.text, sizeof(message.text), "%s", text);
+    }
+    return send(req->fd, &message, sizeof(message), MSG_NOSIGNAL) == sizeof(message);
+}
+
+// Передаём вопрос PAM в интерфейс и блокируемся до ответа пользователя
+static int auth_ask(AuthRequest *req, int type, const char *prompt, char *answer, size_t size) {
+    if (!auth_send(req, type, 0, prompt)) {
+        return 0;
+    }
+
+    AuthMessage reply;
+    ssize_t n = recv(req->fd, &reply, sizeof(reply), 0);
+    if (n != sizeof(reply) || reply.type != AUTH_MSG_ANSWER) {
+        // Интерфейс закрыл канал - отмена
+        explicit_bzero(&reply, sizeof(reply));
+        return 0;
+    }
+    snprintf(answer, size, "%s", reply.text);
+    explicit_bzero(&reply, sizeof(reply));
+    return 1;
+}
+
+// PAM conversation function.
+// Первый скрытый запрос получает введённый пароль, остальные вопросы уходят в интерфейс
 static int conversation(int num_msg, const struct pam_message **msg,
                        struct pam_response **resp, void *appdata_ptr) {
+    AuthRequest *req = appdata_ptr;
+
     if (num_msg <= 0 || num_msg > PAM_MAX_NUM_MSG) {
         return PAM_CONV_ERR;
     }
@@ -97,146 +930,605 @@ static int conversation(int num_msg, const struct pam_message **msg,
     }
     
     for (int i = 0; i < num_msg; i++) {
+        char answer[AUTH_TEXT_MAX];
+
         switch (msg[i]->msg_style) {
             case PAM_PROMPT_ECHO_OFF:
+                if (!req->password_used) {
+                    req->password_used = 1;
+                    response[i].resp = strdup(req->password);
+                    explicit_bzero(req->password, sizeof(req->password));
+                    break;
+                }
+                /* fallthrough */
             case PAM_PROMPT_ECHO_ON:
-                response[i].resp = strdup((char*)appdata_ptr);
-                response[i].resp_retcode = 0;
+                if (!auth_ask(req, msg[i]->msg_style == PAM_PROMPT_ECHO_ON ? AUTH_MSG_PROMPT_ECHO_ON
+                                                                            : AUTH_MSG_PROMPT_ECHO_OFF,
+                              msg[i]->msg, answer, sizeof(answer))) {
+                    goto fail;
+                }
+                response[i].resp = strdup(answer);
+                explicit_bzero(answer, sizeof(answer));
                 break;
             case PAM_ERROR_MSG:
+                auth_send(req, AUTH_MSG_ERROR, 0, msg[i]->msg);
+                break;
             case PAM_TEXT_INFO:
+                auth_send(req, AUTH_MSG_INFO, 0, msg[i]->msg);
                 break;
             default:
-                free(response);
-                return PAM_CONV_ERR;
+                goto fail;
         }
+        response[i].resp_retcode = 0;
     }
     
     *resp = response;
     return PAM_SUCCESS;
-}
 
-int get_users(User *users) {
-    setpwent();
-    struct passwd *p;
-    int count = 0;
-    
-    while ((p = getpwent()) != NULL && count < MAX_USERS) {
-        if (p->pw_uid >= 1000 && strcmp(p->pw_name, "nobody") != 0) {
-            strcpy(users[count].username, p->pw_name);
-            if (p->pw_gecos && *p->pw_gecos) {
-                strncpy(users[count].display_name, p->pw_gecos, 63);
-            } else {
-                strncpy(users[count].display_name, p->pw_name, 63);
-            }
-            users[count].display_name[63] = '\0';
-            users[count].uid = p->pw_uid;
-            users[count].selected = 0;
-            count++;
+fail:
+    for (int i = 0; i < num_msg; i++) {
+        if (response[i].resp) {
+            explicit_bzero(response[i].resp, strlen(response[i].resp));
+            free(response[i].resp);
         }
     }
-    endpwent();
-    return count;
+    free(response);
+    return PAM_CONV_ERR;
 }
 
-int get_sessions(Session *sessions) {
-    int count = 0;
-    
-    if (access("/usr/bin/gnome-session", F_OK) == 0) {
-        strcpy(sessions[count].name, "GNOME");
-        strcpy(sessions[count].exec, "gnome-session");
-        count++;
-    }
-    
-    if (access("/usr/bin/startplasma-x11", F_OK) == 0) {
-        strcpy(sessions[count].name, "KDE Plasma");
-        strcpy(sessions[count].exec, "startplasma-x11");
-        count++;
+// ---------------------------------------------------------------------------
+// Каталог пользователей: отсортированное по имени хранилище без верхнего предела,
+// префиксный индекс по имени и GECOS и порционное перечисление getpwent,
+// чтобы большие LDAP/SSSD каталоги не блокировали интерфейс.
+// ---------------------------------------------------------------------------
+
+void user_directory_free(UserDirectory *dir) {
+    free(dir->users);
+    free(dir->index);
+    memset(dir, 0, sizeof(UserDirectory));
+}
+
+static int user_directory_add(UserDirectory *dir, const struct passwd *p) {
+    if (dir->count == dir->capacity) {
+        int capacity = dir->capacity ? dir->capacity * 2 : 64;
+        User *users = realloc(dir->users, capacity * sizeof(User));
+        if (!users) {
+            return 0;
+        }
+        dir->users = users;
+        dir->capacity = capacity;
     }
-    else if (access("/usr/bin/startkde", F_OK) == 0) {
-        strcpy(sessions[count].name, "KDE");
-        strcpy(sessions[count].exec, "startkde");
-        count++;
+
+    User *user = &dir->users[dir->count++];
+    snprintf(user->username, sizeof(user->username), "%s", p->pw_name);
+    // Из GECOS берём только полное имя - до первой запятой
+    if (p->pw_gecos && *p->pw_gecos && *p->pw_gecos != ',') {
+        snprintf(user->display_name, sizeof(user->display_name), "%.*s",
+                 (int)strcspn(p->pw_gecos, ","), p->pw_gecos);
+    } else {
+        snprintf(user->display_name, sizeof(user->display_name), "%s", p->pw_name);
     }
-    
-    if (access("/usr/bin/startxfce4", F_OK) == 0) {
-        strcpy(sessions[count].name, "XFCE");
-        strcpy(sessions[count].exec, "startxfce4");
-        count++;
+    user->uid = p->pw_uid;
+    return 1;
+}
+
+static int compare_users(const void *a, const void *b) {
+    return strcmp(((const User*)a)->username, ((const User*)b)->username);
+}
+
+static int compare_index_entries(const void *a, const void *b) {
+    return strcmp(((const UserIndexEntry*)a)->key, ((const UserIndexEntry*)b)->key);
+}
+
+static void lowercase_copy(char *dst, const char *src, size_t size) {
+    size_t i = 0;
+    for (; src[i] && i < size - 1; i++) {
+        dst[i] = tolower((unsigned char)src[i]);
     }
-    
-    if (access("/usr/bin/startlxde", F_OK) == 0) {
-        strcpy(sessions[count].name, "LXDE");
-        strcpy(sessions[count].exec, "startlxde");
-        count++;
+    dst[i] = '\0';
+}
+
+// Сортировка и перестройка префиксного индекса после очередной порции
+static void user_directory_rebuild(UserDirectory *dir) {
+    qsort(dir->users, dir->count, sizeof(User), compare_users);
+
+    // Дубликаты (одна запись из files и из LDAP) оставляем в одном экземпляре
+    int unique = 0;
+    for (int i = 0; i < dir->count; i++) {
+        if (unique == 0 || strcmp(dir->users[unique - 1].username, dir->users[i].username) != 0) {
+            dir->users[unique++] = dir->users[i];
+        }
     }
-    
-    if (access("/usr/bin/startlxqt", F_OK) == 0) {
-        strcpy(sessions[count].name, "LXQt");
-        strcpy(sessions[count].exec, "startlxqt");
-        count++;
+    dir->count = unique;
+
+    UserIndexEntry *index = realloc(dir->index, (size_t)dir->count * 2 * sizeof(UserIndexEntry) + 1);
+    if (!index) {
+        dir->index_count = 0;
+        return;
     }
-    
-    if (access("/usr/bin/mate-session", F_OK) == 0) {
-        strcpy(sessions[count].name, "MATE");
-        strcpy(sessions[count].exec, "mate-session");
-        count++;
+    dir->index = index;
+    dir->index_count = 0;
+    for (int i = 0; i < dir->count; i++) {
+        lowercase_copy(index[dir->index_count].key, dir->users[i].username, sizeof(index->key));
+        index[dir->index_count++].user = i;
+        if (strcmp(dir->users[i].display_name, dir->users[i].username) != 0) {
+            lowercase_copy(index[dir->index_count].key, dir->users[i].display_name, sizeof(index->key));
+            index[dir->index_count++].user = i;
+        }
     }
-    
-    if (access("/usr/bin/cinnamon-session", F_OK) == 0) {
-        strcpy(sessions[count].name, "Cinnamon");
-        strcpy(sessions[count].exec, "cinnamon-session");
-        count++;
+    qsort(index, dir->index_count, sizeof(UserIndexEntry), compare_index_entries);
+}
+
+void user_directory_begin(UserDirectory *dir) {
+    setpwent();
+    dir->loading = 1;
+}
+
+// Читает не больше budget записей; возвращает 1, если каталог изменился
+int user_directory_step(UserDirectory *dir, int budget) {
+    if (!dir->loading) {
+        return 0;
     }
-    
-    if (access("/usr/bin/enlightenment_start", F_OK) == 0) {
-        strcpy(sessions[count].name, "Enlightenment");
-        strcpy(sessions[count].exec, "enlightenment_start");
-        count++;
+
+    struct timespec start;
+    stats_begin(&start);
+    struct passwd *p;
+    int added = 0;
+    while (budget-- > 0) {
+        p = getpwent();
+        if (!p) {
+            endpwent();
+            dir->loading = 0;
+            break;
+        }
+        if (p->pw_uid >= 1000 && strcmp(p->pw_name, "nobody") != 0) {
+            added += user_directory_add(dir, p);
+        }
     }
-    
-    if (access("/usr/bin/i3", F_OK) == 0) {
-        strcpy(sessions[count].name, "i3");
-        strcpy(sessions[count].exec, "i3");
-        count++;
+
+    if (added || !dir->loading) {
+        user_directory_rebuild(dir);
     }
-    
-    if (access("/usr/bin/sway", F_OK) == 0) {
-        strcpy(sessions[count].name, "Sway");
-        strcpy(sessions[count].exec, "sway");
-        count++;
+    stats_end(STAT_GET_USERS, &start);
+    return added > 0 || !dir->loading;
+}
+
+int user_directory_find(const UserDirectory *dir, const char *username) {
+    int lo = 0, hi = dir->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(dir->users[mid].username, username);
+        if (cmp == 0) {
+            return mid;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
     }
-    
-    if (access("/usr/bin/openbox-session", F_OK) == 0) {
-        strcpy(sessions[count].name, "Openbox");
-        strcpy(sessions[count].exec, "openbox-session");
-        count++;
+    return -1;
+}
+
+static int compare_ints(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+// Пользователи, у которых имя или GECOS начинается с prefix (без учёта регистра).
+// Результат - индексы в каталоге по возрастанию, без повторов
+int user_directory_search(const UserDirectory *dir, const char *prefix, int *out) {
+    char key[sizeof(((UserIndexEntry*)0)->key)];
+    lowercase_copy(key, prefix, sizeof(key));
+    size_t len = strlen(key);
+
+    // Нижняя граница диапазона с нужным префиксом
+    int lo = 0, hi = dir->index_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strncmp(dir->index[mid].key, key, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    
-    if (access("/usr/bin/awesome", F_OK) == 0) {
-        strcpy(sessions[count].name, "Awesome");
-        strcpy(sessions[count].exec, "awesome");
-        count++;
+
+    int count = 0;
+    for (int i = lo; i < dir->index_count && strncmp(dir->index[i].key, key, len) == 0; i++) {
+        out[count++] = dir->index[i].user;
+    }
+    qsort(out, count, sizeof(int), compare_ints);
+
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || out[unique - 1] != out[i]) {
+            out[unique++] = out[i];
+        }
+    }
+    return unique;
+}
+
+// ---------------------------------------------------------------------------
+// Сессии из XDG .desktop файлов (xsessions) с бинарным кешем.
+// Кеш действителен, пока не изменились mtime каталогов: пакетные менеджеры
+// добавляют, удаляют и заменяют файлы через rename, что меняет mtime каталога.
+// ---------------------------------------------------------------------------
+
+static const char *session_dirs[] = {
+    "/usr/local/share/xsessions",
+    "/usr/share/xsessions",
+};
+#define SESSION_DIR_COUNT (int)(sizeof(session_dirs) / sizeof(session_dirs[0]))
+
+// Есть ли исполняемый файл в PATH (для TryExec)
+static int program_exists(const char *program) {
+    if (strchr(program, '/')) {
+        return access(program, X_OK) == 0;
+    }
+
+    const char *path = getenv("PATH");
+    if (!path || !*path) {
+        path = "/usr/local/bin:/usr/bin:/bin";
+    }
+    while (*path) {
+        size_t len = strcspn(path, ":");
+        char candidate[PATH_MAX];
+        if (len > 0 && snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)len, path, program) < (int)sizeof(candidate) &&
+            access(candidate, X_OK) == 0) {
+            return 1;
+        }
+        path += len;
+        if (*path == ':') {
+            path++;
+        }
+    }
+    return 0;
+}
+
+// Убираем коды полей (%f, %U и т.п.) из Exec, "%%" превращаем в "%"
+static void strip_field_codes(char *exec) {
+    char *dst = exec;
+    for (char *src = exec; *src; src++) {
+        if (*src == '%' && src[1]) {
+            if (src[1] == '%') {
+                *dst++ = '%';
+            }
+            src++;
+            continue;
+        }
+        *dst++ = *src;
+    }
+    *dst = '\0';
+    while (dst > exec && isspace((unsigned char)dst[-1])) {
+        *--dst = '\0';
+    }
+}
+
+// Разбор одного файла; возвращает 1, если сессию нужно показывать
+int parse_session_file(const char *path, const char *id, Session *session) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    memset(session, 0, sizeof(Session));
+    snprintf(session->id, sizeof(session->id), "%s", id);
+
+    char line[1024];
+    char try_exec[256] = "";
+    int in_entry = 0, hidden = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '[') {
+            in_entry = strcmp(line, "[Desktop Entry]") == 0;
+            continue;
+        }
+        if (!in_entry || line[0] == '#') {
+            continue;
+        }
+
+        char *eq = strchr(line, '=');
+        if (!eq) {
+            continue;
+        }
+        char *key_end = eq;
+        while (key_end > line && isspace((unsigned char)key_end[-1])) {
+            key_end--;
+        }
+        *key_end = '\0';
+        char *value = eq + 1;
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+
+        if (strcmp(line, "Name") == 0) {
+            snprintf(session->name, sizeof(session->name), "%s", value);
+        } else if (strcmp(line, "Exec") == 0) {
+            snprintf(session->exec, sizeof(session->exec), "%s", value);
+            strip_field_codes(session->exec);
+        } else if (strcmp(line, "TryExec") == 0) {
+            snprintf(try_exec, sizeof(try_exec), "%s", value);
+        } else if (strcmp(line, "DesktopNames") == 0) {
+            // В файле разделитель ';', в XDG_CURRENT_DESKTOP - ':'
+            snprintf(session->desktop_names, sizeof(session->desktop_names), "%s", value);
+            size_t len = strlen(session->desktop_names);
+            if (len > 0 && session->desktop_names[len - 1] == ';') {
+                session->desktop_names[len - 1] = '\0';
+            }
+            for (char *c = session->desktop_names; *c; c++) {
+                if (*c == ';') {
+                    *c = ':';
+                }
+            }
+        } else if (strcmp(line, "Hidden") == 0 || strcmp(line, "NoDisplay") == 0) {
+            hidden |= strcmp(value, "true") == 0;
+        }
+    }
+    fclose(fp);
+
+    if (hidden || !session->exec[0] || (try_exec[0] && !program_exists(try_exec))) {
+        return 0;
+    }
+    if (!session->name[0]) {
+        snprintf(session->name, sizeof(session->name), "%s", id);
+    }
+    return 1;
+}
+
+typedef struct {
+    char path[PATH_MAX];
+    char id[64];
+    Session session;
+    int valid;
+} SessionFile;
+
+typedef struct {
+    SessionFile *files;
+    int start;
+    int end;
+} SessionParseJob;
+
+static void *session_parse_worker(void *arg) {
+    SessionParseJob *job = arg;
+    for (int i = job->start; i < job->end; i++) {
+        job->files[i].valid = parse_session_file(job->files[i].path, job->files[i].id, &job->files[i].session);
+    }
+    return NULL;
+}
+
+static int compare_sessions(const void *a, const void *b) {
+    return strcasecmp(((const Session*)a)->name, ((const Session*)b)->name);
+}
+
+static void session_dir_mtimes(struct timespec *mtimes) {
+    for (int i = 0; i < SESSION_DIR_COUNT; i++) {
+        struct stat st;
+        if (stat(session_dirs[i], &st) == 0) {
+            mtimes[i] = st.st_mtim;
+        } else {
+            mtimes[i].tv_sec = 0;
+            mtimes[i].tv_nsec = 0;
+        }
+    }
+}
+
+// Холодный путь: обходим каталоги и разбираем файлы параллельно
+static int scan_sessions(Session **sessions) {
+    SessionFile *files = NULL;
+    int file_count = 0, file_capacity = 0;
+
+    for (int d = 0; d < SESSION_DIR_COUNT; d++) {
+        DIR *dir = opendir(session_dirs[d]);
+        if (!dir) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (len <= 8 || strcmp(entry->d_name + len - 8, ".desktop") != 0 || len - 8 >= sizeof(files->id)) {
+                continue;
+            }
+
+            // Одинаковый id в нескольких каталогах: побеждает более приоритетный (первый)
+            int duplicate = 0;
+            for (int i = 0; i < file_count && !duplicate; i++) {
+                duplicate = strncmp(files[i].id, entry->d_name, len - 8) == 0 && files[i].id[len - 8] == '\0';
+            }
+            if (duplicate) {
+                continue;
+            }
+
+            if (file_count == file_capacity) {
+                // Ёмкость меняем только после удачного realloc: иначе следующий
+                // каталог писал бы за конец files
+                int capacity = file_capacity ? file_capacity * 2 : 16;
+                SessionFile *grown = realloc(files, capacity * sizeof(SessionFile));
+                if (!grown) {
+                    break;
+                }
+                files = grown;
+                file_capacity = capacity;
+            }
+            SessionFile *file = &files[file_count++];
+            snprintf(file->path, sizeof(file->path), "%s/%s", session_dirs[d], entry->d_name);
+            snprintf(file->id, sizeof(file->id), "%.*s", (int)(len - 8), entry->d_name);
+            file->valid = 0;
+        }
+        closedir(dir);
+    }
+
+    int threads = file_count / SESSION_FILES_PER_THREAD;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > cpus) threads = cpus;
+    if (threads > MAX_SESSION_THREADS) threads = MAX_SESSION_THREADS;
+    if (threads < 1) threads = 1;
+
+    pthread_t workers[MAX_SESSION_THREADS];
+    SessionParseJob jobs[MAX_SESSION_THREADS];
+    int started = 0;
+    for (int t = 0; t < threads; t++) {
+        jobs[t].files = files;
+        jobs[t].start = file_count * t / threads;
+        jobs[t].end = file_count * (t + 1) / threads;
+        if (t > 0 && pthread_create(&workers[t], NULL, session_parse_worker, &jobs[t]) == 0) {
+            started |= 1 << t;
+        } else if (t > 0) {
+            session_parse_worker(&jobs[t]);
+        }
+    }
+    if (threads > 0) {
+        session_parse_worker(&jobs[0]);
+    }
+    for (int t = 1; t < threads; t++) {
+        if (started & (1 << t)) {
+            pthread_join(workers[t], NULL);
+        }
+    }
+
+    int count = 0;
+    Session *result = malloc((file_count + 1) * sizeof(Session));
+    if (result) {
+        for (int i = 0; i < file_count; i++) {
+            if (files[i].valid) {
+                result[count++] = files[i].session;
+            }
+        }
+        qsort(result, count, sizeof(Session), compare_sessions);
+    }
+    free(files);
+
+    *sessions = result;
+    return result ? count : 0;
+}
+
+static int write_cache_string(FILE *fp, const char *str) {
+    uint16_t len = strlen(str);
+    return fwrite(&len, sizeof(len), 1, fp) == 1 && fwrite(str, 1, len, fp) == len;
+}
+
+static int read_cache_string(FILE *fp, char *str, size_t size) {
+    uint16_t len;
+    if (fread(&len, sizeof(len), 1, fp) != 1 || len >= size || fread(str, 1, len, fp) != len) {
+        return 0;
+    }
+    str[len] = '\0';
+    return 1;
+}
+
+// Тёплый путь: кеш совпадает с mtime каталогов - разбор файлов не нужен
+static int load_session_cache(const struct timespec *mtimes, Session **sessions) {
+    FILE *fp = fopen(SESSION_CACHE_PATH, "rb");
+    if (!fp) {
+        return -1;
+    }
+
+    char magic[sizeof(SESSION_CACHE_MAGIC)];
+    struct timespec cached[SESSION_DIR_COUNT];
+    uint32_t count;
+    if (fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, SESSION_CACHE_MAGIC, sizeof(magic)) != 0 ||
+        fread(cached, sizeof(cached), 1, fp) != 1 || memcmp(cached, mtimes, sizeof(cached)) != 0 ||
+        fread(&count, sizeof(count), 1, fp) != 1 || count > 4096) {
+        fclose(fp);
+        return -1;
+    }
+
+    Session *result = calloc(count + 1, sizeof(Session));
+    if (!result) {
+        fclose(fp);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        Session *s = &result[i];
+        if (!read_cache_string(fp, s->id, sizeof(s->id)) || !read_cache_string(fp, s->name, sizeof(s->name)) ||
+            !read_cache_string(fp, s->exec, sizeof(s->exec)) ||
+            !read_cache_string(fp, s->desktop_names, sizeof(s->desktop_names))) {
+            free(result);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+
+    *sessions = result;
+    return count;
+}
+
+static void save_session_cache(const struct timespec *mtimes, const Session *sessions, int count) {
+    mkdir(CACHE_DIR, 0755);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", SESSION_CACHE_PATH, getpid());
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        return;
     }
+
+    uint32_t count32 = count;
+    int ok = fwrite(SESSION_CACHE_MAGIC, sizeof(SESSION_CACHE_MAGIC), 1, fp) == 1 &&
+             fwrite(mtimes, sizeof(struct timespec) * SESSION_DIR_COUNT, 1, fp) == 1 &&
+             fwrite(&count32, sizeof(count32), 1, fp) == 1;
+    for (int i = 0; ok && i < count; i++) {
+        ok = write_cache_string(fp, sessions[i].id) && write_cache_string(fp, sessions[i].name) &&
+             write_cache_string(fp, sessions[i].exec) && write_cache_string(fp, sessions[i].desktop_names);
+    }
+
+    // Запись через временный файл и rename - кеш никогда не бывает недописанным
+    if (fclose(fp) != 0 || !ok || rename(tmp_path, SESSION_CACHE_PATH) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+int get_sessions(Session **sessions) {
+    struct timespec start;
+    stats_begin(&start);
+
+    struct timespec mtimes[SESSION_DIR_COUNT];
+    session_dir_mtimes(mtimes);
+
+    int count = load_session_cache(mtimes, sessions);
+    if (count >= 0) {
+        stats_end(STAT_GET_SESSIONS, &start);
+        return count;
+    }
+
+    count = scan_sessions(sessions);
     
-    if (count == 0 && access("/usr/bin/xterm", F_OK) == 0) {
-        strcpy(sessions[count].name, "XTerm");
-        strcpy(sessions[count].exec, "xterm");
+    if (count == 0 && *sessions && program_exists("xterm")) {
+        strcpy((*sessions)[count].id, "xterm");
+        strcpy((*sessions)[count].name, "XTerm");
+        strcpy((*sessions)[count].exec, "xterm");
         count++;
     }
-    
+
+    if (*sessions) {
+        save_session_cache(mtimes, *sessions, count);
+    }
+    stats_end(STAT_GET_SESSIONS, &start);
     return count;
 }
 
-int authenticate(const char *username, const char *password) {
+// После входа диалог идёт без интерфейса: сообщения модулей сессии только в журнал
+static int session_conversation(int num_msg, const struct pam_message **msg,
+                                struct pam_response **resp, void *appdata_ptr) {
+    for (int i = 0; i < num_msg; i++) {
+        if (msg[i]->msg_style != PAM_ERROR_MSG && msg[i]->msg_style != PAM_TEXT_INFO) {
+            return PAM_CONV_ERR;
+        }
+        fprintf(stderr, "PAM: %s\n", msg[i]->msg);
+    }
+    *resp = NULL;
+    return PAM_SUCCESS;
+}
+
+// При успехе дескриптор PAM не закрывается: по нему открывается сессия
+int authenticate(AuthRequest *req, pam_handle_t **handle) {
     pam_handle_t *pamh = NULL;
     int retval;
     struct pam_conv conv = {
         .conv = conversation,
-        .appdata_ptr = (void*)password
+        .appdata_ptr = req
     };
     
-    retval = pam_start("login", username, &conv, &pamh);
+    retval = pam_start(options.pam_service, req->username, &conv, &pamh);
     if (retval != PAM_SUCCESS) {
         return 0;
     }
@@ -253,82 +1545,190 @@ int authenticate(const char *username, const char *password) {
         return 0;
     }
     
-    pam_end(pamh, PAM_SUCCESS);
+    // Дальше канал только замеряет exec: модули сессии пишут в журнал
+    static const struct pam_conv session_conv = { .conv = session_conversation };
+    pam_set_item(pamh, PAM_CONV, &session_conv);
+    *handle = pamh;
     return 1;
 }
 
-pid_t start_dbus_session() {
-    char dbus_dir[256];
-    snprintf(dbus_dir, sizeof(dbus_dir), "/tmp/dbus-%d", getpid());
-    mkdir(dbus_dir, 0700);
-    
-    pid_t pid = fork();
-    if (pid == 0) {
-        char *args[] = {
-            "dbus-daemon",
-            "--session",
-            "--address=unix:path=/tmp/dbus-session",
-            "--nofork",
-            "--print-address=1",
-            NULL
-        };
-        
-        int fd = open("/tmp/dbus-address", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-        
-        execvp("dbus-daemon", args);
-        perror("Failed to start DBus");
-        exit(1);
+// Автовход: пароль не спрашивается, но pam_acct_mgmt проверяет учётную запись
+int autologin_account(const char *username, pam_handle_t **handle) {
+    static const struct pam_conv conv = { .conv = session_conversation };
+    pam_handle_t *pamh = NULL;
+    int retval = pam_start(options.pam_service, username, &conv, &pamh);
+    if (retval != PAM_SUCCESS) {
+        fprintf(stderr, "Autologin: pam_start failed\n");
+        return 0;
     }
-    return pid;
+    retval = pam_acct_mgmt(pamh, 0);
+    if (retval != PAM_SUCCESS) {
+        fprintf(stderr, "Autologin: account %s rejected: %s\n", username, pam_strerror(pamh, retval));
+        pam_end(pamh, retval);
+        return 0;
+    }
+    *handle = pamh;
+    return 1;
 }
 
-int get_dbus_address(char *address, size_t size) {
-    FILE *fp = fopen("/tmp/dbus-address", "r");
-    if (!fp) {
+// Запись .Xauthority для cookie удалённого X. FamilyWild с пустым адресом подходит
+// к дисплею с этим номером на любом адресе - имя хоста терминала разрешать не нужно.
+// Вызывается уже с правами пользователя: файл создаётся заново под временным именем
+// (O_EXCL, без следования ссылкам) и переименовывается на место
+#define XAUTH_NUMBER_MAX 15
+
+static int write_xauthority(const char *path, const char *display, const unsigned char *cookie) {
+    const char *number = strrchr(display, ':');
+    number = number ? number + 1 : "0";
+    size_t number_len = strcspn(number, ".");
+    if (number_len == 0 || number_len > XAUTH_NUMBER_MAX) {
+        errno = EINVAL;
         return 0;
     }
-    
-    if (fgets(address, size, fp)) {
-        address[strcspn(address, "\n")] = '\0';
-        fclose(fp);
-        return 1;
+    uint8_t record[4 + 2 + XAUTH_NUMBER_MAX + 2 + sizeof(XDMCP_COOKIE_NAME) - 1 + 2 + XDMCP_COOKIE_SIZE];
+    size_t n = 0;
+    record[n++] = 0xFF;
+    record[n++] = 0xFF;
+    record[n++] = 0;
+    record[n++] = 0;
+    record[n++] = 0;
+    record[n++] = number_len;
+    memcpy(record + n, number, number_len);
+    n += number_len;
+    record[n++] = 0;
+    record[n++] = sizeof(XDMCP_COOKIE_NAME) - 1;
+    memcpy(record + n, XDMCP_COOKIE_NAME, sizeof(XDMCP_COOKIE_NAME) - 1);
+    n += sizeof(XDMCP_COOKIE_NAME) - 1;
+    record[n++] = 0;
+    record[n++] = XDMCP_COOKIE_SIZE;
+    memcpy(record + n, cookie, XDMCP_COOKIE_SIZE);
+    n += XDMCP_COOKIE_SIZE;
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= (int)sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return 0;
     }
-    
-    fclose(fp);
-    return 0;
+    int fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = write(fd, record, n) == (ssize_t)n;
+    ok = close(fd) == 0 && ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+// Сообщение приветствию о том, что сессия не дошла до exec (см. session_exec_done)
+static void session_report_failure(int fd, int err) {
+    if (fd >= 0 && write(fd, &err, sizeof(err)) != sizeof(err)) {
+        perror("session report");
+    }
+}
+
+// Exec из .desktop в argv без оболочки: кавычки и экранирование по спецификации Desktop Entry,
+// коды полей уже убраны при чтении. Строки живут в buffer
+static int session_argv(const char *exec, char *buffer, size_t size, char **argv, int max_args) {
+    int argc = 0;
+    char *dst = buffer, *end = buffer + size - 1;
+    const char *src = exec;
+    while (*src && argc < max_args - 1) {
+        while (isspace((unsigned char)*src)) {
+            src++;
+        }
+        if (!*src) {
+            break;
+        }
+        argv[argc++] = dst;
+        int quoted = 0;
+        while (*src && (quoted || !isspace((unsigned char)*src)) && dst < end) {
+            if (*src == '"') {
+                quoted = !quoted;
+                src++;
+            } else if (*src == '\\' && src[1]) {
+                *dst++ = src[1];
+                src += 2;
+            } else {
+                *dst++ = *src++;
+            }
+        }
+        *dst++ = '\0';
+        if (dst > end) {
+            break;
+        }
+    }
+    argv[argc] = NULL;
+    return argc;
 }
 
-void start_session(const char *username, const char *session_exec) {
+// Процесс сессии: окружение собирается заново из PAM (pam_env, pam_systemd) и
+// метаданных .desktop, бинарник сессии запускается напрямую. Профили оболочки
+// подгружаются только с session_profile = 1 в конфиге
+void start_session(pam_handle_t *pamh, const char *username, const Session *session, const SessionTarget *target) {
     struct passwd *pwd = getpwnam(username);
     if (!pwd) {
+        session_report_failure(target->exec_fd, ENOENT);
         return;
     }
-    
-    // Устанавливаем базовые переменные окружения
+
+    // Окружение менеджера сессии не достаётся: только язык, если PAM его не задал
+    char lang[64];
+    const char *own_lang = getenv("LANG");
+    snprintf(lang, sizeof(lang), "%s", own_lang ? own_lang : "");
+    clearenv();
     setenv("HOME", pwd->pw_dir, 1);
     setenv("SHELL", pwd->pw_shell, 1);
     setenv("USER", pwd->pw_name, 1);
     setenv("LOGNAME", pwd->pw_name, 1);
-    setenv("DISPLAY", ":0", 1);
-    
-    // DBus и systemd переменные
+    setenv("PATH", "/usr/local/bin:/usr/bin:/bin", 1);
+    if (lang[0]) {
+        setenv("LANG", lang, 1);
+    }
+
+    // Всё, что выставили модули и session_run (XDG_SESSION_ID, XDG_SEAT, XDG_VTNR, PATH из
+    // pam_env...), поверх базовых; строки списка переходят окружению
+    char **pam_env = pam_getenvlist(pamh);
+    if (pam_env) {
+        for (char **entry = pam_env; *entry; entry++) {
+            putenv(*entry);
+        }
+        free(pam_env);
+    }
+    setenv("DISPLAY", target->display, 1);
+
+    // Каталог выдаёт logind (pam_systemd); без logind создаём его сами
     char runtime_dir[256];
-    snprintf(runtime_dir, sizeof(runtime_dir), "/run/user/%d", pwd->pw_uid);
-    mkdir(runtime_dir, 0777);
+    const char *pam_runtime_dir = pam_getenv(pamh, "XDG_RUNTIME_DIR");
+    if (pam_runtime_dir) {
+        snprintf(runtime_dir, sizeof(runtime_dir), "%s", pam_runtime_dir);
+    } else {
+        snprintf(runtime_dir, sizeof(runtime_dir), "/run/user/%d", pwd->pw_uid);
+        if (mkdir(runtime_dir, 0700) == 0 && chown(runtime_dir, pwd->pw_uid, pwd->pw_gid) != 0) {
+            perror("chown runtime dir");
+        }
+    }
     
     // Важные переменные для X11 и DBus
     setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
-    setenv("XDG_SESSION_TYPE", "x11", 1);
-    setenv("XDG_CURRENT_DESKTOP", "i3", 1);
-    setenv("XDG_SESSION_CLASS", "user", 1);
-    setenv("XDG_SESSION_DESKTOP", "i3", 1);
+    // Имя рабочего стола берём из DesktopNames сессии, иначе из имени .desktop файла
+    setenv("XDG_CURRENT_DESKTOP", session->desktop_names[0] ? session->desktop_names : session->id, 1);
     
-    // DBus адрес
-    char dbus_addr[256];
-    snprintf(dbus_addr, sizeof(dbus_addr), "unix:path=%s/bus", runtime_dir);
-    setenv("DBUS_SESSION_BUS_ADDRESS", dbus_addr, 1);
+    // Шину пользователя поднимает user@.service; без неё запускаем свою на время сессии
+    char dbus_addr[300];
+    const char *pam_bus = pam_getenv(pamh, "DBUS_SESSION_BUS_ADDRESS");
+    struct stat bus_stat;
+    int private_bus = 0;
+    snprintf(dbus_addr, sizeof(dbus_addr), "%s/bus", runtime_dir);
+    if (pam_bus) {
+        setenv("DBUS_SESSION_BUS_ADDRESS", pam_bus, 1);
+    } else if (stat(dbus_addr, &bus_stat) == 0 && S_ISSOCK(bus_stat.st_mode)) {
+        snprintf(dbus_addr, sizeof(dbus_addr), "unix:path=%s/bus", runtime_dir);
+        setenv("DBUS_SESSION_BUS_ADDRESS", dbus_addr, 1);
+    } else {
+        private_bus = program_exists("dbus-run-session");
+    }
     
     // PulseAudio
     char pulse_dir[256];
@@ -336,617 +1736,6189 @@ void start_session(const char *username, const char *session_exec) {
     mkdir(pulse_dir, 0700);
     setenv("PULSE_RUNTIME_PATH", pulse_dir, 1);
     
-    // Wayland переменные (на всякий случай)
-    unsetenv("WAYLAND_DISPLAY");
-    unsetenv("QT_QPA_PLATFORM");
     setenv("QT_QPA_PLATFORM", "xcb", 1);
     
-    // Меняем группы и пользователя
+    // Группы (вместе с добавленными pam_setcred) уже выставил лидер сессии
     if (setgid(pwd->pw_gid) != 0) {
         perror("setgid failed");
-        exit(1);
-    }
-    
-    if (initgroups(pwd->pw_name, pwd->pw_gid) != 0) {
-        perror("initgroups failed");
+        session_report_failure(target->exec_fd, errno);
         exit(1);
     }
     
     if (setuid(pwd->pw_uid) != 0) {
         perror("setuid failed");
+        session_report_failure(target->exec_fd, errno);
         exit(1);
     }
-    
-    // Запускаем сессию через login shell чтобы подгрузить все профили
-    char *args[] = {
-        pwd->pw_shell,
-        "-l",
-        "-c",
-        "export DBUS_SESSION_BUS_ADDRESS && export PULSE_RUNTIME_PATH && export XDG_RUNTIME_DIR && exec $0",
-        (char*)session_exec,
-        NULL
-    };
-    
-    execvp(pwd->pw_shell, args);
+
+    if (chdir(pwd->pw_dir) != 0 && chdir("/") != 0) {
+        perror("chdir");
+    }
+
+    // Удалённому X нужен тот же cookie, что терминал получил в Accept. Пишем уже
+    // пользователем: каталог его, и подложенная им ссылка или FIFO root не заденет
+    if (target->cookie) {
+        char xauthority[300];
+        snprintf(xauthority, sizeof(xauthority), "%s/miayDE.Xauthority", runtime_dir);
+        if (write_xauthority(xauthority, target->display, target->cookie)) {
+            setenv("XAUTHORITY", xauthority, 1);
+        } else {
+            perror("Xauthority");
+        }
+    }
+
+    // argv: [оболочка -l -c 'exec "$@"' miayDE-session] [dbus-run-session --] Exec...
+    enum { SESSION_MAX_ARGS = 40 };
+    char exec_buffer[sizeof(session->exec)];
+    char *args[SESSION_MAX_ARGS + 8];
+    int argc = 0;
+    if (config.session_profile) {
+        args[argc++] = pwd->pw_shell;
+        args[argc++] = "-l";
+        args[argc++] = "-c";
+        args[argc++] = "exec \"$@\"";
+        args[argc++] = "miayDE-session";
+    }
+    if (private_bus) {
+        args[argc++] = "dbus-run-session";
+        args[argc++] = "--";
+    }
+    if (session_argv(session->exec, exec_buffer, sizeof(exec_buffer), args + argc, SESSION_MAX_ARGS) == 0) {
+        fprintf(stderr, "Session %s has an empty Exec\n", session->id);
+        session_report_failure(target->exec_fd, ENOEXEC);
+        exit(1);
+    }
+
+    execvp(args[0], args);
     perror("Failed to start session");
+    session_report_failure(target->exec_fd, errno);
     exit(1);
 }
 
-pid_t start_x_server() {
+// Запускает X с -displayfd: номер дисплея сервер напишет в трубу, когда будет готов принимать клиентов.
+// seat0 получает :0 и vt1, остальные места - свободный номер, который выберет сам сервер, и -seat
+pid_t start_x_server(const char *seat, int vt, int *ready_fd) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+
     pid_t pid = fork();
     if (pid == 0) {
-        setenv("DISPLAY", ":0", 1);
-        
-        char *args[] = {
-            "X",
-            ":0",
-            "-ac",
-            "-nolisten", "tcp",
-            "-background", "none",
-            "-noreset",
-            "vt1",
-            NULL
-        };
+        child_reset_signals();
+        // Пишущий конец должен пережить exec
+        fcntl(fds[1], F_SETFD, 0);
+        char displayfd[16];
+        snprintf(displayfd, sizeof(displayfd), "%d", fds[1]);
+        char vt_arg[16];
+        snprintf(vt_arg, sizeof(vt_arg), "vt%d", vt);
+
+        char *args[16];
+        int n = 0;
+        args[n++] = "X";
+        if (vt > 0) {
+            setenv("DISPLAY", ":0", 1);
+            args[n++] = ":0";
+        }
+        args[n++] = "-displayfd";
+        args[n++] = displayfd;
+        args[n++] = "-ac";
+        args[n++] = "-nolisten";
+        args[n++] = "tcp";
+        args[n++] = "-background";
+        args[n++] = "none";
+        args[n++] = "-noreset";
+        if (seat[0] && strcmp(seat, "seat0") != 0) {
+            args[n++] = "-seat";
+            args[n++] = (char*)seat;
+        }
+        if (vt > 0) {
+            args[n++] = vt_arg;
+        }
+        args[n] = NULL;
         
         execvp("/usr/bin/X", args);
         perror("Failed to start X server");
-        exit(1);
+        _exit(1);
+    }
+
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    *ready_fd = fds[0];
+    return pid;
+}
+
+// Запасной вариант для серверов без -displayfd
+int wait_for_x_server(const char *display_name) {
+    int attempts = 0;
+    while (attempts < 50) {
+        Display *test_display = XOpenDisplay(display_name);
+        if (test_display) {
+            XCloseDisplay(test_display);
+            return 1;
+        }
+        usleep(100000);
+        attempts++;
+    }
+    return 0;
+}
+
+// Читает из трубы очередную порцию; возвращает 1, когда получена целая строка, -1 при EOF/ошибке
+static int read_ready_line(int fd, char *buf, size_t size, size_t *len) {
+    ssize_t n = read(fd, buf + *len, size - 1 - *len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    *len += n;
+    buf[*len] = '\0';
+    if (strchr(buf, '\n') || *len == size - 1) {
+        buf[strcspn(buf, "\n")] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+static int rects_touch(const Rect *a, const Rect *b) {
+    return a->x <= b->x + b->width && b->x <= a->x + a->width &&
+           a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+static void rect_union(Rect *a, const Rect *b) {
+    int x2 = a->x + a->width > b->x + b->width ? a->x + a->width : b->x + b->width;
+    int y2 = a->y + a->height > b->y + b->height ? a->y + a->height : b->y + b->height;
+    a->x = a->x < b->x ? a->x : b->x;
+    a->y = a->y < b->y ? a->y : b->y;
+    a->width = x2 - a->x;
+    a->height = y2 - a->y;
+}
+
+// Помечаем область для перерисовки (пересекающиеся области сливаются)
+void mark_dirty(DisplayManager *dm, int x, int y, int width, int height) {
+    DamageRegion *damage = &dm->damage;
+
+    if (x < 0) { width += x; x = 0; }
+    if (y < 0) { height += y; y = 0; }
+    if (x + width > dm->width) width = dm->width - x;
+    if (y + height > dm->height) height = dm->height - y;
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    Rect r = { x, y, width, height };
+    for (int i = 0; i < damage->count; i++) {
+        if (rects_touch(&damage->rects[i], &r)) {
+            rect_union(&r, &damage->rects[i]);
+            damage->rects[i] = damage->rects[--damage->count];
+            i = -1;
+        }
+    }
+
+    if (damage->count == MAX_DIRTY_RECTS) {
+        // Переполнение - схлопываем всё в один охватывающий прямоугольник
+        for (int i = 0; i < damage->count; i++) {
+            rect_union(&r, &damage->rects[i]);
+        }
+        damage->count = 0;
+    }
+    damage->rects[damage->count++] = r;
+}
+
+void mark_all_dirty(DisplayManager *dm) {
+    dm->damage.count = 0;
+    mark_dirty(dm, 0, 0, dm->width, dm->height);
+}
+
+Rect cursor_rect(int x, int y) {
+    Rect r = { x - CURSOR_HOTSPOT, y - CURSOR_HOTSPOT, CURSOR_SIZE, CURSOR_SIZE };
+    return r;
+}
+
+void mark_rect_dirty(DisplayManager *dm, Rect r) {
+    mark_dirty(dm, r.x, r.y, r.width, r.height);
+}
+
+int point_in_rect(int x, int y, int rect_x, int rect_y, int width, int height) {
+    return (x >= rect_x && x <= rect_x + width && y >= rect_y && y <= rect_y + height);
+}
+
+// ---------------------------------------------------------------------------
+// Сцена: дерево виджетов с закешированной раскладкой. Вся геометрия задаётся
+// только в layout_scene(); отрисовка, попадание мышью и области повреждений
+// берут границы из узлов. Раскладка пересчитывается лишь после scene_invalidate()
+// (смена размера или структуры интерфейса), а разница со старой раскладкой
+// сама помечается для перерисовки.
+// ---------------------------------------------------------------------------
+
+int users_per_page(const DisplayManager *dm) {
+    const ThemeLayout *l = &plan.layout;
+    int page = (dm->height - l->card_top - 55) / (l->card_height + l->card_spacing);
+    return page > 0 ? page : 1;
+}
+
+void scene_free(Scene *scene) {
+    free(scene->widgets);
+    free(scene->previous);
+    free(scene->bvh);
+    free(scene->bvh_items);
+    memset(scene, 0, sizeof(Scene));
+}
+
+void scene_invalidate(DisplayManager *dm) {
+    dm->scene.valid = 0;
+}
+
+static int scene_add(Scene *scene, WidgetType type, int index, int parent, int interactive,
+                     int x, int y, int width, int height) {
+    if (scene->count == scene->capacity) {
+        int capacity = scene->capacity ? scene->capacity * 2 : 32;
+        Widget *widgets = realloc(scene->widgets, capacity * sizeof(Widget));
+        if (!widgets) {
+            return -1;
+        }
+        scene->widgets = widgets;
+        scene->capacity = capacity;
+    }
+    Widget *w = &scene->widgets[scene->count];
+    w->type = type;
+    w->index = index;
+    w->parent = parent;
+    w->interactive = interactive;
+    w->bounds.x = x;
+    w->bounds.y = y;
+    w->bounds.width = width;
+    w->bounds.height = height;
+    return scene->count++;
+}
+
+static int widget_key_compare(const Widget *a, const Widget *b) {
+    if (a->type != b->type) {
+        return a->type < b->type ? -1 : 1;
+    }
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+static int compare_widgets(const void *a, const void *b) {
+    return widget_key_compare(a, b);
+}
+
+// Единственное место, где задана геометрия интерфейса.
+// Узлы добавляются в порядке отрисовки, он же - порядок (тип, индекс)
+void avatar_request(DisplayManager *dm, const char *username);
+
+static void layout_scene(DisplayManager *dm) {
+    Scene *scene = &dm->scene;
+    const ThemeLayout *l = &plan.layout;
+    int cx = dm->width / 2;
+    int cy = dm->height / 2;
+    int card_x = l->list_x + 10, card_width = l->list_width - 20;
+    int panel_x = cx - l->panel_width / 2, field_width = l->panel_width - 40;
+    scene->count = 0;
+
+    int list = scene_add(scene, WIDGET_USER_LIST, 0, -1, 1, l->list_x, 50, l->list_width, dm->height - 50);
+    scene_add(scene, WIDGET_STATUS, 0, list, 0, card_x, 60, card_width, 35);
+
+    int page = users_per_page(dm);
+    int first_card = scene->count;
+    for (int slot = 0; slot < page && dm->first_visible + slot < dm->visible_count; slot++) {
+        avatar_request(dm, dm->users->users[dm->visible_users[dm->first_visible + slot]].username);
+        scene_add(scene, WIDGET_USER_CARD, dm->visible_users[dm->first_visible + slot], list, 1,
+                  card_x, l->card_top + slot * (l->card_height + l->card_spacing), card_width, l->card_height);
+    }
+    // Результаты поиска идут не по порядку каталога; карточки не перекрываются,
+    // так что сортировка по индексу порядок отрисовки не меняет
+    qsort(scene->widgets + first_card, scene->count - first_card, sizeof(Widget), compare_widgets);
+
+    if (dm->password_active) {
+        int panel = scene_add(scene, WIDGET_LOGIN_PANEL, 0, -1, 0, panel_x, cy - 60, l->panel_width, 240);
+        scene_add(scene, WIDGET_PROMPT, 0, panel, 0, panel_x + 20, cy - 105, field_width, 30);
+        scene_add(scene, WIDGET_PASSWORD_FIELD, 0, panel, 1, panel_x + 20, cy - 30, field_width, 60);
+        if (dm->auth_fd >= 0 && !dm->auth_prompting) {
+            scene_add(scene, WIDGET_SPINNER, 0, panel, 0, panel_x + field_width - 30, cy - 15, 30, 30);
+        }
+        scene_add(scene, WIDGET_SESSION_BUTTON, 0, panel, 1, panel_x + 20, cy + 70, field_width, 50);
+        if (dm->show_sessions && dm->session_count > 0) {
+            int dropdown = scene_add(scene, WIDGET_SESSION_LIST, 0, panel, 0,
+                                     panel_x + 20, cy + 130, field_width, dm->session_count * 50);
+            for (int i = 0; i < dm->session_count; i++) {
+                scene_add(scene, WIDGET_SESSION_ITEM, i, dropdown, 1, panel_x + 20, cy + 130 + i * 50,
+                          field_width, 50);
+            }
+        }
+    }
+
+    int notification_x = dm->width - l->notification_width - 30;
+    if (dm->show_error) {
+        scene_add(scene, WIDGET_NOTIFICATION, 0, -1, 0, notification_x, 30, l->notification_width, 70);
+    }
+    if (dm->show_warning) {
+        scene_add(scene, WIDGET_NOTIFICATION, 1, -1, 0, notification_x, 110, l->notification_width, 70);
+    }
+}
+
+static int rects_equal(const Rect *a, const Rect *b) {
+    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
+// Помечаем появившиеся, исчезнувшие и сдвинутые узлы (оба массива упорядочены по ключу)
+static void scene_diff(DisplayManager *dm) {
+    Scene *scene = &dm->scene;
+    int i = 0, j = 0;
+    while (i < scene->previous_count || j < scene->count) {
+        int cmp;
+        if (i == scene->previous_count) {
+            cmp = 1;
+        } else if (j == scene->count) {
+            cmp = -1;
+        } else {
+            cmp = widget_key_compare(&scene->previous[i], &scene->widgets[j]);
+        }
+
+        if (cmp < 0) {
+            mark_rect_dirty(dm, scene->previous[i++].bounds);
+        } else if (cmp > 0) {
+            mark_rect_dirty(dm, scene->widgets[j++].bounds);
+        } else {
+            if (!rects_equal(&scene->previous[i].bounds, &scene->widgets[j].bounds)) {
+                mark_rect_dirty(dm, scene->previous[i].bounds);
+                mark_rect_dirty(dm, scene->widgets[j].bounds);
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+static int bvh_compare(const void *a, const void *b, void *arg) {
+    const Scene *scene = arg;
+    const Rect *ra = &scene->widgets[*(const int*)a].bounds;
+    const Rect *rb = &scene->widgets[*(const int*)b].bounds;
+    int ca = scene->bvh_axis ? 2 * ra->y + ra->height : 2 * ra->x + ra->width;
+    int cb = scene->bvh_axis ? 2 * rb->y + rb->height : 2 * rb->x + rb->width;
+    return (ca > cb) - (ca < cb);
+}
+
+// Иерархия ограничивающих прямоугольников над интерактивными узлами:
+// деление пополам по медиане вдоль длинной стороны
+static int bvh_build(Scene *scene, int *items, int count) {
+    int node = scene->bvh_count++;
+    Rect bounds = scene->widgets[items[0]].bounds;
+    for (int i = 1; i < count; i++) {
+        rect_union(&bounds, &scene->widgets[items[i]].bounds);
+    }
+    scene->bvh[node].bounds = bounds;
+
+    if (count == 1) {
+        scene->bvh[node].left = scene->bvh[node].right = -1;
+        scene->bvh[node].widget = items[0];
+        return node;
+    }
+
+    scene->bvh_axis = bounds.height > bounds.width;
+    qsort_r(items, count, sizeof(int), bvh_compare, scene);
+    int half = count / 2;
+    int left = bvh_build(scene, items, half);
+    int right = bvh_build(scene, items + half, count - half);
+    scene->bvh[node].left = left;
+    scene->bvh[node].right = right;
+    scene->bvh[node].widget = -1;
+    return node;
+}
+
+static void scene_build_index(Scene *scene) {
+    scene->bvh_count = 0;
+    if (scene->count > scene->bvh_capacity) {
+        BvhNode *bvh = realloc(scene->bvh, 2 * scene->count * sizeof(BvhNode));
+        int *items = realloc(scene->bvh_items, scene->count * sizeof(int));
+        if (bvh) scene->bvh = bvh;
+        if (items) scene->bvh_items = items;
+        if (!bvh || !items) {
+            return;
+        }
+        scene->bvh_capacity = scene->count;
+    }
+
+    int count = 0;
+    for (int i = 0; i < scene->count; i++) {
+        if (scene->widgets[i].interactive) {
+            scene->bvh_items[count++] = i;
+        }
+    }
+    if (count > 0) {
+        bvh_build(scene, scene->bvh_items, count);
+    }
+}
+
+// Пересчёт раскладки, если она устарела
+void scene_update(DisplayManager *dm) {
+    Scene *scene = &dm->scene;
+    if (scene->valid) {
+        return;
+    }
+
+    // Текущая раскладка становится предыдущей, массивы переиспользуются
+    Widget *swap = scene->previous;
+    int swap_capacity = scene->previous_capacity;
+    scene->previous = scene->widgets;
+    scene->previous_count = scene->count;
+    scene->previous_capacity = scene->capacity;
+    scene->widgets = swap;
+    scene->capacity = swap_capacity;
+
+    struct timespec start;
+    stats_begin(&start);
+    layout_scene(dm);
+    scene_diff(dm);
+    scene_build_index(scene);
+    scene->valid = 1;
+    stats_end(STAT_LAYOUT, &start);
+}
+
+// Верхний интерактивный узел под точкой или NULL
+const Widget *scene_hit_test(const Scene *scene, int x, int y) {
+    if (scene->bvh_count == 0) {
+        return NULL;
+    }
+
+    int stack[64];
+    int top = 0;
+    int best = -1;
+    stack[top++] = 0;
+    while (top > 0) {
+        const BvhNode *node = &scene->bvh[stack[--top]];
+        const Rect *b = &node->bounds;
+        if (!point_in_rect(x, y, b->x, b->y, b->width, b->height)) {
+            continue;
+        }
+        if (node->widget >= 0) {
+            // Больший номер рисуется позже, то есть лежит выше
+            if (node->widget > best) {
+                best = node->widget;
+            }
+        } else if (top + 2 <= (int)(sizeof(stack) / sizeof(stack[0]))) {
+            stack[top++] = node->left;
+            stack[top++] = node->right;
+        }
+    }
+    return best >= 0 ? &scene->widgets[best] : NULL;
+}
+
+// Узел по ключу (тип, индекс) - двоичный поиск по упорядоченному массиву
+const Widget *scene_find(const Scene *scene, WidgetType type, int index) {
+    Widget key;
+    key.type = type;
+    key.index = index;
+    int lo = 0, hi = scene->count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = widget_key_compare(&scene->widgets[mid], &key);
+        if (cmp == 0) {
+            return &scene->widgets[mid];
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+// Перерисовка содержимого узла без изменения раскладки
+void mark_widget_dirty(DisplayManager *dm, WidgetType type, int index) {
+    const Widget *w = scene_find(&dm->scene, type, index);
+    if (w) {
+        mark_rect_dirty(dm, w->bounds);
+    }
+}
+
+// Поменялось состояние панели входа: заголовок, поле и кнопка сессии
+void mark_login_dirty(DisplayManager *dm) {
+    scene_invalidate(dm);
+    mark_widget_dirty(dm, WIDGET_PROMPT, 0);
+    mark_widget_dirty(dm, WIDGET_PASSWORD_FIELD, 0);
+    mark_widget_dirty(dm, WIDGET_SESSION_BUTTON, 0);
+}
+
+// ---------------------------------------------------------------------------
+// Программный рендерер: весь интерфейс растеризуется в 32-битный буфер клиента,
+// разделяемый с X-сервером через MIT-SHM, и выводится одним XShmPutImage.
+// Если SHM недоступен (удалённый дисплей, неподходящий визуал) - остаётся путь через Xlib.
+// ---------------------------------------------------------------------------
+
+static void fill_span_scalar(uint32_t *dst, uint32_t color, int n) {
+    for (int i = 0; i < n; i++) {
+        dst[i] = color;
+    }
+}
+
+static inline uint32_t blend_pixel(uint32_t dst, uint32_t color, unsigned a) {
+    uint32_t out = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        unsigned d = (dst >> shift) & 0xFF;
+        unsigned s = (color >> shift) & 0xFF;
+        unsigned t = d * (255 - a) + s * a + 128;
+        out |= (((t + (t >> 8)) >> 8) & 0xFF) << shift;
+    }
+    return out;
+}
+
+// dst = color * coverage + dst * (1 - coverage), coverage 0..255 на пиксель
+static void blend_span_scalar(uint32_t *dst, uint32_t color, const uint8_t *coverage, int n) {
+    for (int i = 0; i < n; i++) {
+        unsigned a = coverage[i];
+        if (a == 255) {
+            dst[i] = color;
+        } else if (a != 0) {
+            dst[i] = blend_pixel(dst[i], color, a);
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void fill_span_sse2(uint32_t *dst, uint32_t color, int n) {
+    __m128i c = _mm_set1_epi32((int)color);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i*)(dst + i), c);
+    }
+    fill_span_scalar(dst + i, color, n - i);
+}
+
+// Деление на 255 с округлением для 16-битных каналов
+__attribute__((target("sse2")))
+static inline __m128i div255_epu16(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void blend_span_sse2(uint32_t *dst, uint32_t color, const uint8_t *coverage, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i src = _mm_unpacklo_epi8(_mm_set1_epi32((int)color), zero);
+    int i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        uint32_t cov4;
+        memcpy(&cov4, coverage + i, 4);
+        if (cov4 == 0) {
+            continue;
+        }
+        if (cov4 == 0xFFFFFFFFu) {
+            _mm_storeu_si128((__m128i*)(dst + i), _mm_set1_epi32((int)color));
+            continue;
+        }
+
+        __m128i a = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)cov4), zero);
+        a = _mm_unpacklo_epi16(a, a);
+        __m128i a01 = _mm_unpacklo_epi32(a, a);
+        __m128i a23 = _mm_unpackhi_epi32(a, a);
+
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i d01 = _mm_unpacklo_epi8(d, zero);
+        __m128i d23 = _mm_unpackhi_epi8(d, zero);
+
+        d01 = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(d01, _mm_sub_epi16(full, a01)),
+                                         _mm_mullo_epi16(src, a01)));
+        d23 = div255_epu16(_mm_add_epi16(_mm_mullo_epi16(d23, _mm_sub_epi16(full, a23)),
+                                         _mm_mullo_epi16(src, a23)));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(d01, d23));
+    }
+    blend_span_scalar(dst + i, color, coverage + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void fill_span_avx2(uint32_t *dst, uint32_t color, int n) {
+    __m256i c = _mm256_set1_epi32((int)color);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i*)(dst + i), c);
+    }
+    fill_span_scalar(dst + i, color, n - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div255_epu16_avx2(__m256i x) {
+    x = _mm256_add_epi16(x, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(x, _mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void blend_span_avx2(uint32_t *dst, uint32_t color, const uint8_t *coverage, int n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(255);
+    const __m256i src = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)color), zero);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        uint64_t cov8;
+        memcpy(&cov8, coverage + i, 8);
+        if (cov8 == 0) {
+            continue;
+        }
+        if (cov8 == UINT64_MAX) {
+            _mm256_storeu_si256((__m256i*)(dst + i), _mm256_set1_epi32((int)color));
+            continue;
+        }
+
+        // unpack в AVX2 работает по 128-битным половинам: lo = пиксели 0,1 | 4,5, hi = 2,3 | 6,7
+        __m128i a = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(coverage + i)));
+        __m128i a0123 = _mm_unpacklo_epi16(a, a);
+        __m128i a4567 = _mm_unpackhi_epi16(a, a);
+        __m256i a_lo = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi32(a0123, a0123)),
+                                               _mm_unpacklo_epi32(a4567, a4567), 1);
+        __m256i a_hi = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpackhi_epi32(a0123, a0123)),
+                                               _mm_unpackhi_epi32(a4567, a4567), 1);
+
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i d_lo = _mm256_unpacklo_epi8(d, zero);
+        __m256i d_hi = _mm256_unpackhi_epi8(d, zero);
+
+        d_lo = div255_epu16_avx2(_mm256_add_epi16(_mm256_mullo_epi16(d_lo, _mm256_sub_epi16(full, a_lo)),
+                                                  _mm256_mullo_epi16(src, a_lo)));
+        d_hi = div255_epu16_avx2(_mm256_add_epi16(_mm256_mullo_epi16(d_hi, _mm256_sub_epi16(full, a_hi)),
+                                                  _mm256_mullo_epi16(src, a_hi)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_packus_epi16(d_lo, d_hi));
+    }
+    blend_span_scalar(dst + i, color, coverage + i, n - i);
+}
+#endif
+
+static void (*fill_span)(uint32_t *dst, uint32_t color, int n) = fill_span_scalar;
+static void (*blend_span)(uint32_t *dst, uint32_t color, const uint8_t *coverage, int n) = blend_span_scalar;
+static void box_sum_scalar(const uint32_t *src, int stride, int x0, int y0, int x1, int y1, uint32_t sum[4]);
+#if defined(__x86_64__) || defined(__i386__)
+static void box_sum_sse2(const uint32_t *src, int stride, int x0, int y0, int x1, int y1, uint32_t sum[4]);
+#endif
+// Им пользуется поток аватаров: выбирается до его запуска и больше не меняется
+static void (*box_sum)(const uint32_t *src, int stride, int x0, int y0, int x1, int y1,
+                       uint32_t sum[4]) = box_sum_scalar;
+
+// Выбор ядер по возможностям процессора
+void fb_init_kernels(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    static int selected;
+    if (selected) {
+        return;
+    }
+    selected = 1;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        fill_span = fill_span_avx2;
+        blend_span = blend_span_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        fill_span = fill_span_sse2;
+        blend_span = blend_span_sse2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        box_sum = box_sum_sse2;
+    }
+#endif
+}
+
+static int shm_attach_failed;
+
+static int shm_error_handler(Display *display, XErrorEvent *event) {
+    shm_attach_failed = 1;
+    return 0;
+}
+
+// Размер буфера с запасом: округление вверх до класса BUFFER_SIZE_CLASS
+int size_class(int n) {
+    return (n + BUFFER_SIZE_CLASS - 1) / BUFFER_SIZE_CLASS * BUFFER_SIZE_CLASS;
+}
+
+void background_release(uint32_t *pixels);
+
+void fb_destroy(DisplayManager *dm) {
+    Framebuffer *fb = dm->fb;
+    if (!fb) {
+        return;
+    }
+    if (fb->image) {
+        XShmDetach(dm->display, &fb->shm);
+        XSync(dm->display, False);
+        stats_round_trip();
+        fb->image->data = NULL;
+        XDestroyImage(fb->image);
+        shmdt(fb->shm.shmaddr);
+    }
+    background_release(fb->background);
+    free(fb->glyphs);
+    free(fb->coverage);
+    free(fb);
+    dm->fb = NULL;
+}
+
+static int fb_create_image(DisplayManager *dm, Framebuffer *fb, int width, int height) {
+    Visual *visual = DefaultVisual(dm->display, dm->screen);
+    // Сегмент выделяется по классу размера, чтобы небольшие изменения окна в него укладывались
+    int capacity_width = size_class(width), capacity_height = size_class(height);
+    fb->image = XShmCreateImage(dm->display, visual, DefaultDepth(dm->display, dm->screen),
+                                ZPixmap, NULL, &fb->shm, capacity_width, capacity_height);
+    if (!fb->image) {
+        return 0;
+    }
+
+    fb->shm.shmid = shmget(IPC_PRIVATE, (size_t)fb->image->bytes_per_line * capacity_height, IPC_CREAT | 0600);
+    if (fb->shm.shmid < 0) {
+        XDestroyImage(fb->image);
+        fb->image = NULL;
+        return 0;
+    }
+    fb->shm.shmaddr = fb->image->data = shmat(fb->shm.shmid, NULL, 0);
+    fb->shm.readOnly = False;
+
+    // Сегмент удаляется, как только от него отсоединятся оба процесса
+    shm_attach_failed = 0;
+    XErrorHandler old_handler = XSetErrorHandler(shm_error_handler);
+    Bool attached = fb->shm.shmaddr != (char*)-1 && XShmAttach(dm->display, &fb->shm);
+    XSync(dm->display, False);
+    stats_round_trip();
+    XSetErrorHandler(old_handler);
+    shmctl(fb->shm.shmid, IPC_RMID, NULL);
+
+    if (!attached || shm_attach_failed) {
+        if (fb->shm.shmaddr != (char*)-1) {
+            shmdt(fb->shm.shmaddr);
+        }
+        fb->image->data = NULL;
+        XDestroyImage(fb->image);
+        fb->image = NULL;
+        return 0;
+    }
+
+    fb->pixels = (uint32_t*)fb->image->data;
+    fb->stride = fb->image->bytes_per_line / 4;
+    fb->width = width;
+    fb->height = height;
+    fb->capacity_width = capacity_width;
+    fb->capacity_height = capacity_height;
+
+    free(fb->coverage);
+    fb->coverage = malloc(capacity_width);
+    return fb->coverage != NULL;
+}
+
+// Атлас глифов: все печатные ASCII-символы рисуются серверным шрифтом один раз
+// и забираются одним XGetImage, дальше текст накладывается на клиенте
+static int fb_build_glyphs(DisplayManager *dm, Framebuffer *fb) {
+    if (!dm->font) {
+        return 0;
+    }
+
+    fb->glyph_origin = -dm->font->min_bounds.lbearing > 0 ? -dm->font->min_bounds.lbearing : 0;
+    fb->glyph_cell = dm->font->max_bounds.rbearing + fb->glyph_origin;
+    fb->glyph_ascent = dm->font->ascent;
+    fb->glyph_height = dm->font->ascent + dm->font->descent;
+    int atlas_width = fb->glyph_cell * GLYPH_COUNT;
+
+    Pixmap atlas = XCreatePixmap(dm->display, dm->window, atlas_width, fb->glyph_height, 1);
+    GC gc = XCreateGC(dm->display, atlas, 0, NULL);
+    XSetForeground(dm->display, gc, 0);
+    XFillRectangle(dm->display, atlas, gc, 0, 0, atlas_width, fb->glyph_height);
+    XSetForeground(dm->display, gc, 1);
+    XSetFont(dm->display, gc, dm->font->fid);
+
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        char c = (char)(GLYPH_FIRST + i);
+        fb->glyph_advance[i] = XTextWidth(dm->font, &c, 1);
+        XDrawString(dm->display, atlas, gc, i * fb->glyph_cell + fb->glyph_origin, fb->glyph_ascent, &c, 1);
+    }
+
+    XImage *image = XGetImage(dm->display, atlas, 0, 0, atlas_width, fb->glyph_height, 1, XYPixmap);
+    stats_round_trip();
+    XFreeGC(dm->display, gc);
+    XFreePixmap(dm->display, atlas);
+    if (!image) {
+        return 0;
+    }
+
+    fb->glyphs = malloc((size_t)atlas_width * fb->glyph_height);
+    if (fb->glyphs) {
+        for (int y = 0; y < fb->glyph_height; y++) {
+            for (int x = 0; x < atlas_width; x++) {
+                fb->glyphs[y * atlas_width + x] = XGetPixel(image, x, y) ? 255 : 0;
+            }
+        }
+    }
+    XDestroyImage(image);
+    return fb->glyphs != NULL;
+}
+
+// Включает программный рендерер, если сервер поддерживает MIT-SHM и визуал 0xRRGGBB
+int fb_init(DisplayManager *dm) {
+    fb_init_kernels();
+
+    const char *renderer = getenv("MIAYDE_RENDERER");
+    if (renderer && strcmp(renderer, "xlib") == 0) {
+        return 0;
+    }
+
+    Visual *visual = DefaultVisual(dm->display, dm->screen);
+    if (!XShmQueryExtension(dm->display) || DefaultDepth(dm->display, dm->screen) < 24 ||
+        visual->red_mask != 0xff0000 || visual->green_mask != 0x00ff00 || visual->blue_mask != 0x0000ff) {
+        return 0;
+    }
+
+    Framebuffer *fb = calloc(1, sizeof(Framebuffer));
+    if (!fb) {
+        return 0;
+    }
+    dm->fb = fb;
+
+    // С Xft маски строк берутся из кеша текста, атлас серверного шрифта не нужен
+    int need_glyphs = !dm->text || !dm->text->xft;
+    if (!fb_create_image(dm, fb, dm->width, dm->height) || (need_glyphs && !fb_build_glyphs(dm, fb))) {
+        fb_destroy(dm);
+        return 0;
+    }
+
+    return 1;
+}
+
+int fb_resize(DisplayManager *dm) {
+    Framebuffer *fb = dm->fb;
+    if (dm->width <= fb->capacity_width && dm->height <= fb->capacity_height) {
+        fb->width = dm->width;
+        fb->height = dm->height;
+        return 1;
+    }
+
+    XShmDetach(dm->display, &fb->shm);
+    fb->image->data = NULL;
+    XDestroyImage(fb->image);
+    shmdt(fb->shm.shmaddr);
+    fb->image = NULL;
+
+    if (!fb_create_image(dm, fb, dm->width, dm->height)) {
+        fb_destroy(dm);
+        return 0;
+    }
+    return 1;
+}
+
+// Пересечение прямоугольника с текущей областью отсечения
+static int fb_clip(Framebuffer *fb, int *x0, int *y0, int *x1, int *y1) {
+    if (*x0 < fb->clip.x) *x0 = fb->clip.x;
+    if (*y0 < fb->clip.y) *y0 = fb->clip.y;
+    if (*x1 > fb->clip.x + fb->clip.width) *x1 = fb->clip.x + fb->clip.width;
+    if (*y1 > fb->clip.y + fb->clip.height) *y1 = fb->clip.y + fb->clip.height;
+    return *x0 < *x1 && *y0 < *y1;
+}
+
+void fb_fill_rect(Framebuffer *fb, int x, int y, int width, int height, uint32_t color) {
+    int x0 = x, y0 = y, x1 = x + width, y1 = y + height;
+    if (!fb_clip(fb, &x0, &y0, &x1, &y1)) {
+        return;
+    }
+    for (int row = y0; row < y1; row++) {
+        fill_span(fb->pixels + (size_t)row * fb->stride + x0, color, x1 - x0);
+    }
+}
+
+static inline uint8_t coverage_from_distance(double distance) {
+    // distance < 0 внутри фигуры; полпикселя сглаживания с каждой стороны
+    double c = 0.5 - distance;
+    if (c <= 0.0) return 0;
+    if (c >= 1.0) return 255;
+    return (uint8_t)(c * 255.0 + 0.5);
+}
+
+// Сглаженный прямоугольник со скруглёнными углами
+void fb_fill_rounded_rect(Framebuffer *fb, int x, int y, int width, int height, int radius, uint32_t color) {
+    int x0 = x, y0 = y, x1 = x + width, y1 = y + height;
+    if (!fb_clip(fb, &x0, &y0, &x1, &y1)) {
+        return;
+    }
+    if (radius * 2 > width) radius = width / 2;
+    if (radius * 2 > height) radius = height / 2;
+
+    for (int row = y0; row < y1; row++) {
+        uint32_t *dst = fb->pixels + (size_t)row * fb->stride;
+
+        // Центр скругления по вертикали для строк в зоне углов
+        double cy;
+        if (row < y + radius) {
+            cy = y + radius;
+        } else if (row >= y + height - radius) {
+            cy = y + height - radius;
+        } else {
+            fill_span(dst + x0, color, x1 - x0);
+            continue;
+        }
+
+        double dy = row + 0.5 - cy;
+        for (int col = x0; col < x1; col++) {
+            double cx;
+            if (col < x + radius) {
+                cx = x + radius;
+            } else if (col >= x + width - radius) {
+                cx = x + width - radius;
+            } else {
+                fb->coverage[col - x0] = 255;
+                continue;
+            }
+            double dx = col + 0.5 - cx;
+            fb->coverage[col - x0] = coverage_from_distance(sqrt(dx * dx + dy * dy) - radius);
+        }
+        blend_span(dst + x0, color, fb->coverage, x1 - x0);
+    }
+}
+
+// Сглаженный эллипс с центром (cx, cy) и полуосями a, b.
+// stroke = 0 - заливка, иначе обводка толщиной stroke; upper_half - только верхняя половина
+void fb_ellipse(Framebuffer *fb, double cx, double cy, double a, double b,
+                double stroke, int upper_half, uint32_t color) {
+    double pad = stroke / 2 + 1;
+    int x0 = (int)floor(cx - a - pad), x1 = (int)ceil(cx + a + pad);
+    int y0 = (int)floor(cy - b - pad), y1 = (int)ceil(upper_half ? cy + pad : cy + b + pad);
+    if (!fb_clip(fb, &x0, &y0, &x1, &y1)) {
+        return;
+    }
+
+    for (int row = y0; row < y1; row++) {
+        double dy = row + 0.5 - cy;
+        int span_start = x0, span_end = x1;
+
+        // Для залитого круга середина строки гарантированно внутри - не считаем её попиксельно
+        int inner_lo = x1, inner_hi = x1;
+        if (stroke == 0 && a == b && fabs(dy) < a - 1) {
+            double half = sqrt((a - 1) * (a - 1) - dy * dy) - 1;
+            inner_lo = (int)ceil(cx - half);
+            inner_hi = (int)floor(cx + half);
+            if (inner_lo < x0) inner_lo = x0;
+            if (inner_hi > x1) inner_hi = x1;
+            if (inner_lo > inner_hi) inner_lo = inner_hi = x1;
+        }
+
+        for (int col = x0; col < x1; col++) {
+            if (col >= inner_lo && col < inner_hi) {
+                fb->coverage[col - x0] = 255;
+                continue;
+            }
+            double dx = col + 0.5 - cx;
+            double nx = dx / a, ny = dy / b;
+            double f = sqrt(nx * nx + ny * ny);
+            // Приближённое расстояние до контура: (f - 1) / |grad f|
+            double grad = sqrt(nx * nx / (a * a) + ny * ny / (b * b));
+            double distance = grad > 1e-9 ? (f - 1) * f / grad : -fmin(a, b);
+            if (stroke > 0) {
+                distance = fabs(distance) - stroke / 2;
+            }
+            uint8_t c = coverage_from_distance(distance);
+            if (upper_half && dy > 0.5) {
+                c = 0;
+            }
+            fb->coverage[col - x0] = c;
+        }
+        blend_span(fb->pixels + (size_t)row * fb->stride + span_start, color,
+                   fb->coverage, span_end - span_start);
+    }
+}
+
+// Текст через атлас глифов; baseline - как у XDrawString
+void fb_draw_text(Framebuffer *fb, int x, int y, const char *text, int length, uint32_t color) {
+    int atlas_width = fb->glyph_cell * GLYPH_COUNT;
+    int top = y - fb->glyph_ascent;
+
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c < GLYPH_FIRST || c >= GLYPH_FIRST + GLYPH_COUNT) {
+            continue;
+        }
+        int index = c - GLYPH_FIRST;
+        int gx = x - fb->glyph_origin;
+        int x0 = gx, y0 = top, x1 = gx + fb->glyph_cell, y1 = top + fb->glyph_height;
+
+        if (fb_clip(fb, &x0, &y0, &x1, &y1)) {
+            for (int row = y0; row < y1; row++) {
+                const uint8_t *mask = fb->glyphs + (size_t)(row - top) * atlas_width +
+                                      index * fb->glyph_cell + (x0 - gx);
+                blend_span(fb->pixels + (size_t)row * fb->stride + x0, color, mask, x1 - x0);
+            }
+        }
+        x += fb->glyph_advance[index];
+    }
+}
+
+// Выводим область кадра на окно одним запросом
+void fb_present(DisplayManager *dm, Rect area) {
+    Framebuffer *fb = dm->fb;
+    XShmPutImage(dm->display, dm->window, dm->gc, fb->image,
+                 area.x, area.y, area.x, area.y, area.width, area.height, False);
+    // Буфер общий с сервером - нельзя трогать его, пока сервер не дочитал
+    XSync(dm->display, False);
+    stats_round_trip();
+}
+
+// ---------------------------------------------------------------------------
+// Текст: Xft (UTF-8, сглаживание) с кешем строк. Для каждой строки ширина
+// считается один раз, а для программного рендерера её маска покрытия
+// рисуется на сервере и забирается одним XGetImage при первом выводе.
+// Без Xft остаются серверный шрифт и атлас ASCII.
+// ---------------------------------------------------------------------------
+
+static uint32_t text_hash(const char *text, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+TextCache *text_init(DisplayManager *dm) {
+    TextCache *cache = calloc(1, sizeof(TextCache));
+    if (!cache) {
+        return NULL;
+    }
+    for (int i = 0; i < TEXT_CACHE_BUCKETS; i++) {
+        cache->buckets[i] = -1;
+    }
+
+    const char *mode = getenv("MIAYDE_TEXT");
+    if (!mode || strcmp(mode, "core") != 0) {
+        cache->xft = XftFontOpenName(dm->display, dm->screen, plan.font);
+    }
+    return cache;
+}
+
+void text_free(Display *display, TextCache *cache) {
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < cache->count; i++) {
+        free(cache->runs[i].text);
+        free(cache->runs[i].mask);
+    }
+    if (cache->xft) {
+        XftFontClose(display, cache->xft);
+    }
+    free(cache);
+}
+
+static void text_unlink(TextCache *cache, int index) {
+    int *link = &cache->buckets[cache->runs[index].hash % TEXT_CACHE_BUCKETS];
+    while (*link != index) {
+        link = &cache->runs[*link].next;
+    }
+    *link = cache->runs[index].next;
+}
+
+// Строка из кеша; при заполнении вытесняется давно не использованная
+TextRun *text_run(TextCache *cache, Display *display, XFontStruct *font, const char *text, int length) {
+    uint32_t hash = text_hash(text, length);
+    int *bucket = &cache->buckets[hash % TEXT_CACHE_BUCKETS];
+    cache->clock++;
+
+    for (int i = *bucket; i >= 0; i = cache->runs[i].next) {
+        TextRun *run = &cache->runs[i];
+        if (run->hash == hash && run->length == length && memcmp(run->text, text, length) == 0) {
+            run->last_used = cache->clock;
+            return run;
+        }
+    }
+
+    int index;
+    if (cache->count < TEXT_CACHE_SIZE) {
+        index = cache->count++;
+    } else {
+        index = 0;
+        for (int i = 1; i < TEXT_CACHE_SIZE; i++) {
+            if (cache->runs[i].last_used < cache->runs[index].last_used) {
+                index = i;
+            }
+        }
+        if (cache->runs[index].text) {
+            text_unlink(cache, index);
+        }
+        free(cache->runs[index].text);
+        free(cache->runs[index].mask);
+    }
+
+    TextRun *run = &cache->runs[index];
+    memset(run, 0, sizeof(TextRun));
+    run->text = malloc(length + 1);
+    if (!run->text) {
+        // Слот остаётся пустым, не связанным с корзиной, и будет вытеснен первым
+        return NULL;
+    }
+    memcpy(run->text, text, length);
+    run->text[length] = '\0';
+    run->length = length;
+    run->hash = hash;
+    run->last_used = cache->clock;
+
+    if (cache->xft) {
+        XGlyphInfo extents;
+        XftTextExtentsUtf8(display, cache->xft, (const FcChar8*)text, length, &extents);
+        run->width = extents.xOff;
+        run->mask_x = extents.x;
+        run->mask_y = extents.y;
+        run->mask_width = extents.width;
+        run->mask_height = extents.height;
+    } else if (font) {
+        run->width = XTextWidth(font, text, length);
+    }
+
+    run->next = *bucket;
+    *bucket = index;
+    return run;
+}
+
+int text_width(const DisplayManager *dm, const char *text, int length) {
+    TextRun *run = dm->text ? text_run(dm->text, dm->display, dm->font, text, length) : NULL;
+    if (run) {
+        return run->width;
+    }
+    return dm->font ? XTextWidth(dm->font, text, length) : 0;
+}
+
+// Маска покрытия строки для программного рендерера
+static const uint8_t *text_run_mask(TextCache *cache, Display *display, Drawable window, TextRun *run) {
+    if (run->mask || run->mask_width <= 0 || run->mask_height <= 0) {
+        return run->mask;
+    }
+
+    Pixmap pixmap = XCreatePixmap(display, window, run->mask_width, run->mask_height, 8);
+    XftDraw *draw = XftDrawCreateAlpha(display, pixmap, 8);
+    if (!draw) {
+        XFreePixmap(display, pixmap);
+        return NULL;
+    }
+    XftColor clear, opaque;
+    memset(&clear, 0, sizeof(clear));
+    memset(&opaque, 0, sizeof(opaque));
+    opaque.color.red = opaque.color.green = opaque.color.blue = opaque.color.alpha = 0xffff;
+    XftDrawRect(draw, &clear, 0, 0, run->mask_width, run->mask_height);
+    XftDrawStringUtf8(draw, &opaque, cache->xft, run->mask_x, run->mask_y,
+                      (const FcChar8*)run->text, run->length);
+    XftDrawDestroy(draw);
+
+    XImage *image = XGetImage(display, pixmap, 0, 0, run->mask_width, run->mask_height, AllPlanes, ZPixmap);
+    stats_round_trip();
+    XFreePixmap(display, pixmap);
+    if (!image) {
+        return NULL;
+    }
+
+    run->mask = malloc((size_t)run->mask_width * run->mask_height);
+    if (run->mask) {
+        for (int y = 0; y < run->mask_height; y++) {
+            memcpy(run->mask + (size_t)y * run->mask_width,
+                   image->data + (size_t)y * image->bytes_per_line, run->mask_width);
+        }
+    }
+    XDestroyImage(image);
+    return run->mask;
+}
+
+// Строка в программный буфер: маска из кеша накладывается с отсечением
+void fb_draw_run(Framebuffer *fb, TextCache *cache, Display *display, Drawable window,
+                 int x, int y, TextRun *run, uint32_t color) {
+    const uint8_t *mask = text_run_mask(cache, display, window, run);
+    if (!mask) {
+        return;
+    }
+    int left = x - run->mask_x, top = y - run->mask_y;
+    int x0 = left, y0 = top, x1 = left + run->mask_width, y1 = top + run->mask_height;
+    if (!fb_clip(fb, &x0, &y0, &x1, &y1)) {
+        return;
+    }
+    for (int row = y0; row < y1; row++) {
+        blend_span(fb->pixels + (size_t)row * fb->stride + x0, color,
+                   mask + (size_t)(row - top) * run->mask_width + (x0 - left), x1 - x0);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Аватары: ~/.face или значок AccountsService. Декодирование и масштабирование
+// идут в отдельном потоке; результат ложится в кеш миниатюр по хешу содержимого,
+// и на следующих загрузках готовые пиксели просто отображаются через mmap.
+// ---------------------------------------------------------------------------
+
+// Файл картинки целиком; fd уже открыт, owner - требуемый владелец или (uid_t)-1
+static uint8_t *avatar_read_fd(int fd, uid_t owner, size_t *length) {
+    struct stat st;
+    uint8_t *data = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (owner == (uid_t)-1 || st.st_uid == owner) &&
+        st.st_size > 0 && st.st_size <= AVATAR_FILE_MAX) {
+        data = malloc(st.st_size);
+        if (data && read(fd, data, st.st_size) != st.st_size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    close(fd);
+    if (data) {
+        *length = st.st_size;
+    }
+    return data;
+}
+
+// ~/.face и ~/.face.icon принадлежат пользователю и могут быть ссылками куда угодно:
+// открываем их с его fsuid/fsgid (действует только на этот поток), так что root-only
+// файл или устройство не откроется, и берём только файлы, владелец которых - он сам
+static uint8_t *avatar_read_home(const struct passwd *pwd, size_t *length) {
+    static const char *names[] = { ".face", ".face.icon" };
+    uid_t old_uid = setfsuid(pwd->pw_uid);
+    gid_t old_gid = setfsgid(pwd->pw_gid);
+    int fds[2];
+    for (int i = 0; i < 2; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", pwd->pw_dir, names[i]);
+        fds[i] = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    }
+    setfsgid(old_gid);
+    setfsuid(old_uid);
+
+    uint8_t *data = NULL;
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+        if (data) {
+            close(fds[i]);
+        } else {
+            data = avatar_read_fd(fds[i], pwd->pw_uid, length);
+        }
+    }
+    return data;
+}
+
+static uint8_t *avatar_read_source(const char *username, size_t *length) {
+    // Записи LDAP бывают длиннее обычного буфера - растим его по ERANGE
+    size_t size = 1024;
+    char *buf = NULL;
+    struct passwd pwd, *result = NULL;
+    int err;
+    do {
+        char *grown = realloc(buf, size);
+        if (!grown) {
+            break;
+        }
+        buf = grown;
+        err = getpwnam_r(username, &pwd, buf, size, &result);
+        size *= 2;
+    } while (err == ERANGE && size <= 1024 * 1024);
+
+    uint8_t *data = result ? avatar_read_home(&pwd, length) : NULL;
+    free(buf);
+    if (data) {
+        return data;
+    }
+
+    // Каталог AccountsService ведёт root
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", ACCOUNTS_ICON_DIR, username);
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    return fd >= 0 ? avatar_read_fd(fd, (uid_t)-1, length) : NULL;
+}
+
+// FNV-1a 64; hash - начальное значение (FNV64_BASIS или предыдущий результат для цепочки)
+static uint64_t fnv1a_64(const void *data, size_t length, uint64_t hash) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Готовая миниатюра из кеша: заголовок и size*size пикселей
+static uint32_t *avatar_map_thumbnail(const char *path, int size, size_t *mapped) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    size_t length = AVATAR_HEADER_SIZE + (size_t)size * size * 4;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size == length) {
+        map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    if (memcmp(map, AVATAR_CACHE_MAGIC, sizeof(AVATAR_CACHE_MAGIC)) != 0) {
+        munmap(map, length);
+        return NULL;
+    }
+    *mapped = length;
+    return (uint32_t*)((char*)map + AVATAR_HEADER_SIZE);
+}
+
+static void avatar_save_thumbnail(const char *path, const uint32_t *pixels, int size) {
+    mkdir(CACHE_DIR, 0755);
+    mkdir(AVATAR_CACHE_DIR, 0755);
+
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid()) >= (int)sizeof(tmp_path)) {
+        return;
+    }
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        return;
+    }
+    char header[AVATAR_HEADER_SIZE] = AVATAR_CACHE_MAGIC;
+    int ok = fwrite(header, sizeof(header), 1, fp) == 1 &&
+             fwrite(pixels, (size_t)size * size * 4, 1, fp) == 1;
+    if (fclose(fp) != 0 || !ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+// PNG через упрощённый API libpng: сразу в порядок байт ARGB32 хоста
+static uint32_t *avatar_decode_png(const uint8_t *data, size_t length, int *width, int *height) {
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&image, data, length)) {
+        return NULL;
+    }
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    image.format = PNG_FORMAT_ARGB;
+#else
+    image.format = PNG_FORMAT_BGRA;
+#endif
+    uint32_t *pixels = NULL;
+    if (image.width <= AVATAR_DECODE_MAX && image.height <= AVATAR_DECODE_MAX) {
+        pixels = malloc((size_t)image.width * image.height * 4);
+    }
+    if (!pixels || !png_image_finish_read(&image, NULL, pixels, 0, NULL)) {
+        png_image_free(&image);
+        free(pixels);
+        return NULL;
+    }
+    *width = image.width;
+    *height = image.height;
+    return pixels;
+}
+
+typedef struct {
+    struct jpeg_error_mgr base;
+    jmp_buf escape;
+} JpegError;
+
+// По умолчанию libjpeg завершает процесс при ошибке
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(((JpegError*)cinfo->err)->escape, 1);
+}
+
+// JPEG: большие фото libjpeg сразу уменьшает при декодировании (scale_denom до 8)
+static uint32_t *avatar_decode_jpeg(const uint8_t *data, size_t length, int size, int *width, int *height) {
+    struct jpeg_decompress_struct cinfo;
+    JpegError error;
+    uint32_t *volatile pixels = NULL;
+    uint8_t *volatile row = NULL;
+
+    cinfo.err = jpeg_std_error(&error.base);
+    error.base.error_exit = jpeg_error_exit;
+    if (setjmp(error.escape)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(pixels);
+        free(row);
+        return NULL;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)data, length);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    int shortest = cinfo.image_width < cinfo.image_height ? cinfo.image_width : cinfo.image_height;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    while (cinfo.scale_denom < 8 && shortest / (int)(cinfo.scale_denom * 2) >= size) {
+        cinfo.scale_denom *= 2;
+    }
+    jpeg_start_decompress(&cinfo);
+
+    if (cinfo.output_width > AVATAR_DECODE_MAX || cinfo.output_height > AVATAR_DECODE_MAX ||
+        cinfo.output_components != 3) {
+        longjmp(error.escape, 1);
+    }
+    pixels = malloc((size_t)cinfo.output_width * cinfo.output_height * 4);
+    row = malloc((size_t)cinfo.output_width * 3);
+    if (!pixels || !row) {
+        longjmp(error.escape, 1);
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW rows[1] = { row };
+        uint32_t *dst = pixels + (size_t)cinfo.output_scanline * cinfo.output_width;
+        jpeg_read_scanlines(&cinfo, rows, 1);
+        for (unsigned x = 0; x < cinfo.output_width; x++) {
+            dst[x] = 0xFF000000u | (uint32_t)row[3 * x] << 16 | (uint32_t)row[3 * x + 1] << 8 | row[3 * x + 2];
+        }
+    }
+    *width = cinfo.output_width;
+    *height = cinfo.output_height;
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+    return pixels;
+}
+
+// Сумма каналов прямоугольника исходных пикселей, в порядке байт пикселя: B, G, R, A
+static void box_sum_scalar(const uint32_t *src, int stride, int x0, int y0, int x1, int y1, uint32_t sum[4]) {
+    memset(sum, 0, 4 * sizeof(uint32_t));
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            uint32_t p = src[(size_t)y * stride + x];
+            sum[0] += p & 0xFF;
+            sum[1] += (p >> 8) & 0xFF;
+            sum[2] += (p >> 16) & 0xFF;
+            sum[3] += p >> 24;
+        }
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 складывает все четыре канала разом
+__attribute__((target("sse2")))
+static void box_sum_sse2(const uint32_t *src, int stride, int x0, int y0, int x1, int y1, uint32_t sum[4]) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (int y = y0; y < y1; y++) {
+        const uint32_t *p = src + (size_t)y * stride;
+        int x = x0;
+        for (; x + 4 <= x1; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(p + x));
+            __m128i lo = _mm_unpacklo_epi8(v, zero);
+            __m128i hi = _mm_unpackhi_epi8(v, zero);
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(lo, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(lo, zero));
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(hi, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(hi, zero));
+        }
+        for (; x < x1; x++) {
+            __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p[x]), zero);
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+        }
+    }
+    _mm_storeu_si128((__m128i*)sum, acc);
+}
+#endif
+
+// Центральный квадрат изображения усредняется по площади в size x size,
+// затем обрезается по сглаженному кругу с предумножением альфы
+static void avatar_resample(const uint32_t *src, int width, int height, uint32_t *dst, int size) {
+    int side = width < height ? width : height;
+    const uint32_t *square = src + (size_t)((height - side) / 2) * width + (width - side) / 2;
+    double radius = size / 2.0;
+
+    for (int oy = 0; oy < size; oy++) {
+        int y0 = oy * side / size, y1 = (oy + 1) * side / size;
+        if (y1 <= y0) y1 = y0 + 1;
+        for (int ox = 0; ox < size; ox++) {
+            int x0 = ox * side / size, x1 = (ox + 1) * side / size;
+            if (x1 <= x0) x1 = x0 + 1;
+
+            uint32_t sum[4];
+            box_sum(square, width, x0, y0, x1, y1, sum);
+            uint32_t n = (uint32_t)(x1 - x0) * (y1 - y0);
+
+            // Сумма хранится как B, G, R, A (порядок байт пикселя в памяти)
+            double dx = ox + 0.5 - radius, dy = oy + 0.5 - radius;
+            uint32_t coverage = coverage_from_distance(sqrt(dx * dx + dy * dy) - radius);
+            uint32_t a = (sum[3] / n) * coverage / 255;
+            uint32_t r = (sum[2] / n) * a / 255;
+            uint32_t g = (sum[1] / n) * a / 255;
+            uint32_t b = (sum[0] / n) * a / 255;
+            dst[(size_t)oy * size + ox] = a << 24 | r << 16 | g << 8 | b;
+        }
+    }
+}
+
+// Миниатюра пользователя: из кеша или декодированием; NULL - аватара нет
+static uint32_t *avatar_load(const char *username, int size, size_t *mapped) {
+    size_t length;
+    uint8_t *data = avatar_read_source(username, &length);
+    if (!data) {
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx-%d", AVATAR_CACHE_DIR,
+             (unsigned long long)fnv1a_64(data, length, FNV64_BASIS), size);
+    uint32_t *pixels = avatar_map_thumbnail(path, size, mapped);
+    if (pixels) {
+        free(data);
+        return pixels;
+    }
+
+    int width = 0, height = 0;
+    uint32_t *image = NULL;
+    static const uint8_t png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    if (length >= 8 && memcmp(data, png_signature, 8) == 0) {
+        image = avatar_decode_png(data, length, &width, &height);
+    } else if (length >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) {
+        image = avatar_decode_jpeg(data, length, size, &width, &height);
+    }
+    free(data);
+    if (!image) {
+        return NULL;
+    }
+
+    pixels = malloc((size_t)size * size * 4);
+    if (pixels) {
+        avatar_resample(image, width, height, pixels, size);
+        avatar_save_thumbnail(path, pixels, size);
+        *mapped = 0;
+    }
+    free(image);
+    return pixels;
+}
+
+static void avatar_cache_destroy(AvatarCache *cache);
+
+static void *avatar_worker(void *arg) {
+    AvatarCache *cache = arg;
+    pthread_mutex_lock(&cache->lock);
+    for (;;) {
+        while (cache->next_job == cache->count && !cache->stop) {
+            pthread_cond_wait(&cache->wake, &cache->lock);
+        }
+        if (cache->stop) {
+            break;
+        }
+        Avatar *avatar = &cache->items[cache->next_job++];
+        char username[sizeof(avatar->username)];
+        memcpy(username, avatar->username, sizeof(username));
+        pthread_mutex_unlock(&cache->lock);
+
+        size_t mapped = 0;
+        uint32_t *pixels = avatar_load(username, cache->size, &mapped);
+
+        pthread_mutex_lock(&cache->lock);
+        avatar->pixels = pixels;
+        avatar->mapped = mapped;
+        avatar->state = pixels ? AVATAR_DECODED : AVATAR_MISSING;
+        uint64_t one = 1;
+        if (pixels && !cache->stop && write(cache->event_fd, &one, sizeof(one)) < 0) {
+            perror("avatar eventfd");
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    avatar_cache_destroy(cache);
+    return NULL;
+}
+
+AvatarCache *avatar_init(void) {
+    AvatarCache *cache = calloc(1, sizeof(AvatarCache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cache->event_fd < 0) {
+        free(cache);
+        return NULL;
+    }
+    cache->size = plan.layout.avatar_size;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->wake, NULL);
+    return cache;
+}
+
+// Ставит пользователя в очередь декодирования; повторные запросы ничего не стоят
+void avatar_request(DisplayManager *dm, const char *username) {
+    AvatarCache *cache = dm->avatars;
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->items[i].username, username) == 0) {
+            return;
+        }
+    }
+    if (cache->count == MAX_AVATARS) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    Avatar *avatar = &cache->items[cache->count];
+    memset(avatar, 0, sizeof(Avatar));
+    snprintf(avatar->username, sizeof(avatar->username), "%s", username);
+    avatar->size = cache->size;
+    avatar->state = AVATAR_PENDING;
+    cache->count++;
+    if (!cache->started) {
+        // Поток создаётся при первом запросе: без списка пользователей он не нужен
+        cache->started = pthread_create(&cache->thread, NULL, avatar_worker, cache) == 0;
+        if (cache->started) {
+            pthread_detach(cache->thread);
+        }
+    }
+    pthread_cond_signal(&cache->wake);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Загрузка на сервер: маскированный Pixmap, потом каждый кадр - одно XCopyArea
+static void avatar_upload(DisplayManager *dm, Avatar *avatar) {
+    int size = avatar->size;
+    int depth = DefaultDepth(dm->display, dm->screen);
+    if (depth < 24) {
+        return;
+    }
+    char *data = malloc((size_t)size * size * 4);
+    XImage *image = data ? XCreateImage(dm->display, DefaultVisual(dm->display, dm->screen), depth,
+                                        ZPixmap, 0, data, size, size, 32, 0) : NULL;
+    if (!image) {
+        free(data);
+        return;
+    }
+    image->byte_order = HOST_BYTE_ORDER;
+
+    // Маска - по половинной прозрачности; края внутри маски возвращаем из предумножения
+    int mask_stride = (size + 7) / 8;
+    char *bits = calloc((size_t)mask_stride * size, 1);
+    for (int y = 0; y < size; y++) {
+        uint32_t *row = (uint32_t*)(image->data + (size_t)y * image->bytes_per_line);
+        for (int x = 0; x < size; x++) {
+            uint32_t p = avatar->pixels[(size_t)y * size + x];
+            uint32_t a = p >> 24;
+            if (a >= 128) {
+                if (bits) {
+                    bits[y * mask_stride + x / 8] |= 1 << (x % 8);
+                }
+                if (a < 255) {
+                    p = ((p >> 16 & 0xFF) * 255 / a) << 16 | ((p >> 8 & 0xFF) * 255 / a) << 8 |
+                        (p & 0xFF) * 255 / a;
+                }
+            }
+            row[x] = p & 0xFFFFFF;
+        }
+    }
+
+    avatar->pixmap = XCreatePixmap(dm->display, dm->window, size, size, depth);
+    GC gc = XCreateGC(dm->display, avatar->pixmap, 0, NULL);
+    XPutImage(dm->display, avatar->pixmap, gc, image, 0, 0, 0, 0, size, size);
+    XFreeGC(dm->display, gc);
+    XDestroyImage(image);
+
+    avatar->gc = XCreateGC(dm->display, dm->window, 0, NULL);
+    if (bits) {
+        avatar->mask = XCreateBitmapFromData(dm->display, dm->window, bits, size, size);
+        XSetClipMask(dm->display, avatar->gc, avatar->mask);
+        free(bits);
+    }
+}
+
+static void avatar_release_pixels(Avatar *avatar) {
+    if (avatar->mapped) {
+        munmap((char*)avatar->pixels - AVATAR_HEADER_SIZE, avatar->mapped);
+    } else {
+        free(avatar->pixels);
+    }
+    avatar->pixels = NULL;
+    avatar->mapped = 0;
+}
+
+// Готовые аватары из потока: загрузка (для Xlib) и перерисовка их карточек
+void avatar_collect(DisplayManager *dm) {
+    AvatarCache *cache = dm->avatars;
+    uint64_t count;
+    if (read(cache->event_fd, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < cache->count; i++) {
+        Avatar *avatar = &cache->items[i];
+        if (avatar->state != AVATAR_DECODED) {
+            continue;
+        }
+        avatar->state = AVATAR_READY;
+        if (!dm->fb) {
+            avatar_upload(dm, avatar);
+            avatar_release_pixels(avatar);
+        }
+        avatar->ready = avatar->pixels || avatar->pixmap;
+
+        int index = user_directory_find(dm->users, avatar->username);
+        if (index >= 0) {
+            mark_widget_dirty(dm, WIDGET_USER_CARD, index);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Есть ли аватары, которые ещё декодируются или ждут загрузки на сервер
+int avatar_busy(AvatarCache *cache) {
+    if (!cache) {
+        return 0;
+    }
+    int busy = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < cache->count && !busy; i++) {
+        busy = cache->items[i].state == AVATAR_PENDING || cache->items[i].state == AVATAR_DECODED;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return busy;
+}
+
+const Avatar *avatar_find(const AvatarCache *cache, const char *username) {
+    if (!cache) {
+        return NULL;
+    }
+    for (int i = 0; i < cache->count; i++) {
+        const Avatar *avatar = &cache->items[i];
+        if (avatar->ready && strcmp(avatar->username, username) == 0) {
+            return avatar;
+        }
+    }
+    return NULL;
+}
+
+static void avatar_cache_destroy(AvatarCache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        avatar_release_pixels(&cache->items[i]);
+    }
+    close(cache->event_fd);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->wake);
+    free(cache);
+}
+
+// Серверные ресурсы освобождаются сразу, остальное - потоком, если он уже запущен
+void avatar_free(DisplayManager *dm) {
+    AvatarCache *cache = dm->avatars;
+    if (!cache) {
+        return;
+    }
+    for (int i = 0; i < cache->count; i++) {
+        Avatar *avatar = &cache->items[i];
+        if (avatar->ready && avatar->pixmap) {
+            XFreePixmap(dm->display, avatar->pixmap);
+            if (avatar->mask) {
+                XFreePixmap(dm->display, avatar->mask);
+            }
+            XFreeGC(dm->display, avatar->gc);
+        }
+    }
+    dm->avatars = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stop = 1;
+    int owned = cache->started;
+    pthread_cond_signal(&cache->wake);
+    pthread_mutex_unlock(&cache->lock);
+    if (!owned) {
+        avatar_cache_destroy(cache);
+    }
+}
+
+// Предумноженный ARGB поверх программного буфера с отсечением
+void fb_composite(Framebuffer *fb, int x, int y, const uint32_t *pixels, int width, int height) {
+    int x0 = x, y0 = y, x1 = x + width, y1 = y + height;
+    if (!fb_clip(fb, &x0, &y0, &x1, &y1)) {
+        return;
+    }
+    for (int row = y0; row < y1; row++) {
+        const uint32_t *src = pixels + (size_t)(row - y) * width + (x0 - x);
+        uint32_t *dst = fb->pixels + (size_t)row * fb->stride + x0;
+        for (int i = 0; i < x1 - x0; i++) {
+            uint32_t s = src[i], a = s >> 24;
+            if (a == 255) {
+                dst[i] = s & 0xFFFFFF;
+            } else if (a) {
+                uint32_t d = dst[i], k = 255 - a;
+                uint32_t rb = ((d & 0xFF00FF) * k + 0x800080) >> 8 & 0xFF00FF;
+                uint32_t g = ((d & 0x00FF00) * k + 0x008000) >> 8 & 0x00FF00;
+                dst[i] = (s & 0xFFFFFF) + rb + g;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Заставка: последний спокойный кадр окна входа, сжатый RLE по строкам.
+// Ключ - размер окна, тема и /etc/passwd; при совпадении кадр показывается
+// сразу после открытия дисплея, до шрифтов, пользователей и сессий.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char magic[sizeof(SPLASH_CACHE_MAGIC)];
+    uint32_t width;
+    uint32_t height;
+    uint64_t key;
+    uint64_t length;  // байт данных RLE после заголовка
+} SplashHeader;
+
+static uint64_t splash_key(const DisplayManager *dm) {
+    uint32_t size[2] = { dm->width, dm->height };
+    uint64_t key = fnv1a_64(size, sizeof(size), FNV64_BASIS);
+    key = fnv1a_64(&plan, sizeof(plan), key);
+
+    struct stat st;
+    if (stat("/etc/passwd", &st) == 0) {
+        key = fnv1a_64(&st.st_ino, sizeof(st.st_ino), key);
+        key = fnv1a_64(&st.st_size, sizeof(st.st_size), key);
+        key = fnv1a_64(&st.st_mtim, sizeof(st.st_mtim), key);
+    }
+    return key;
+}
+
+// Строка в RLE: слово со старшим битом - повтор следующего пикселя, без него - столько же пикселей подряд
+static uint32_t *splash_encode_row(const uint32_t *row, int width, uint32_t *out) {
+    int x = 0;
+    while (x < width) {
+        int run = 1;
+        while (x + run < width && row[x + run] == row[x]) {
+            run++;
+        }
+        if (run >= 3) {
+            *out++ = 0x80000000u | run;
+            *out++ = row[x] & 0xFFFFFF;
+            x += run;
+            continue;
+        }
+
+        int start = x;
+        while (x < width && !(x + 2 < width && row[x] == row[x + 1] && row[x] == row[x + 2])) {
+            x++;
+        }
+        *out++ = x - start;
+        for (int i = start; i < x; i++) {
+            *out++ = row[i] & 0xFFFFFF;
+        }
+    }
+    return out;
+}
+
+static int splash_decode(const uint32_t *in, const uint32_t *end, uint32_t *pixels, int width, int height,
+                         int stride) {
+    for (int y = 0; y < height; y++) {
+        uint32_t *row = pixels + (size_t)y * stride;
+        int x = 0;
+        while (x < width) {
+            if (in >= end) {
+                return 0;
+            }
+            uint32_t token = *in++;
+            int n = token & 0x7FFFFFFF;
+            if (n == 0 || n > width - x) {
+                return 0;
+            }
+            if (token & 0x80000000u) {
+                if (in >= end) {
+                    return 0;
+                }
+                fill_span(row + x, *in++, n);
+            } else {
+                if (end - in < n) {
+                    return 0;
+                }
+                memcpy(row + x, in, (size_t)n * 4);
+                in += n;
+            }
+            x += n;
+        }
+    }
+    return 1;
+}
+
+// У каждого места своя заставка; seat0 и единственный дисплей - общий путь
+static void splash_path(const DisplayManager *dm, char *path, size_t size) {
+    if (!dm->seat[0] || strcmp(dm->seat, "seat0") == 0) {
+        snprintf(path, size, "%s", SPLASH_CACHE_PATH);
+        return;
+    }
+    snprintf(path, size, SPLASH_SEAT_PATH, dm->seat);
+}
+
+// Кадр прошлой загрузки становится фоном окна до отображения: сервер сам нарисует его
+// при XMapWindow, одна загрузка XPutImage. Возвращает Pixmap фона или None
+Pixmap splash_present(DisplayManager *dm) {
+    int depth = DefaultDepth(dm->display, dm->screen);
+    char path[PATH_MAX];
+    splash_path(dm, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || depth < 24) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return None;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(SplashHeader)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return None;
+    }
+
+    const SplashHeader *header = map;
+    Pixmap pixmap = None;
+    if (memcmp(header->magic, SPLASH_CACHE_MAGIC, sizeof(header->magic)) == 0 &&
+        header->width == (uint32_t)dm->width && header->height == (uint32_t)dm->height &&
+        header->key == splash_key(dm) && header->length == st.st_size - sizeof(SplashHeader)) {
+        char *data = malloc((size_t)dm->width * dm->height * 4);
+        XImage *image = data ? XCreateImage(dm->display, DefaultVisual(dm->display, dm->screen), depth,
+                                            ZPixmap, 0, data, dm->width, dm->height, 32, 0) : NULL;
+        if (!image) {
+            free(data);
+        } else {
+            image->byte_order = HOST_BYTE_ORDER;
+            const uint32_t *in = (const uint32_t*)(header + 1);
+            if (splash_decode(in, in + header->length / 4, (uint32_t*)image->data, dm->width, dm->height,
+                              image->bytes_per_line / 4)) {
+                pixmap = XCreatePixmap(dm->display, dm->window, dm->width, dm->height, depth);
+                XPutImage(dm->display, pixmap, dm->gc, image, 0, 0, 0, 0, dm->width, dm->height);
+                XSetWindowBackgroundPixmap(dm->display, dm->window, pixmap);
+            }
+            XDestroyImage(image);
+        }
+    }
+    munmap(map, st.st_size);
+    return pixmap;
+}
+
+// Живой интерфейс на экране - заставка больше не нужна
+void splash_release(DisplayManager *dm) {
+    if (dm->splash == None) {
+        return;
+    }
+    XSetWindowBackground(dm->display, dm->window, BlackPixel(dm->display, dm->screen));
+    XFreePixmap(dm->display, dm->splash);
+    dm->splash = None;
+}
+
+// Окно в исходном виде: всё загружено, ничего не выбрано и не всплыло
+int splash_idle(const DisplayManager *dm) {
+    return dm->first_frame_done && dm->damage.count == 0 && !dm->users->loading && !dm->password_active &&
+           !dm->show_error && !dm->show_warning && !dm->show_sessions && !dm->search[0] &&
+           dm->first_visible == 0 && dm->session_pid <= 0 && !avatar_busy(dm->avatars);
+}
+
+void splash_save(DisplayManager *dm, Pixmap buffer) {
+    const uint32_t *pixels;
+    int stride;
+    XImage *image = NULL;
+    if (dm->fb) {
+        pixels = dm->fb->pixels;
+        stride = dm->fb->stride;
+    } else {
+        image = XGetImage(dm->display, buffer, 0, 0, dm->width, dm->height, AllPlanes, ZPixmap);
+        stats_round_trip();
+        if (!image || image->bits_per_pixel != 32 || image->byte_order != HOST_BYTE_ORDER) {
+            if (image) {
+                XDestroyImage(image);
+            }
+            return;
+        }
+        pixels = (const uint32_t*)image->data;
+        stride = image->bytes_per_line / 4;
+    }
+
+    // Худший случай - чередование повторов и одиночных пикселей: два слова на пиксель
+    uint32_t *encoded = malloc((size_t)dm->width * dm->height * 2 * sizeof(uint32_t));
+    if (encoded) {
+        uint32_t *out = encoded;
+        for (int y = 0; y < dm->height; y++) {
+            out = splash_encode_row(pixels + (size_t)y * stride, dm->width, out);
+        }
+
+        SplashHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SPLASH_CACHE_MAGIC, sizeof(header.magic));
+        header.width = dm->width;
+        header.height = dm->height;
+        header.key = splash_key(dm);
+        header.length = (size_t)(out - encoded) * sizeof(uint32_t);
+
+        // Снимок экрана с именами пользователей - только для root
+        mkdir(CACHE_DIR, 0755);
+        char path[PATH_MAX], tmp_path[PATH_MAX + 16];
+        splash_path(dm, path, sizeof(path));
+        snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+        int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+        if (fp) {
+            int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                     fwrite(encoded, header.length, 1, fp) == 1;
+            if (fclose(fp) != 0 || !ok || rename(tmp_path, path) != 0) {
+                unlink(tmp_path);
+            }
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        free(encoded);
+    }
+    if (image) {
+        XDestroyImage(image);
+    }
+}
+
+// Охватывающий прямоугольник всех грязных областей (весь экран, если их нет)
+Rect damage_bounds(const DisplayManager *dm) {
+    Rect bounds = { 0, 0, dm->width, dm->height };
+    if (dm->damage.count > 0) {
+        bounds = dm->damage.rects[0];
+        for (int i = 1; i < dm->damage.count; i++) {
+            rect_union(&bounds, &dm->damage.rects[i]);
+        }
+    }
+    return bounds;
+}
+
+void gradient_init(Gradient *gradient, double angle) {
+    memset(gradient, 0, sizeof(Gradient));
+    gradient->angle = angle;
+}
+
+// Добавляет опорную точку; position в диапазоне [0, 1], точки держим отсортированными
+int gradient_add_stop(Gradient *gradient, double position, unsigned long color) {
+    if (gradient->stop_count >= MAX_GRADIENT_STOPS) {
+        return 0;
+    }
+    if (position < 0.0) position = 0.0;
+    if (position > 1.0) position = 1.0;
+
+    int i = gradient->stop_count;
+    while (i > 0 && gradient->stops[i - 1].position > position) {
+        gradient->stops[i] = gradient->stops[i - 1];
+        i--;
+    }
+    gradient->stops[i].position = position;
+    gradient->stops[i].color = color;
+    gradient->stop_count++;
+    return 1;
+}
+
+// Таблица цветов вдоль градиента; строится один раз вместе с темой
+void gradient_build_lut(Gradient *gradient);
+
+unsigned long gradient_color_at(const Gradient *gradient, double t) {
+    if (gradient->stop_count == 0) {
+        return 0;
+    }
+    if (t <= gradient->stops[0].position) {
+        return gradient->stops[0].color;
+    }
+
+    for (int i = 1; i < gradient->stop_count; i++) {
+        const GradientStop *a = &gradient->stops[i - 1];
+        const GradientStop *b = &gradient->stops[i];
+        if (t <= b->position) {
+            double span = b->position - a->position;
+            double ratio = span > 0.0 ? (t - a->position) / span : 1.0;
+            int r = ((a->color >> 16) & 0xFF) + (((int)((b->color >> 16) & 0xFF) - (int)((a->color >> 16) & 0xFF)) * ratio);
+            int g = ((a->color >> 8) & 0xFF) + (((int)((b->color >> 8) & 0xFF) - (int)((a->color >> 8) & 0xFF)) * ratio);
+            int bl = (a->color & 0xFF) + (((int)(b->color & 0xFF) - (int)(a->color & 0xFF)) * ratio);
+            return (r << 16) | (g << 8) | bl;
+        }
+    }
+    return gradient->stops[gradient->stop_count - 1].color;
+}
+
+// Заполняет буфер пикселями градиента через таблицу цветов
+void gradient_build_lut(Gradient *gradient) {
+    for (int i = 0; i < GRADIENT_LUT_SIZE; i++) {
+        gradient->lut[i] = gradient_color_at(gradient, (double)i / (GRADIENT_LUT_SIZE - 1));
+    }
+}
+
+void render_gradient_pixels(const Gradient *gradient, uint32_t *pixels, int width, int height, int stride) {
+    const uint32_t *lut = gradient->lut;
+
+    // Проекция точки на направление градиента: angle = 0 - сверху вниз
+    double rad = gradient->angle * M_PI / 180.0;
+    double dx = sin(rad);
+    double dy = cos(rad);
+    double p0 = fmin(0.0, dx * width) + fmin(0.0, dy * height);
+    double p1 = fmax(0.0, dx * width) + fmax(0.0, dy * height);
+    double scale = (GRADIENT_LUT_SIZE - 1) / (p1 - p0 > 0.0 ? p1 - p0 : 1.0);
+
+    for (int y = 0; y < height; y++) {
+        uint32_t *row = pixels + (size_t)y * stride;
+        if (fabs(dx) < 1e-9) {
+            fill_span(row, lut[(int)((dy * y - p0) * scale)], width);
+        } else {
+            for (int x = 0; x < width; x++) {
+                row[x] = lut[(int)((dx * x + dy * y - p0) * scale)];
+            }
+        }
+    }
+}
+
+// Фон программного рендерера зависит только от темы и размера, поэтому места
+// с одинаковым разрешением получают один и тот же буфер (только для чтения)
+uint32_t *background_acquire(const Gradient *gradient, int width, int height) {
+    SharedBackground *free_slot = NULL;
+    for (int i = 0; i < MAX_SEATS; i++) {
+        SharedBackground *bg = &seats.backgrounds[i];
+        if (bg->refs > 0 && bg->width == width && bg->height == height) {
+            bg->refs++;
+            return bg->pixels;
+        }
+        if (bg->refs == 0 && !free_slot) {
+            free_slot = bg;
+        }
+    }
+
+    uint32_t *pixels = malloc((size_t)width * height * sizeof(uint32_t));
+    if (!pixels) {
+        return NULL;
+    }
+    render_gradient_pixels(gradient, pixels, width, height, width);
+    if (free_slot) {
+        free_slot->width = width;
+        free_slot->height = height;
+        free_slot->refs = 1;
+        free_slot->pixels = pixels;
+    }
+    return pixels;
+}
+
+void background_release(uint32_t *pixels) {
+    if (!pixels) {
+        return;
+    }
+    for (int i = 0; i < MAX_SEATS; i++) {
+        SharedBackground *bg = &seats.backgrounds[i];
+        if (bg->refs > 0 && bg->pixels == pixels) {
+            if (--bg->refs == 0) {
+                free(bg->pixels);
+                memset(bg, 0, sizeof(SharedBackground));
+            }
+            return;
+        }
+    }
+    // Не попал в таблицу (мест больше, чем слотов) - принадлежит одному месту
+    free(pixels);
+}
+
+// ---------------------------------------------------------------------------
+// Конфигурация и тема (CONFIG_PATH): строки "ключ = значение", '#' - комментарий.
+// Файл разбирается один раз и компилируется в RenderPlan: цвета, метрики
+// раскладки и таблица градиента; настройки демона - в DaemonConfig. Оба
+// кешируются целиком в THEME_CACHE_PATH, ключ - устройство, inode, размер и
+// mtime конфига и версия формата.
+// ---------------------------------------------------------------------------
+
+typedef enum {
+    THEME_COLOR,
+    THEME_INT,
+    THEME_STRING
+} ThemeKeyType;
+
+typedef struct {
+    const char *name;
+    ThemeKeyType type;
+    size_t offset;
+    size_t size;  // размер буфера строки
+    int min;      // нижняя граница числа
+    int daemon;   // 1 - поле DaemonConfig, иначе RenderPlan
+} ThemeKey;
+
+static const ThemeKey theme_keys[] = {
+    { "background_top",     THEME_COLOR,  offsetof(RenderPlan, colors.bg1), 0, 0, 0 },
+    { "background_bottom",  THEME_COLOR,  offsetof(RenderPlan, colors.bg2), 0, 0, 0 },
+    { "accent",             THEME_COLOR,  offsetof(RenderPlan, colors.accent1), 0, 0, 0 },
+    { "accent_alt",         THEME_COLOR,  offsetof(RenderPlan, colors.accent2), 0, 0, 0 },
+    { "text",               THEME_COLOR,  offsetof(RenderPlan, colors.text), 0, 0, 0 },
+    { "highlight",          THEME_COLOR,  offsetof(RenderPlan, colors.highlight), 0, 0, 0 },
+    { "user_background",    THEME_COLOR,  offsetof(RenderPlan, colors.user_bg), 0, 0, 0 },
+    { "user_selected",      THEME_COLOR,  offsetof(RenderPlan, colors.user_selected), 0, 0, 0 },
+    { "password_background", THEME_COLOR, offsetof(RenderPlan, colors.pass_bg), 0, 0, 0 },
+    { "password_focus",     THEME_COLOR,  offsetof(RenderPlan, colors.pass_focus), 0, 0, 0 },
+    { "avatar_size",        THEME_INT,    offsetof(RenderPlan, layout.avatar_size), 0, 16, 0 },
+    { "list_x",             THEME_INT,    offsetof(RenderPlan, layout.list_x), 0, 0, 0 },
+    { "list_width",         THEME_INT,    offsetof(RenderPlan, layout.list_width), 0, 200, 0 },
+    { "card_top",           THEME_INT,    offsetof(RenderPlan, layout.card_top), 0, 100, 0 },
+    { "card_height",        THEME_INT,    offsetof(RenderPlan, layout.card_height), 0, 40, 0 },
+    { "card_spacing",       THEME_INT,    offsetof(RenderPlan, layout.card_spacing), 0, 0, 0 },
+    { "panel_width",        THEME_INT,    offsetof(RenderPlan, layout.panel_width), 0, 300, 0 },
+    { "notification_width", THEME_INT,    offsetof(RenderPlan, layout.notification_width), 0, 200, 0 },
+    { "font",               THEME_STRING, offsetof(RenderPlan, font), sizeof(plan.font), 0, 0 },
+    { "core_font",          THEME_STRING, offsetof(RenderPlan, core_font), sizeof(plan.core_font), 0, 0 },
+    { "autologin_timeout",  THEME_INT,    offsetof(DaemonConfig, autologin_timeout), 0, 0, 1 },
+    { "session_profile",    THEME_INT,    offsetof(DaemonConfig, session_profile), 0, 0, 1 },
+    { "xdmcp",              THEME_INT,    offsetof(DaemonConfig, xdmcp), 0, 0, 1 },
+    { "xdmcp_port",         THEME_INT,    offsetof(DaemonConfig, xdmcp_port), 0, 1, 1 },
+    { "xdmcp_max_displays", THEME_INT,    offsetof(DaemonConfig, xdmcp_max_displays), 0, 1, 1 },
+    { "pam_service",        THEME_STRING, offsetof(DaemonConfig, pam_service), sizeof(config.pam_service), 0, 1 },
+    { "autologin",          THEME_STRING, offsetof(DaemonConfig, autologin_user), sizeof(config.autologin_user), 0, 1 },
+    { "autologin_session",  THEME_STRING, offsetof(DaemonConfig, autologin_session), sizeof(config.autologin_session), 0, 1 },
+    { "xdmcp_allow",        THEME_STRING, offsetof(DaemonConfig, xdmcp_allow), sizeof(config.xdmcp_allow), 0, 1 },
+};
+#define THEME_KEY_COUNT (int)(sizeof(theme_keys) / sizeof(theme_keys[0]))
+
+// Версия формата кеша: увеличивать при любом изменении значений по умолчанию,
+// разбора или theme_compile - размер структур такие правки не ловит
+#define THEME_CACHE_VERSION 3
+
+// Ключ кеша: тот же файл, то же содержимое и та же сборка плана
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint32_t version;
+    uint32_t plan_size;
+    uint32_t config_size;
+} ThemeCacheKey;
+
+void theme_defaults(RenderPlan *theme) {
+    memset(theme, 0, sizeof(RenderPlan));
+    theme->colors.bg1 = 0xf61a2e;
+    theme->colors.bg2 = 0x16213e;
+    theme->colors.accent1 = 0x0f3460;
+    theme->colors.accent2 = 0xe94560;
+    theme->colors.text = 0xf0f0f0;
+    theme->colors.highlight = 0x4cc9f0;
+    theme->colors.user_bg = 0x2d2d4d;
+    theme->colors.user_selected = 0x4a4a8a;
+    theme->colors.pass_bg = 0x3d3d6d;
+    theme->colors.pass_focus = 0x5a5a9a;
+    theme->layout.avatar_size = 80;
+    theme->layout.list_x = 40;
+    theme->layout.list_width = 320;
+    theme->layout.card_top = 105;
+    theme->layout.card_height = 110;
+    theme->layout.card_spacing = 30;
+    theme->layout.panel_width = 500;
+    theme->layout.notification_width = 350;
+    snprintf(theme->font, sizeof(theme->font), "DejaVu Sans Mono:pixelsize=18");
+    snprintf(theme->core_font, sizeof(theme->core_font),
+             "-misc-dejavu sans mono-medium-r-normal--18-0-0-0-m-0-iso10646-1");
+    gradient_init(&theme->background, 0.0);
+}
+
+void config_defaults(DaemonConfig *daemon) {
+    memset(daemon, 0, sizeof(DaemonConfig));
+    daemon->xdmcp_port = XDMCP_PORT;
+    daemon->xdmcp_max_displays = 8;
+}
+
+// "#rrggbb" или "rrggbb"
+static int parse_color(const char *value, unsigned long *color) {
+    if (*value == '#') {
+        value++;
+    }
+    char *end;
+    unsigned long parsed = strtoul(value, &end, 16);
+    if (end - value != 6 || *end) {
+        return 0;
+    }
+    *color = parsed;
+    return 1;
+}
+
+static int theme_set(RenderPlan *theme, DaemonConfig *daemon, const char *key, const char *value) {
+    for (int i = 0; i < THEME_KEY_COUNT; i++) {
+        const ThemeKey *k = &theme_keys[i];
+        if (strcmp(key, k->name) != 0) {
+            continue;
+        }
+        char *field = (k->daemon ? (char*)daemon : (char*)theme) + k->offset;
+        if (k->type == THEME_COLOR) {
+            return parse_color(value, (unsigned long*)field);
+        }
+        if (k->type == THEME_INT) {
+            char *end;
+            long parsed = strtol(value, &end, 10);
+            if (end == value || *end || parsed < k->min || parsed > 4096) {
+                return 0;
+            }
+            *(int*)field = parsed;
+            return 1;
+        }
+        snprintf(field, k->size, "%s", value);
+        return 1;
+    }
+    return 0;
+}
+
+// Разбор конфига; ошибки в отдельных строках только печатаются - остальная тема применяется
+int theme_parse(RenderPlan *theme, DaemonConfig *daemon, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return 0;
+    }
+
+    // Крайние точки градиента - цвета фона, промежуточные задаются gradient_stop
+    GradientStop stops[MAX_GRADIENT_STOPS];
+    int stop_count = 0;
+    double angle = 0.0;
+
+    char line[512];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char *eq = strchr(line, '=');
+        char *key = line;
+        while (isspace((unsigned char)*key)) {
+            key++;
+        }
+        if (*key == '#') {
+            continue;
+        }
+        if (!eq) {
+            if (*key) {
+                fprintf(stderr, "%s:%d: expected key = value\n", path, line_number);
+            }
+            continue;
+        }
+        char *key_end = eq;
+        while (key_end > key && isspace((unsigned char)key_end[-1])) {
+            key_end--;
+        }
+        *key_end = '\0';
+        char *value = eq + 1;
+        while (isspace((unsigned char)*value)) {
+            value++;
+        }
+        char *value_end = value + strlen(value);
+        while (value_end > value && isspace((unsigned char)value_end[-1])) {
+            *--value_end = '\0';
+        }
+
+        int ok;
+        if (strcmp(key, "gradient_angle") == 0) {
+            char *end;
+            angle = strtod(value, &end);
+            ok = end != value && !*end;
+        } else if (strcmp(key, "gradient_stop") == 0) {
+            // gradient_stop = 0.5 #303060
+            char *end;
+            double position = strtod(value, &end);
+            ok = end != value && stop_count < MAX_GRADIENT_STOPS - 2 && position > 0.0 && position < 1.0;
+            while (ok && isspace((unsigned char)*end)) {
+                end++;
+            }
+            if (ok && (ok = parse_color(end, &stops[stop_count].color))) {
+                stops[stop_count++].position = position;
+            }
+        } else {
+            ok = theme_set(theme, daemon, key, value);
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%d: invalid setting %s\n", path, line_number, key);
+        }
+    }
+    fclose(fp);
+
+    gradient_init(&theme->background, angle);
+    for (int i = 0; i < stop_count; i++) {
+        gradient_add_stop(&theme->background, stops[i].position, stops[i].color);
+    }
+    return 1;
+}
+
+// Компиляция: производные значения, которые иначе считались бы на каждом кадре
+void theme_compile(RenderPlan *theme) {
+    ThemeLayout *l = &theme->layout;
+    if (l->avatar_size > l->card_height) {
+        l->avatar_size = l->card_height;
+    }
+    gradient_add_stop(&theme->background, 0.0, theme->colors.bg1);
+    gradient_add_stop(&theme->background, 1.0, theme->colors.bg2);
+    gradient_build_lut(&theme->background);
+}
+
+static int load_theme_cache(const ThemeCacheKey *key, RenderPlan *theme, DaemonConfig *daemon) {
+    FILE *fp = fopen(THEME_CACHE_PATH, "rb");
+    if (!fp) {
+        return 0;
+    }
+
+    char magic[sizeof(THEME_CACHE_MAGIC)];
+    ThemeCacheKey cached;
+    int ok = fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, THEME_CACHE_MAGIC, sizeof(magic)) == 0 &&
+             fread(&cached, sizeof(cached), 1, fp) == 1 && memcmp(&cached, key, sizeof(cached)) == 0 &&
+             fread(theme, sizeof(RenderPlan), 1, fp) == 1 &&
+             fread(daemon, sizeof(DaemonConfig), 1, fp) == 1;
+    fclose(fp);
+    return ok;
+}
+
+static void save_theme_cache(const ThemeCacheKey *key, const RenderPlan *theme, const DaemonConfig *daemon) {
+    mkdir(CACHE_DIR, 0755);
+
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", THEME_CACHE_PATH, getpid());
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        return;
+    }
+
+    int ok = fwrite(THEME_CACHE_MAGIC, sizeof(THEME_CACHE_MAGIC), 1, fp) == 1 &&
+             fwrite(key, sizeof(ThemeCacheKey), 1, fp) == 1 &&
+             fwrite(theme, sizeof(RenderPlan), 1, fp) == 1 &&
+             fwrite(daemon, sizeof(DaemonConfig), 1, fp) == 1;
+    if (fclose(fp) != 0 || !ok || rename(tmp_path, THEME_CACHE_PATH) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+// Тема для plan и настройки для config: из кеша, если конфиг не менялся;
+// без конфига - значения по умолчанию
+void theme_load(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        theme_defaults(&plan);
+        config_defaults(&config);
+        theme_compile(&plan);
+        return;
+    }
+
+    ThemeCacheKey key;
+    memset(&key, 0, sizeof(key));
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.size = st.st_size;
+    key.mtime = st.st_mtim;
+    key.version = THEME_CACHE_VERSION;
+    key.plan_size = sizeof(RenderPlan);
+    key.config_size = sizeof(DaemonConfig);
+    if (load_theme_cache(&key, &plan, &config)) {
+        timeline_mark("theme cached");
+        return;
+    }
+
+    theme_defaults(&plan);
+    config_defaults(&config);
+    theme_parse(&plan, &config, path);
+    theme_compile(&plan);
+    save_theme_cache(&key, &plan, &config);
+    timeline_mark("theme compiled");
+}
+
+// Градиент целиком на сервере (XRender 0.10): по сети идут точки и цвета опорных
+// точек, а не мегабайты XPutImage. 0 - расширения нет или визуал не подходит
+static int gradient_render_server(DisplayManager *dm, Pixmap pixmap, int width, int height) {
+    int event_base, error_base, major, minor;
+    if (!XRenderQueryExtension(dm->display, &event_base, &error_base) ||
+        !XRenderQueryVersion(dm->display, &major, &minor) || (major == 0 && minor < 10)) {
+        return 0;
+    }
+    XRenderPictFormat *format = XRenderFindVisualFormat(dm->display, DefaultVisual(dm->display, dm->screen));
+    const Gradient *gradient = &dm->gradient;
+    if (!format || gradient->stop_count == 0) {
+        return 0;
+    }
+
+    // Та же проекция, что в render_gradient_pixels: концы - крайние точки окна на направлении
+    double rad = gradient->angle * M_PI / 180.0;
+    double dx = sin(rad);
+    double dy = cos(rad);
+    double p0 = fmin(0.0, dx * width) + fmin(0.0, dy * height);
+    double p1 = fmax(0.0, dx * width) + fmax(0.0, dy * height);
+    XLinearGradient line = {
+        { XDoubleToFixed(dx * p0), XDoubleToFixed(dy * p0) },
+        { XDoubleToFixed(dx * p1), XDoubleToFixed(dy * p1) }
+    };
+
+    XFixed stops[MAX_GRADIENT_STOPS];
+    XRenderColor colors[MAX_GRADIENT_STOPS];
+    for (int i = 0; i < gradient->stop_count; i++) {
+        unsigned long color = gradient->stops[i].color;
+        stops[i] = XDoubleToFixed(gradient->stops[i].position);
+        colors[i].red = ((color >> 16) & 0xff) * 0x101;
+        colors[i].green = ((color >> 8) & 0xff) * 0x101;
+        colors[i].blue = (color & 0xff) * 0x101;
+        colors[i].alpha = 0xffff;
+    }
+
+    Picture source = XRenderCreateLinearGradient(dm->display, &line, stops, colors, gradient->stop_count);
+    Picture target = XRenderCreatePicture(dm->display, pixmap, format, 0, NULL);
+    XRenderComposite(dm->display, PictOpSrc, source, None, target, 0, 0, 0, 0, 0, 0, width, height);
+    XRenderFreePicture(dm->display, target);
+    XRenderFreePicture(dm->display, source);
+    return 1;
+}
+
+// Градиент в серверный Pixmap заданного размера
+Pixmap gradient_pixmap(DisplayManager *dm, int width, int height) {
+    int depth = DefaultDepth(dm->display, dm->screen);
+    Pixmap pixmap = XCreatePixmap(dm->display, dm->window, width, height, depth);
+    if (dm->remote && gradient_render_server(dm, pixmap, width, height)) {
+        return pixmap;
+    }
+
+    GC gc = XCreateGC(dm->display, pixmap, 0, NULL);
+    XImage *image = NULL;
+    if (depth >= 24) {
+        char *data = malloc((size_t)width * height * 4);
+        if (data) {
+            image = XCreateImage(dm->display, DefaultVisual(dm->display, dm->screen), depth,
+                                 ZPixmap, 0, data, width, height, 32, 0);
+            if (!image) {
+                free(data);
+            } else {
+                // Пиксели пишем в порядке байт клиента, Xlib сам переставит их для сервера
+                image->byte_order = HOST_BYTE_ORDER;
+            }
+        }
+    }
+
+    if (image) {
+        // Одна загрузка XPutImage вместо запроса на каждую строку
+        render_gradient_pixels(&dm->gradient, (uint32_t*)image->data, width, height,
+                               image->bytes_per_line / 4);
+        XPutImage(dm->display, pixmap, gc, image, 0, 0, 0, 0, width, height);
+        XDestroyImage(image);
+    } else {
+        // Неглубокие визуалы: строки градиента рисуем по одной, но тоже только один раз
+        uint32_t *column = malloc((size_t)height * sizeof(uint32_t));
+        if (column) {
+            Gradient vertical = dm->gradient;
+            vertical.angle = 0.0;
+            render_gradient_pixels(&vertical, column, 1, height, 1);
+            for (int y = 0; y < height; y++) {
+                XSetForeground(dm->display, gc, column[y]);
+                XDrawLine(dm->display, pixmap, gc, 0, y, width, y);
+            }
+            free(column);
+        }
+    }
+    XFreeGC(dm->display, gc);
+    return pixmap;
+}
+
+void render_background(DisplayManager *dm) {
+    if (dm->fb) {
+        background_release(dm->fb->background);
+        dm->fb->background = background_acquire(&dm->gradient, dm->width, dm->height);
+        if (dm->fb->background) {
+            return;
+        }
+        fb_destroy(dm);
+    }
+
+    if (dm->background != None) {
+        XFreePixmap(dm->display, dm->background);
+    }
+    dm->background = gradient_pixmap(dm, dm->width, dm->height);
+}
+
+// ---------------------------------------------------------------------------
+// Мониторы (XRandR): окно входа занимает только основной выход, так что буфер
+// кадра и копирование масштабируются по нему, а не по всему виртуальному экрану.
+// Остальные выходы закрыты окнами с закешированным фоном - их рисует сам сервер.
+// ---------------------------------------------------------------------------
+
+// Прямоугольники активных выходов; без XRandR - весь экран
+int query_outputs(DisplayManager *dm, Rect *outputs, int *primary) {
+    int count = 0;
+    *primary = 0;
+
+    if (dm->randr_event_base >= 0) {
+        Window root = RootWindow(dm->display, dm->screen);
+        XRRScreenResources *resources = XRRGetScreenResourcesCurrent(dm->display, root);
+        if (resources) {
+            RROutput primary_output = XRRGetOutputPrimary(dm->display, root);
+            for (int i = 0; i < resources->ncrtc && count < MAX_OUTPUTS; i++) {
+                XRRCrtcInfo *crtc = XRRGetCrtcInfo(dm->display, resources, resources->crtcs[i]);
+                if (!crtc) {
+                    continue;
+                }
+                if (crtc->mode != None && crtc->noutput > 0 && crtc->width > 0 && crtc->height > 0) {
+                    Rect r = { crtc->x, crtc->y, crtc->width, crtc->height };
+                    // Зеркальные выходы дают один и тот же прямоугольник
+                    int index = 0;
+                    while (index < count && !rects_equal(&outputs[index], &r)) {
+                        index++;
+                    }
+                    if (index == count) {
+                        outputs[count++] = r;
+                    }
+                    for (int o = 0; o < crtc->noutput; o++) {
+                        if (crtc->outputs[o] == primary_output) {
+                            *primary = index;
+                        }
+                    }
+                }
+                XRRFreeCrtcInfo(crtc);
+            }
+            XRRFreeScreenResources(resources);
+        }
+    }
+
+    if (count == 0) {
+        outputs[0].x = 0;
+        outputs[0].y = 0;
+        outputs[0].width = DisplayWidth(dm->display, dm->screen);
+        outputs[0].height = DisplayHeight(dm->display, dm->screen);
+        count = 1;
+    }
+    return count;
+}
+
+void outputs_init(DisplayManager *dm) {
+    int event_base, error_base;
+    dm->randr_event_base = -1;
+    if (XRRQueryExtension(dm->display, &event_base, &error_base)) {
+        dm->randr_event_base = event_base;
+        XRRSelectInput(dm->display, RootWindow(dm->display, dm->screen), RRScreenChangeNotifyMask);
+    }
+
+    Rect outputs[MAX_OUTPUTS];
+    int primary;
+    query_outputs(dm, outputs, &primary);
+    dm->primary_output = outputs[primary];
+    dm->width = dm->primary_output.width;
+    dm->height = dm->primary_output.height;
+}
+
+// Пересчёт после смены конфигурации: окна переиспользуются, фон пересчитывается
+// только для выходов, у которых поменялся размер
+void outputs_update(DisplayManager *dm) {
+    Rect rects[MAX_OUTPUTS];
+    int primary;
+    int count = query_outputs(dm, rects, &primary);
+
+    if (!rects_equal(&rects[primary], &dm->primary_output)) {
+        // Буферы под новый размер пересоздаст обработчик ConfigureNotify
+        dm->primary_output = rects[primary];
+        XMoveResizeWindow(dm->display, dm->window, rects[primary].x, rects[primary].y,
+                          rects[primary].width, rects[primary].height);
+    }
+
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (i == primary) {
+            continue;
+        }
+        Output *output = &dm->outputs[n];
+        Rect r = rects[i];
+        if (n >= dm->output_count) {
+            XSetWindowAttributes attrs;
+            attrs.override_redirect = True;
+            attrs.background_pixel = BlackPixel(dm->display, dm->screen);
+            attrs.cursor = dm->cursor;
+            output->window = XCreateWindow(dm->display, RootWindow(dm->display, dm->screen),
+                                           r.x, r.y, r.width, r.height, 0, CopyFromParent,
+                                           InputOutput, CopyFromParent,
+                                           CWOverrideRedirect | CWBackPixel | CWCursor, &attrs);
+            output->background = None;
+            memset(&output->bounds, 0, sizeof(Rect));
+            // Во время сессии новый выход получит окно при возврате приветствия
+            if (dm->session_pid <= 0) {
+                XMapRaised(dm->display, output->window);
+            }
+        } else if (r.x != output->bounds.x || r.y != output->bounds.y ||
+                   r.width != output->bounds.width || r.height != output->bounds.height) {
+            XMoveResizeWindow(dm->display, output->window, r.x, r.y, r.width, r.height);
+        }
+
+        if (r.width != output->bounds.width || r.height != output->bounds.height) {
+            if (output->background != None) {
+                XFreePixmap(dm->display, output->background);
+            }
+            output->background = gradient_pixmap(dm, r.width, r.height);
+            XSetWindowBackgroundPixmap(dm->display, output->window, output->background);
+            XClearWindow(dm->display, output->window);
+        }
+        output->bounds = r;
+        n++;
+    }
+
+    // Отключённые выходы
+    for (int i = n; i < dm->output_count; i++) {
+        XDestroyWindow(dm->display, dm->outputs[i].window);
+        XFreePixmap(dm->display, dm->outputs[i].background);
+    }
+    dm->output_count = n;
+}
+
+void outputs_free(DisplayManager *dm) {
+    for (int i = 0; i < dm->output_count; i++) {
+        XDestroyWindow(dm->display, dm->outputs[i].window);
+        XFreePixmap(dm->display, dm->outputs[i].background);
+    }
+    dm->output_count = 0;
+}
+
+void draw_gradient_background(RenderTarget *rt, const DisplayManager *dm) {
+    // Копируем закешированный фон только в пределах грязных областей
+    Rect bounds = rt->clip;
+    if (rt->fb) {
+        int x0 = bounds.x, y0 = bounds.y, x1 = bounds.x + bounds.width, y1 = bounds.y + bounds.height;
+        if (fb_clip(rt->fb, &x0, &y0, &x1, &y1)) {
+            for (int y = y0; y < y1; y++) {
+                memcpy(rt->fb->pixels + (size_t)y * rt->fb->stride + x0,
+                       rt->fb->background + (size_t)y * dm->width + x0,
+                       (size_t)(x1 - x0) * sizeof(uint32_t));
+            }
+        }
+        return;
+    }
+    XCopyArea(rt->display, dm->background, rt->drawable, rt->gc,
+              bounds.x, bounds.y, bounds.width, bounds.height, bounds.x, bounds.y);
+}
+
+void draw_rounded_rect(RenderTarget *rt, int x, int y, int width, int height, int radius, unsigned long color) {
+    if (rt->fb) {
+        fb_fill_rounded_rect(rt->fb, x, y, width, height, radius, color);
+        return;
+    }
+
+    XSetForeground(rt->display, rt->gc, color);
+    
+    // Основной прямоугольник
+    XFillRectangle(rt->display, rt->drawable, rt->gc, x + radius, y, width - 2 * radius, height);
+    XFillRectangle(rt->display, rt->drawable, rt->gc, x, y + radius, width, height - 2 * radius);
+    
+    // Углы
+    XFillArc(rt->display, rt->drawable, rt->gc, x, y, 2 * radius, 2 * radius, 90 * 64, 90 * 64);
+    XFillArc(rt->display, rt->drawable, rt->gc, x + width - 2 * radius, y, 2 * radius, 2 * radius, 0, 90 * 64);
+    XFillArc(rt->display, rt->drawable, rt->gc, x, y + height - 2 * radius, 2 * radius, 2 * radius, 180 * 64, 90 * 64);
+    XFillArc(rt->display, rt->drawable, rt->gc, x + width - 2 * radius, y + height - 2 * radius, 2 * radius, 2 * radius, 270 * 64, 90 * 64);
+}
+
+void draw_user_avatar(RenderTarget *rt, const Avatar *avatar, int x, int y, int selected) {
+    int radius = plan.layout.avatar_size / 2;
+
+    if (avatar) {
+        int size = avatar->size;
+        if (rt->fb) {
+            fb_composite(rt->fb, x, y, avatar->pixels, size, size);
+            if (selected) {
+                fb_ellipse(rt->fb, x + radius, y + radius, radius, radius, 3, 0, plan.colors.highlight);
+            }
+            return;
+        }
+
+        // Копируем только часть внутри области повреждений: маска заменяет отсечение GC
+        int x0 = x, y0 = y, x1 = x + size, y1 = y + size;
+        if (x0 < rt->clip.x) x0 = rt->clip.x;
+        if (y0 < rt->clip.y) y0 = rt->clip.y;
+        if (x1 > rt->clip.x + rt->clip.width) x1 = rt->clip.x + rt->clip.width;
+        if (y1 > rt->clip.y + rt->clip.height) y1 = rt->clip.y + rt->clip.height;
+        if (x0 < x1 && y0 < y1) {
+            XSetClipOrigin(rt->display, avatar->gc, x, y);
+            XCopyArea(rt->display, avatar->pixmap, rt->drawable, avatar->gc,
+                      x0 - x, y0 - y, x1 - x0, y1 - y0, x0, y0);
+        }
+        if (selected) {
+            XSetForeground(rt->display, rt->gc, plan.colors.highlight);
+            XSetLineAttributes(rt->display, rt->gc, 3, LineSolid, CapRound, JoinRound);
+            XDrawArc(rt->display, rt->drawable, rt->gc, x, y, size, size, 0, 360 * 64);
+            XSetLineAttributes(rt->display, rt->gc, 1, LineSolid, CapRound, JoinRound);
+        }
+        return;
+    }
+
+    // Пока изображение не готово (или его нет) - процедурная заглушка
+
+    if (rt->fb) {
+        fb_ellipse(rt->fb, x + radius, y + radius, radius, radius, 0, 0,
+                   selected ? plan.colors.user_selected : plan.colors.user_bg);
+        if (selected) {
+            fb_ellipse(rt->fb, x + radius, y + radius, radius, radius, 3, 0, plan.colors.highlight);
+        }
+        fb_ellipse(rt->fb, x + radius - 10, y + radius - 5, 5, 5, 0, 0, plan.colors.text);
+        fb_ellipse(rt->fb, x + radius + 10, y + radius - 5, 5, 5, 0, 0, plan.colors.text);
+        fb_ellipse(rt->fb, x + radius, y + radius + 10, 15, 10, 1, 1, plan.colors.text);
+        return;
+    }
+    
+    // Фон аватарки
+    XSetForeground(rt->display, rt->gc, selected ? plan.colors.user_selected : plan.colors.user_bg);
+    XFillArc(rt->display, rt->drawable, rt->gc, x, y, plan.layout.avatar_size, plan.layout.avatar_size, 0, 360 * 64);
+    
+    // Обводка если выбрано
+    if (selected) {
+        XSetForeground(rt->display, rt->gc, plan.colors.highlight);
+        XSetLineAttributes(rt->display, rt->gc, 3, LineSolid, CapRound, JoinRound);
+        XDrawArc(rt->display, rt->drawable, rt->gc, x, y, plan.layout.avatar_size, plan.layout.avatar_size, 0, 360 * 64);
+        XSetLineAttributes(rt->display, rt->gc, 1, LineSolid, CapRound, JoinRound);
+    }
+    
+    // Смайлик
+    XSetForeground(rt->display, rt->gc, plan.colors.text);
+    
+    // Глаза
+    XFillArc(rt->display, rt->drawable, rt->gc, x + radius - 15, y + radius - 10, 10, 10, 0, 360 * 64);
+    XFillArc(rt->display, rt->drawable, rt->gc, x + radius + 5, y + radius - 10, 10, 10, 0, 360 * 64);
+    
+    // Улыбка
+    XDrawArc(rt->display, rt->drawable, rt->gc, x + radius - 15, y + radius, 30, 20, 0, 180 * 64);
+}
+
+void draw_mouse_cursor(RenderTarget *rt, int mouse_x, int mouse_y) {
+    if (rt->fb) {
+        fb_fill_rect(rt->fb, mouse_x - 9, mouse_y - 1, 8, 2, plan.colors.highlight);
+        fb_fill_rect(rt->fb, mouse_x + 1, mouse_y - 1, 8, 2, plan.colors.highlight);
+        fb_fill_rect(rt->fb, mouse_x - 1, mouse_y - 9, 2, 8, plan.colors.highlight);
+        fb_fill_rect(rt->fb, mouse_x - 1, mouse_y + 1, 2, 8, plan.colors.highlight);
+        fb_ellipse(rt->fb, mouse_x, mouse_y, 2, 2, 0, 0, plan.colors.highlight);
+        return;
+    }
+
+    XSetForeground(rt->display, rt->gc, plan.colors.highlight);
+    XSetLineAttributes(rt->display, rt->gc, 2, LineSolid, CapRound, JoinRound);
+    
+    // Крестик без пересечения
+    XDrawLine(rt->display, rt->drawable, rt->gc, mouse_x - 8, mouse_y, mouse_x - 2, mouse_y);
+    XDrawLine(rt->display, rt->drawable, rt->gc, mouse_x + 2, mouse_y, mouse_x + 8, mouse_y);
+    XDrawLine(rt->display, rt->drawable, rt->gc, mouse_x, mouse_y - 8, mouse_x, mouse_y - 2);
+    XDrawLine(rt->display, rt->drawable, rt->gc, mouse_x, mouse_y + 2, mouse_x, mouse_y + 8);
+    
+    // Точка в центре
+    XFillArc(rt->display, rt->drawable, rt->gc, mouse_x - 2, mouse_y - 2, 4, 4, 0, 360 * 64);
+    
+    XSetLineAttributes(rt->display, rt->gc, 1, LineSolid, CapRound, JoinRound);
+}
+
+// Крестик курсора: покрытие пикселя (x, y) относительно горячей точки, 0..1.
+// Те же лучи и точка, что рисует draw_mouse_cursor()
+static double crosshair_coverage(int x, int y) {
+    if ((y == -1 || y == 0) && ((x >= -9 && x <= -2) || (x >= 1 && x <= 8))) {
+        return 1.0;
+    }
+    if ((x == -1 || x == 0) && ((y >= -9 && y <= -2) || (y >= 1 && y <= 8))) {
+        return 1.0;
+    }
+    double distance = sqrt((x + 0.5) * (x + 0.5) + (y + 0.5) * (y + 0.5));
+    return fmax(0.0, fmin(1.0, 2.5 - distance));
+}
+
+// Полноцветный курсор через XRender (нужна версия 0.5)
+static Cursor create_argb_cursor(DisplayManager *dm) {
+    int event_base, error_base, major, minor;
+    if (!XRenderQueryExtension(dm->display, &event_base, &error_base) ||
+        !XRenderQueryVersion(dm->display, &major, &minor) || (major == 0 && minor < 5)) {
+        return None;
+    }
+    XRenderPictFormat *format = XRenderFindStandardFormat(dm->display, PictStandardARGB32);
+    if (!format) {
+        return None;
+    }
+
+    // Цвет с предумноженной альфой
+    uint32_t pixels[CURSOR_SIZE * CURSOR_SIZE];
+    for (int y = 0; y < CURSOR_SIZE; y++) {
+        for (int x = 0; x < CURSOR_SIZE; x++) {
+            double a = crosshair_coverage(x - CURSOR_HOTSPOT, y - CURSOR_HOTSPOT);
+            uint32_t r = (uint32_t)lround(((plan.colors.highlight >> 16) & 0xff) * a);
+            uint32_t g = (uint32_t)lround(((plan.colors.highlight >> 8) & 0xff) * a);
+            uint32_t b = (uint32_t)lround((plan.colors.highlight & 0xff) * a);
+            pixels[y * CURSOR_SIZE + x] = (uint32_t)lround(a * 255) << 24 | r << 16 | g << 8 | b;
+        }
+    }
+
+    XImage *image = XCreateImage(dm->display, DefaultVisual(dm->display, dm->screen), 32, ZPixmap, 0,
+                                 (char*)pixels, CURSOR_SIZE, CURSOR_SIZE, 32, CURSOR_SIZE * 4);
+    if (!image) {
+        return None;
+    }
+    image->byte_order = HOST_BYTE_ORDER;
+
+    Pixmap pixmap = XCreatePixmap(dm->display, dm->window, CURSOR_SIZE, CURSOR_SIZE, 32);
+    GC gc = XCreateGC(dm->display, pixmap, 0, NULL);
+    XPutImage(dm->display, pixmap, gc, image, 0, 0, 0, 0, CURSOR_SIZE, CURSOR_SIZE);
+    image->data = NULL;
+    XDestroyImage(image);
+    XFreeGC(dm->display, gc);
+
+    Picture picture = XRenderCreatePicture(dm->display, pixmap, format, 0, NULL);
+    Cursor cursor = XRenderCreateCursor(dm->display, picture, CURSOR_HOTSPOT, CURSOR_HOTSPOT);
+    XRenderFreePicture(dm->display, picture);
+    XFreePixmap(dm->display, pixmap);
+    return cursor;
+}
+
+// Двухцветный курсор ядра X из того же рисунка; пустой рисунок даёт невидимый курсор
+static Cursor create_bitmap_cursor(DisplayManager *dm, int visible) {
+    char bits[CURSOR_SIZE * ((CURSOR_SIZE + 7) / 8)];
+    memset(bits, 0, sizeof(bits));
+    for (int y = 0; visible && y < CURSOR_SIZE; y++) {
+        for (int x = 0; x < CURSOR_SIZE; x++) {
+            if (crosshair_coverage(x - CURSOR_HOTSPOT, y - CURSOR_HOTSPOT) >= 0.5) {
+                bits[y * ((CURSOR_SIZE + 7) / 8) + x / 8] |= 1 << (x % 8);
+            }
+        }
+    }
+
+    Pixmap bitmap = XCreateBitmapFromData(dm->display, dm->window, bits, CURSOR_SIZE, CURSOR_SIZE);
+    XColor color;
+    color.red = ((plan.colors.highlight >> 16) & 0xff) * 257;
+    color.green = ((plan.colors.highlight >> 8) & 0xff) * 257;
+    color.blue = (plan.colors.highlight & 0xff) * 257;
+    Cursor cursor = XCreatePixmapCursor(dm->display, bitmap, bitmap, &color, &color,
+                                        CURSOR_HOTSPOT, CURSOR_HOTSPOT);
+    XFreePixmap(dm->display, bitmap);
+    return cursor;
+}
+
+// Курсор двигает сервер, окно при движении мыши не перерисовывается.
+// Программный крестик остаётся запасным вариантом (MIAYDE_CURSOR=software),
+// тогда серверный курсор прячется
+void cursor_init(DisplayManager *dm) {
+    const char *mode = getenv("MIAYDE_CURSOR");
+    dm->software_cursor = mode && strcmp(mode, "software") == 0;
+
+    dm->cursor = None;
+    if (!dm->software_cursor) {
+        dm->cursor = create_argb_cursor(dm);
+        if (dm->cursor == None) {
+            dm->cursor = create_bitmap_cursor(dm, 1);
+        }
+        dm->software_cursor = dm->cursor == None;
+    }
+    if (dm->software_cursor) {
+        dm->cursor = create_bitmap_cursor(dm, 0);
+    }
+    XDefineCursor(dm->display, dm->window, dm->cursor);
+}
+
+
+void auth_cancel(DisplayManager *dm);
+
+
+// Пересчёт видимого списка (фильтр поиска) и границ страницы
+void update_user_view(DisplayManager *dm) {
+    int *visible = realloc(dm->visible_users, ((size_t)dm->users->count * 2 + 1) * sizeof(int));
+    if (!visible) {
+        return;
+    }
+    dm->visible_users = visible;
+
+    if (dm->search[0]) {
+        dm->visible_count = user_directory_search(dm->users, dm->search, visible);
+    } else {
+        for (int i = 0; i < dm->users->count; i++) {
+            visible[i] = i;
+        }
+        dm->visible_count = dm->users->count;
+    }
+
+    int max_first = dm->visible_count - users_per_page(dm);
+    if (dm->first_visible > max_first) dm->first_visible = max_first;
+    if (dm->first_visible < 0) dm->first_visible = 0;
+
+    // Порядок в каталоге мог поменяться при тех же индексах - перерисовываем весь список
+    mark_widget_dirty(dm, WIDGET_USER_LIST, 0);
+    scene_invalidate(dm);
+}
+
+void scroll_users(DisplayManager *dm, int delta) {
+    int first = dm->first_visible + delta;
+    int max_first = dm->visible_count - users_per_page(dm);
+    if (first > max_first) first = max_first;
+    if (first < 0) first = 0;
+    if (first != dm->first_visible) {
+        dm->first_visible = first;
+        mark_widget_dirty(dm, WIDGET_STATUS, 0);
+        scene_invalidate(dm);
+    }
+}
+
+// После пересортировки каталога индекс выбранного пользователя мог сдвинуться
+void restore_selected_user(DisplayManager *dm) {
+    if (!dm->password_active) {
+        return;
+    }
+    dm->selected_user = user_directory_find(dm->users, dm->selected_username);
+    if (dm->selected_user < 0 && !dm->users->loading) {
+        // Пользователь исчез из каталога
+        auth_cancel(dm);
+        dm->selected_user = 0;
+        dm->password_active = 0;
+        dm->password_focus = 0;
+        explicit_bzero(dm->password, sizeof(dm->password));
+        scene_invalidate(dm);
+    }
+}
+
+void select_user(DisplayManager *dm, int index) {
+    if (dm->password_active) {
+        mark_widget_dirty(dm, WIDGET_USER_CARD, dm->selected_user);
+    }
+    mark_widget_dirty(dm, WIDGET_USER_CARD, index);
+    mark_login_dirty(dm);
+    auth_cancel(dm);
+    dm->selected_user = index;
+    strcpy(dm->selected_username, dm->users->users[index].username);
+    dm->password_active = 1;
+    dm->password_focus = 1;
+    dm->show_sessions = 0;
+    memset(dm->password, 0, sizeof(dm->password));
+}
+
+void handle_mouse_click(DisplayManager *dm, int x, int y, int button) {
+    scene_update(dm);
+    const Widget *hit = scene_hit_test(&dm->scene, x, y);
+
+    // Колесо мыши листает список пользователей
+    if (button == Button4 || button == Button5) {
+        if (hit && (hit->type == WIDGET_USER_LIST || hit->type == WIDGET_USER_CARD)) {
+            scroll_users(dm, button == Button4 ? -1 : 1);
+        }
+        return;
+    }
+
+    WidgetType type = hit ? hit->type : WIDGET_USER_LIST;
+    int index = hit ? hit->index : 0;
+    switch (type) {
+        case WIDGET_USER_CARD:
+            // Клик по пользователю
+            select_user(dm, index);
+            return;
+        case WIDGET_PASSWORD_FIELD:
+            // Клик по полю пароля
+            if (!dm->password_focus) {
+                mark_widget_dirty(dm, WIDGET_PASSWORD_FIELD, 0);
+            }
+            dm->password_focus = 1;
+            return;
+        case WIDGET_SESSION_BUTTON:
+            // Клик по кнопке сессии
+            if (dm->password_focus) {
+                mark_widget_dirty(dm, WIDGET_PASSWORD_FIELD, 0);
+            }
+            dm->password_focus = 0;
+            dm->show_sessions = !dm->show_sessions;
+            scene_invalidate(dm);
+            return;
+        case WIDGET_SESSION_ITEM:
+            // Клик по элементам выпадающего списка сессий
+            mark_widget_dirty(dm, WIDGET_SESSION_ITEM, dm->selected_session);
+            mark_widget_dirty(dm, WIDGET_SESSION_BUTTON, 0);
+            dm->selected_session = index;
+            dm->show_sessions = 0;
+            scene_invalidate(dm);
+            return;
+        default:
+            break;
+    }
+
+    // Клик вне элементов - снимаем фокус
+    if (dm->password_active && dm->password_focus) {
+        mark_widget_dirty(dm, WIDGET_PASSWORD_FIELD, 0);
+        dm->password_focus = 0;
+    }
+}
+
+void show_error(DisplayManager *dm, const char *message) {
+    snprintf(dm->error_message, sizeof(dm->error_message), "%s", message);
+    dm->error_time = time(NULL);
+    dm->show_error = 1;
+    mark_widget_dirty(dm, WIDGET_NOTIFICATION, 0);
+    scene_invalidate(dm);
+}
+
+void show_warning(DisplayManager *dm, const char *message) {
+    snprintf(dm->warning_message, sizeof(dm->warning_message), "%s", message);
+    dm->warning_time = time(NULL);
+    dm->show_warning = 1;
+    mark_widget_dirty(dm, WIDGET_NOTIFICATION, 1);
+    scene_invalidate(dm);
+}
+
+void draw_text(RenderTarget *rt, int x, int y, const char *text, int length, unsigned long color) {
+    if (rt->text && rt->text->xft) {
+        if (rt->fb) {
+            TextRun *run = text_run(rt->text, rt->display, rt->font, text, length);
+            if (run) {
+                fb_draw_run(rt->fb, rt->text, rt->display, rt->drawable, x, y, run, color);
+            }
+        } else if (rt->xft) {
+            // Глифы Xft загружает на сервер один раз и дальше ссылается на них
+            XftColor xft_color;
+            xft_color.pixel = color;
+            xft_color.color.red = ((color >> 16) & 0xff) * 257;
+            xft_color.color.green = ((color >> 8) & 0xff) * 257;
+            xft_color.color.blue = (color & 0xff) * 257;
+            xft_color.color.alpha = 0xffff;
+            XftDrawStringUtf8(rt->xft, &xft_color, rt->text->xft, x, y, (const FcChar8*)text, length);
+        }
+        return;
+    }
+    if (rt->fb) {
+        fb_draw_text(rt->fb, x, y, text, length, color);
+        return;
+    }
+    XSetForeground(rt->display, rt->gc, color);
+    XDrawString(rt->display, rt->drawable, rt->gc, x, y, text, length);
+}
+
+// Движение указателя: прежнее и новое положение курсора помечаются
+// один раз за пробуждение, сколько бы событий движения ни пришло
+void update_cursor_damage(DisplayManager *dm) {
+    if (!dm->software_cursor || (dm->mouse_x == dm->cursor_x && dm->mouse_y == dm->cursor_y)) {
+        return;
+    }
+    mark_rect_dirty(dm, cursor_rect(dm->cursor_x, dm->cursor_y));
+    mark_rect_dirty(dm, cursor_rect(dm->mouse_x, dm->mouse_y));
+    dm->cursor_x = dm->mouse_x;
+    dm->cursor_y = dm->mouse_y;
+}
+
+// Взводит timerfd на timeout мс; -1 снимает таймер
+void arm_timer(int timer_fd, int timeout) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (timeout == 0) {
+        spec.it_value.tv_nsec = 1;
+    } else if (timeout > 0) {
+        spec.it_value.tv_sec = timeout / 1000;
+        spec.it_value.tv_nsec = (timeout % 1000) * 1000000L;
+    }
+    timerfd_settime(timer_fd, 0, &spec, NULL);
+}
+
+// Таймеры: мигание курсора и истечение уведомлений.
+// Помечает изменившиеся области и возвращает таймаут до следующего события в мс (-1 - ждать бесконечно)
+int update_timers(DisplayManager *dm) {
+    time_t current_time = time(NULL);
+    int need_tick = 0;
+
+    if (dm->show_error) {
+        if (current_time - dm->error_time >= NOTIFY_TIMEOUT) {
+            dm->show_error = 0;
+            scene_invalidate(dm);
+        } else {
+            need_tick = 1;
+        }
+    }
+
+    if (dm->show_warning) {
+        if (current_time - dm->warning_time >= NOTIFY_TIMEOUT) {
+            dm->show_warning = 0;
+            scene_invalidate(dm);
+        } else {
+            need_tick = 1;
+        }
+    }
+
+    int blinking = dm->password_active && dm->password_focus && dm->password[0] == '\0' &&
+                   (dm->auth_fd < 0 || dm->auth_prompting);
+    int blink_visible = blinking && current_time % 2 == 0;
+    if (blink_visible != dm->blink_visible) {
+        dm->blink_visible = blink_visible;
+        mark_widget_dirty(dm, WIDGET_PASSWORD_FIELD, 0);
+    }
+    if (blinking) {
+        need_tick = 1;
+    }
+
+    // Анимация индикатора, пока помощник сессии проверяет вход без вопросов к пользователю
+    int spinner_timeout = -1;
+    if (dm->auth_fd >= 0 && !dm->auth_prompting) {
+        double since = elapsed_ms(&dm->spinner_time);
+        if (since >= SPINNER_INTERVAL_MS) {
+            dm->spinner_phase = (dm->spinner_phase + 1) % SPINNER_DOTS;
+            clock_gettime(CLOCK_MONOTONIC, &dm->spinner_time);
+            mark_widget_dirty(dm, WIDGET_SPINNER, 0);
+            since = 0;
+        }
+        spinner_timeout = SPINNER_INTERVAL_MS - (int)since;
+    }
+
+    if (!need_tick) {
+        return spinner_timeout;
+    }
+
+    // Просыпаемся на границе следующей секунды
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int tick_timeout = 1000 - now.tv_nsec / 1000000;
+    return spinner_timeout >= 0 && spinner_timeout < tick_timeout ? spinner_timeout : tick_timeout;
+}
+
+// Ставит дескриптор в общий epoll вместо прежнего; fd < 0 - снять наблюдение.
+// Снимать нужно до close: копии дескрипторов у дочерних процессов держат регистрацию живой
+void watch_set(Watch *watch, int fd) {
+    if (watch->fd == fd) {
+        return;
+    }
+    if (watch->fd >= 0) {
+        epoll_ctl(seats.epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    }
+    watch->fd = fd;
+    if (fd >= 0) {
+        // Неблокирующий connect сообщает о завершении готовностью к записи
+        struct epoll_event event = { .events = watch->type == WATCH_CONNECT ? EPOLLOUT : EPOLLIN,
+                                     .data.ptr = watch };
+        if (epoll_ctl(seats.epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            perror("epoll_ctl");
+        }
+    }
+}
+
+// Помощник сессии живёт всю сессию, поэтому дескрипторы демона закрываются до его exec явно,
+// не полагаясь на CLOEXEC у каждой библиотеки: соединения с X принадлежат приветствиям,
+// открытый канал входа другого места не дал бы его помощнику увидеть отмену, а UDP 177
+// и inotify не дали бы перезапущенному менеджеру занять порт и копили бы события
+void seats_close_in_child(void) {
+    for (int i = 0; i < seats.count; i++) {
+        DisplayManager *dm = seats.seats[i];
+        if (dm->display) {
+            close(ConnectionNumber(dm->display));
+        }
+        if (dm->countdown.display) {
+            close(ConnectionNumber(dm->countdown.display));
+        }
+        if (dm->avatars) {
+            close(dm->avatars->event_fd);
+        }
+        int fds[] = { dm->auth_fd, dm->exec_fd, dm->timer_fd, dm->x_ready_fd, dm->session_fd, dm->connect_fd };
+        for (size_t j = 0; j < sizeof(fds) / sizeof(fds[0]); j++) {
+            if (fds[j] >= 0) {
+                close(fds[j]);
+            }
+        }
+    }
+    int shared[] = { seats.passwd_watch.fd, seats.seats_watch.fd, xdmcp.watch.fd, seats.epoll_fd };
+    for (size_t j = 0; j < sizeof(shared) / sizeof(shared[0]); j++) {
+        if (shared[j] >= 0) {
+            close(shared[j]);
+        }
+    }
+}
+
+void seats_reap_orphans(void);
+
+// Процесс доживает сам; зомби заберёт seats_reap_orphans
+void seats_orphan(pid_t pid) {
+    if (pid <= 0) {
+        return;
+    }
+    if (seats.orphan_count == MAX_SEATS * 2) {
+        seats_reap_orphans();
+    }
+    if (seats.orphan_count < MAX_SEATS * 2) {
+        seats.orphans[seats.orphan_count++] = pid;
+    }
+}
+
+// Помощник сессии - этот же бинарник через fork+exec. Демон многопоточный (аватары, разбор
+// сессий), и копия без exec могла унаследовать блокировку NSS, модуля PAM или stdio,
+// взятую другим потоком. До exec - только async-signal-safe вызовы
+static pid_t session_child_spawn(int fd) {
+    char fd_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", fd);
+    char *args[] = { "miayDE", SESSION_CHILD_ARG, fd_arg, NULL };
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        seats_close_in_child();
+        setsid();
+        child_reset_signals();
+        // Конец канала помощника должен пережить exec
+        fcntl(fd, F_SETFD, 0);
+        execv("/proc/self/exe", args);
+        _exit(127);
+    }
+    return pid;
+}
+
+// Запуск помощника с первым сообщением; запрос стирается. Возвращает pid, *fd - наш конец канала
+static pid_t session_child_start(AuthRequest *request, int *fd) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0) {
+        explicit_bzero(request, sizeof(AuthRequest));
+        return -1;
+    }
+    snprintf(request->pam_service, sizeof(request->pam_service), "%s", options.pam_service);
+    request->session_profile = config.session_profile;
+
+    pid_t pid = session_child_spawn(sv[1]);
+    close(sv[1]);
+    int sent = pid > 0 && send(sv[0], request, sizeof(AuthRequest), MSG_NOSIGNAL) == sizeof(AuthRequest);
+    explicit_bzero(request, sizeof(AuthRequest));
+    if (!sent) {
+        close(sv[0]);
+        seats_orphan(pid);
+        return -1;
+    }
+    *fd = sv[0];
+    return pid;
+}
+
+// Сессия и место для помощника: он получает их после успешного входа
+void session_request_fill(SessionRequest *request, const DisplayManager *dm, const Session *session) {
+    memset(request, 0, sizeof(SessionRequest));
+    request->session = *session;
+    snprintf(request->display, sizeof(request->display), "%s", dm->display_name);
+    if (!dm->attached) {
+        snprintf(request->seat, sizeof(request->seat), "%s", dm->seat);
+    }
+    request->vt = dm->vt;
+    if (dm->remote) {
+        snprintf(request->remote_host, sizeof(request->remote_host), "%s", dm->remote_host);
+    }
+    if (dm->has_cookie) {
+        memcpy(request->cookie, dm->cookie, XDMCP_COOKIE_SIZE);
+        request->has_cookie = 1;
+    }
+}
+
+// Запускаем аутентификацию в помощнике сессии; его сообщения приходят в dm->auth_fd
+void auth_start(DisplayManager *dm) {
+    stats_begin(&dm->submitted);
+    AuthRequest request;
+    memset(&request, 0, sizeof(request));
+    snprintf(request.username, sizeof(request.username), "%s", dm->selected_username);
+    snprintf(request.password, sizeof(request.password), "%s", dm->password);
+    explicit_bzero(dm->password, sizeof(dm->password));
+
+    int fd;
+    pid_t pid = session_child_start(&request, &fd);
+    if (pid < 0) {
+        show_error(dm, "Cannot start authentication");
+        return;
+    }
+
+    dm->auth_fd = fd;
+    dm->auth_pid = pid;
+    watch_set(&dm->watches[WATCH_AUTH], dm->auth_fd);
+    dm->auth_prompting = 0;
+    dm->spinner_phase = 0;
+    clock_gettime(CLOCK_MONOTONIC, &dm->spinner_time);
+    mark_login_dirty(dm);
+}
+
+// Закрытие канала - сигнал помощнику: ожидающий вопрос получит отказ, PAM он закончит сам
+void auth_cancel(DisplayManager *dm) {
+    if (dm->auth_fd < 0) {
+        return;
+    }
+    watch_set(&dm->watches[WATCH_AUTH], -1);
+    close(dm->auth_fd);
+    dm->auth_fd = -1;
+    seats_orphan(dm->auth_pid);
+    dm->auth_pid = 0;
+    dm->auth_prompting = 0;
+    explicit_bzero(dm->password, sizeof(dm->password));
+    mark_login_dirty(dm);
+}
+
+// Ответ пользователя на дополнительный вопрос PAM
+void auth_answer(DisplayManager *dm) {
+    AuthMessage reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.type = AUTH_MSG_ANSWER;
+    snprintf(reply.text, sizeof(reply.text), "%s", dm->password);
+    explicit_bzero(dm->password, sizeof(dm->password));
+
+    int sent = send(dm->auth_fd, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply);
+    explicit_bzero(&reply, sizeof(reply));
+    if (!sent) {
+        auth_cancel(dm);
+        return;
+    }
+    dm->auth_prompting = 0;
+    mark_login_dirty(dm);
+}
+
+// Движения нужны только программному курсору; удалённому терминалу они забивали бы линию
+long greeter_motion_mask(const DisplayManager *dm) {
+    return dm->remote && !dm->software_cursor ? 0 : PointerMotionMask;
+}
+
+// Захват ввода окном приветствия
+void greeter_grab(DisplayManager *dm) {
+    XGrabPointer(dm->display, dm->window, True,
+                ButtonPressMask | ButtonReleaseMask | greeter_motion_mask(dm),
+                GrabModeAsync, GrabModeAsync, dm->window, dm->cursor, CurrentTime);
+    if (XGrabKeyboard(dm->display, dm->window, True, GrabModeAsync, GrabModeAsync,
+                      CurrentTime) != GrabSuccess) {
+        fprintf(stderr, "Failed to grab keyboard\n");
+    }
+}
+
+// На время сессии окна приветствия убираются, но не уничтожаются
+void greeter_hide(DisplayManager *dm) {
+    XUngrabPointer(dm->display, CurrentTime);
+    XUngrabKeyboard(dm->display, CurrentTime);
+    XUnmapWindow(dm->display, dm->window);
+    for (int i = 0; i < dm->output_count; i++) {
+        XUnmapWindow(dm->display, dm->outputs[i].window);
+    }
+    XSync(dm->display, False);
+    stats_round_trip();
+
+    // Таймеры мигания и уведомлений не должны тикать под сессией
+    dm->password_active = 0;
+    dm->password_focus = 0;
+    dm->show_sessions = 0;
+    dm->show_error = 0;
+    dm->show_warning = 0;
+    explicit_bzero(dm->password, sizeof(dm->password));
+}
+
+// Возврат после выхода из сессии: X, шрифты, кэши и список пользователей уже готовы
+void greeter_show(DisplayManager *dm) {
+    for (int i = 0; i < dm->output_count; i++) {
+        XMapRaised(dm->display, dm->outputs[i].window);
+    }
+    XMapRaised(dm->display, dm->window);
+    greeter_grab(dm);
+    scene_invalidate(dm);
+    mark_all_dirty(dm);
+}
+
+// Следим за сессией через pidfd; на старых ядрах - через signalfd по SIGCHLD
+int session_watch(pid_t pid, int *is_signalfd) {
+    *is_signalfd = 0;
+#ifdef SYS_pidfd_open
+    int fd = syscall(SYS_pidfd_open, pid, 0);
+    if (fd >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        return fd;
+    }
+#endif
+    // SIGCHLD заблокирован во всех потоках с самого старта (main)
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sfd < 0) {
+        return -1;
+    }
+    *is_signalfd = 1;
+    return sfd;
+}
+
+void session_unwatch(DisplayManager *dm) {
+    if (dm->exec_fd >= 0) {
+        watch_set(&dm->watches[WATCH_EXEC], -1);
+        close(dm->exec_fd);
+        dm->exec_fd = -1;
+    }
+    if (dm->session_fd >= 0) {
+        watch_set(&dm->watches[WATCH_SESSION], -1);
+        close(dm->session_fd);
+        dm->session_fd = -1;
+    }
+    dm->session_fd_is_signalfd = 0;
+}
+
+// Процесс сессии дошёл до exec (EOF) или сообщил errno: время от Return до exec
+void session_exec_done(DisplayManager *dm) {
+    int err = 0;
+    ssize_t n = read(dm->exec_fd, &err, sizeof(err));
+    if (n < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (n == 0) {
+        double ms = stats_end(STAT_SESSION_EXEC, &dm->submitted);
+        printf("Session exec %.1f ms after Return\n", ms);
+    } else {
+        fprintf(stderr, "Session did not start: %s\n", n == sizeof(err) ? strerror(err) : "unknown error");
+    }
+    watch_set(&dm->watches[WATCH_EXEC], -1);
+    close(dm->exec_fd);
+    dm->exec_fd = -1;
+}
+
+void seat_remove(DisplayManager *dm);
+int greeter_open(DisplayManager *dm);
+
+// Проверка завершения сессии; возвращает 1, если приветствие вернулось на экран (или место убрано)
+int session_reap(DisplayManager *dm) {
+    if (dm->session_pid <= 0) {
+        return 0;
+    }
+    if (dm->session_fd_is_signalfd) {
+        struct signalfd_siginfo info;
+        while (read(dm->session_fd, &info, sizeof(info)) == sizeof(info)) {
+        }
+    }
+
+    int status;
+    pid_t pid = waitpid(dm->session_pid, &status, WNOHANG);
+    if (pid == 0 || (pid < 0 && errno == EINTR)) {
+        return 0;
+    }
+
+    if (pid > 0 && WIFEXITED(status)) {
+        printf("Session finished with status %d\n", WEXITSTATUS(status));
+    } else if (pid > 0 && WIFSIGNALED(status)) {
+        printf("Session killed by signal %d\n", WTERMSIG(status));
+    }
+    dm->session_pid = 0;
+    session_unwatch(dm);
+    if (dm->remote) {
+        // Удалённый X после отключения сбрасывается и снова спрашивает менеджер по XDMCP
+        seat_remove(dm);
+        return 1;
+    }
+    if (!dm->opened) {
+        // Вышла сессия автовхода: окно входа открывается впервые
+        printf("Autologin session finished\n");
+        if (!greeter_open(dm)) {
+            seat_remove(dm);
+        }
+        return 1;
+    }
+    greeter_show(dm);
+    return 1;
+}
+
+// Сессия запущена: о выходе сообщит pidfd/signalfd в общем epoll
+void session_track(DisplayManager *dm, pid_t pid) {
+    dm->session_pid = pid;
+    dm->session_fd = session_watch(pid, &dm->session_fd_is_signalfd);
+    if (dm->session_fd < 0) {
+        perror("session watch");
+    }
+    watch_set(&dm->watches[WATCH_SESSION], dm->session_fd);
+}
+
+// Лидер сессии: открывает сессию PAM (pam_systemd регистрирует её в logind и поднимает
+// user@.service с шиной пользователя), запускает сессию и закрывает её после выхода
+int session_run(pam_handle_t *pamh, const char *username, const Session *session, const SessionTarget *target) {
+    char desktop[sizeof(session->id) + 32];
+    snprintf(desktop, sizeof(desktop), "XDG_SESSION_DESKTOP=%s", session->id);
+
+    setenv("DISPLAY", target->display, 1);
+    pam_set_item(pamh, PAM_TTY, target->display);
+    pam_set_item(pamh, PAM_XDISPLAY, target->display);
+    if (target->remote_host) {
+        pam_set_item(pamh, PAM_RHOST, target->remote_host);
+    }
+    pam_putenv(pamh, "XDG_SESSION_TYPE=x11");
+    pam_putenv(pamh, "XDG_SESSION_CLASS=user");
+    pam_putenv(pamh, desktop);
+    if (target->seat) {
+        char seat_env[64], vt_env[32];
+        snprintf(seat_env, sizeof(seat_env), "XDG_SEAT=%s", target->seat);
+        pam_putenv(pamh, seat_env);
+        if (target->vt > 0) {
+            snprintf(vt_env, sizeof(vt_env), "XDG_VTNR=%d", target->vt);
+            pam_putenv(pamh, vt_env);
+        }
+    }
+
+    // Группы пользователя до pam_setcred: pam_group добавляет свои к ним, процесс сессии
+    // их унаследует. Порядок setcred, затем open_session - как у sshd
+    struct passwd *pwd = getpwnam(username);
+    if (!pwd || initgroups(pwd->pw_name, pwd->pw_gid) != 0) {
+        perror("initgroups failed");
+        session_report_failure(target->exec_fd, pwd ? errno : ENOENT);
+        pam_end(pamh, PAM_SYSTEM_ERR);
+        return 1;
+    }
+    int retval = pam_setcred(pamh, PAM_ESTABLISH_CRED);
+    if (retval != PAM_SUCCESS) {
+        fprintf(stderr, "pam_setcred failed: %s\n", pam_strerror(pamh, retval));
+        session_report_failure(target->exec_fd, EPERM);
+        pam_end(pamh, retval);
+        return 1;
+    }
+    retval = pam_open_session(pamh, 0);
+    if (retval != PAM_SUCCESS) {
+        fprintf(stderr, "pam_open_session failed: %s\n", pam_strerror(pamh, retval));
+        session_report_failure(target->exec_fd, EPERM);
+        pam_setcred(pamh, PAM_DELETE_CRED);
+        pam_end(pamh, retval);
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        start_session(pamh, username, session, target);
+        _exit(1);
+    }
+    if (pid < 0) {
+        session_report_failure(target->exec_fd, errno);
+    }
+    // Дальше канал держит только процесс сессии - до своего exec
+    if (target->exec_fd >= 0) {
+        close(target->exec_fd);
+    }
+
+    int status = 0;
+    while (pid > 0 && waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+
+    retval = pam_close_session(pamh, 0);
+    pam_setcred(pamh, PAM_DELETE_CRED);
+    pam_end(pamh, retval);
+    return pid > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+// Помощник сессии (--session-child FD): свежий однопоточный процесс ведёт PAM от входа
+// до закрытия сессии. Порядок в канале: AuthRequest, вопросы и ответы, RESULT, SessionRequest;
+// дальше канал замеряет exec. Закрытый демоном канал - отмена
+int session_child(int fd) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    AuthRequest request;
+    if (recv(fd, &request, sizeof(request), 0) != sizeof(request)) {
+        return 1;
+    }
+    request.fd = fd;
+    options.pam_service = request.pam_service;
+    config.session_profile = request.session_profile;
+
+    pam_handle_t *pamh = NULL;
+    int ok;
+    if (request.autologin) {
+        ok = autologin_account(request.username, &pamh);
+    } else {
+        struct timespec start;
+        stats_begin(&start);
+        ok = authenticate(&request, &pamh);
+
+        AuthMessage message;
+        memset(&message, 0, sizeof(message));
+        message.type = AUTH_MSG_RESULT;
+        message.result = ok;
+        message.ms = elapsed_ms(&start);
+        if (send(fd, &message, sizeof(message), MSG_NOSIGNAL) != sizeof(message) && ok) {
+            // Вход отменён - дескриптор никому не достанется
+            pam_end(pamh, PAM_SUCCESS);
+            ok = 0;
+        }
+    }
+    explicit_bzero(request.password, sizeof(request.password));
+    if (!ok) {
+        return 1;
+    }
+
+    SessionRequest session;
+    if (recv(fd, &session, sizeof(session), 0) != sizeof(session)) {
+        // Отмена или замер: сессию не открываем
+        pam_end(pamh, PAM_SUCCESS);
+        return 0;
+    }
+    SessionTarget target = {
+        .display = session.display,
+        .seat = session.seat[0] ? session.seat : NULL,
+        .vt = session.vt,
+        .remote_host = session.remote_host[0] ? session.remote_host : NULL,
+        .cookie = session.has_cookie ? session.cookie : NULL,
+        .exec_fd = fd,
+    };
+    if (request.autologin) {
+        // Автовход без замера: демон закрыл свой конец сразу после запросов
+        close(fd);
+        target.exec_fd = -1;
+    }
+    return session_run(pamh, request.username, &session.session, &target);
+}
+
+void auth_succeeded(DisplayManager *dm) {
+    if (options.bench_script) {
+        // В замере сессию не запускаем: по закрытому каналу помощник закончит PAM сам
+        auth_cancel(dm);
+        show_warning(dm, "Authentication successful");
+        return;
+    }
+
+    printf("Authentication successful! Starting session...\n");
+
+    // Помощник становится лидером сессии, его канал - замером exec (см. session_exec_done)
+    pid_t pid = dm->auth_pid;
+    int fd = dm->auth_fd;
+    watch_set(&dm->watches[WATCH_AUTH], -1);
+    dm->auth_fd = -1;
+    dm->auth_pid = 0;
+    dm->auth_prompting = 0;
+    mark_login_dirty(dm);
+
+    // Приветствие остаётся жить: после выхода из сессии оно вернётся без перезапуска X
+    greeter_hide(dm);
+
+    SessionRequest request;
+    session_request_fill(&request, dm, &dm->sessions[dm->selected_session]);
+    if (send(fd, &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+        perror("session request");
+        close(fd);
+        seats_orphan(pid);
+        greeter_show(dm);
+        show_error(dm, "Failed to start session");
+        return;
+    }
+    dm->exec_fd = fd;
+    watch_set(&dm->watches[WATCH_EXEC], dm->exec_fd);
+    session_track(dm, pid);
+}
+
+// Обработка сообщения от помощника сессии
+void auth_handle_message(DisplayManager *dm) {
+    AuthMessage message;
+    ssize_t n = recv(dm->auth_fd, &message, sizeof(message), MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n != sizeof(message)) {
+        auth_cancel(dm);
+        show_error(dm, "Authentication aborted");
+        return;
+    }
+
+    switch (message.type) {
+        case AUTH_MSG_PROMPT_ECHO_OFF:
+        case AUTH_MSG_PROMPT_ECHO_ON:
+            dm->auth_prompting = 1;
+            dm->auth_prompt_echo = message.type == AUTH_MSG_PROMPT_ECHO_ON;
+            snprintf(dm->auth_prompt, sizeof(dm->auth_prompt), "%s", message.text);
+            dm->password_focus = 1;
+            explicit_bzero(dm->password, sizeof(dm->password));
+            mark_login_dirty(dm);
+            break;
+        case AUTH_MSG_INFO:
+            show_warning(dm, message.text);
+            break;
+        case AUTH_MSG_ERROR:
+            show_error(dm, message.text);
+            break;
+        case AUTH_MSG_RESULT:
+            stats_record(STAT_AUTHENTICATE, message.ms);
+            if (message.result) {
+                auth_succeeded(dm);
+                break;
+            }
+            auth_cancel(dm);
+            printf("Authentication failed!\n");
+            show_error(dm, "Invalid password");
+            break;
+    }
+}
+
+// Клавиши вне поля пароля: поиск по мере набора и листание списка пользователей
+void handle_search_key(DisplayManager *dm, KeySym key, char ch) {
+    size_t len = strlen(dm->search);
+
+    switch (key) {
+        case XK_Up:
+            scroll_users(dm, -1);
+            return;
+        case XK_Down:
+            scroll_users(dm, 1);
+            return;
+        case XK_Prior:
+            scroll_users(dm, -users_per_page(dm));
+            return;
+        case XK_Next:
+            scroll_users(dm, users_per_page(dm));
+            return;
+        case XK_Return:
+            if (dm->first_visible < dm->visible_count) {
+                select_user(dm, dm->visible_users[dm->first_visible]);
+            }
+            return;
+        case XK_Escape:
+            dm->search[0] = '\0';
+            break;
+        case XK_BackSpace:
+            if (len == 0) {
+                return;
+            }
+            dm->search[len - 1] = '\0';
+            break;
+        default:
+            if (ch < 32 || ch > 126 || len >= sizeof(dm->search) - 1) {
+                return;
+            }
+            dm->search[len] = ch;
+            dm->search[len + 1] = '\0';
+            break;
+    }
+
+    dm->first_visible = 0;
+    update_user_view(dm);
+}
+
+void handle_key_press(DisplayManager *dm, XKeyEvent *event) {
+    char keybuf[8];
+    KeySym key;
+    if (XLookupString(event, keybuf, sizeof(keybuf), &key, NULL) == 0) {
+        keybuf[0] = '\0';
+    }
+
+    // Во время проверки принимаем только отмену и ответы на вопросы PAM
+    if (dm->auth_fd >= 0 && key == XK_Escape) {
+        auth_cancel(dm);
+        return;
+    }
+    if (dm->auth_fd >= 0 && !dm->auth_prompting) {
+        return;
+    }
+
+    if (dm->password_active && dm->password_focus) {
+        mark_widget_dirty(dm, WIDGET_PASSWORD_FIELD, 0);
+
+        if (key == XK_Return) {
+            if (dm->auth_prompting) {
+                auth_answer(dm);
+            } else {
+                auth_start(dm);
+            }
+        } else if (key == XK_BackSpace) {
+            if (strlen(dm->password) > 0) {
+                dm->password[strlen(dm->password)-1] = '\0';
+            }
+        } else if (keybuf[0] >= 32 && keybuf[0] <= 126) {
+            if (strlen(dm->password) < sizeof(dm->password)-1) {
+                strncat(dm->password, keybuf, 1);
+            }
+        }
+    } else {
+        handle_search_key(dm, key, keybuf[0]);
+    }
+}
+
+// Индикатор ожидания: точки по кругу, одна подсвечена
+void draw_spinner(RenderTarget *rt, const DisplayManager *dm, Rect r) {
+    int cx = r.x + r.width / 2;
+    int cy = r.y + r.height / 2;
+    for (int i = 0; i < SPINNER_DOTS; i++) {
+        double angle = 2 * M_PI * i / SPINNER_DOTS;
+        int x = cx + (int)lround(cos(angle) * (r.width / 2 - 4));
+        int y = cy + (int)lround(sin(angle) * (r.height / 2 - 4));
+        int active = i == dm->spinner_phase;
+        draw_rounded_rect(rt, x - 3, y - 3, 6, 6, 3, active ? plan.colors.highlight : plan.colors.user_bg);
+    }
+}
+
+// Строка поиска или положение в списке
+void draw_status(RenderTarget *rt, const DisplayManager *dm, Rect r) {
+    char status[64];
+    if (dm->search[0]) {
+        snprintf(status, sizeof(status), "Search: %s_", dm->search);
+    } else if (dm->visible_count > users_per_page(dm)) {
+        int last = dm->first_visible + users_per_page(dm);
+        snprintf(status, sizeof(status), "Users %d-%d of %d%s", dm->first_visible + 1,
+                 last < dm->visible_count ? last : dm->visible_count, dm->visible_count,
+                 dm->users->loading ? "..." : "");
+    } else {
+        return;
+    }
+    draw_text(rt, r.x, r.y + 25, status, strlen(status), plan.colors.text);
+}
+
+void draw_user_card(RenderTarget *rt, const DisplayManager *dm, int index, Rect r) {
+    const User *user = &dm->users->users[index];
+    int selected = dm->password_active && index == dm->selected_user;
+
+    // Фон пользователя
+    draw_rounded_rect(rt, r.x, r.y, r.width, r.height, 20,
+                      selected ? plan.colors.user_selected : plan.colors.user_bg);
+
+    // Аватарка
+    int avatar = plan.layout.avatar_size;
+    draw_user_avatar(rt, avatar_find(dm->avatars, user->username), r.x + 30, r.y + (r.height - avatar) / 2,
+                     selected);
+
+    // Имя пользователя
+    draw_text(rt, r.x + 20 + avatar, r.y + r.height / 2 + 5, user->display_name, strlen(user->display_name),
+              plan.colors.text);
+}
+
+// Поле ввода (подсвечиваем если в фокусе)
+void draw_password_field(RenderTarget *rt, const DisplayManager *dm, Rect r) {
+    unsigned long pass_color = dm->password_focus ? plan.colors.pass_focus : 0xffffff;
+    draw_rounded_rect(rt, r.x, r.y, r.width, r.height, 20, pass_color);
+
+    // Текст пароля
+    int password_length = strlen(dm->password);
+    if (password_length > 0) {
+        // Пароль в кадр не копируется: рисуем нужное число звёздочек из константы.
+        // Ответы на открытые вопросы PAM показываем как есть
+        static const char stars[sizeof(((DisplayManager*)0)->password)] =
+            "***************************************************************";
+        const char *text = dm->auth_prompting && dm->auth_prompt_echo ? dm->password : stars;
+
+        // Центрируем текст пароля
+        int width = text_width(dm, text, password_length);
+        draw_text(rt, r.x + r.width/2 - width/2, r.y + 40, text, password_length, 0x000000);
+    } else if (dm->password_focus && dm->blink_visible) {
+        // Мигающий курсор когда поле в фокусе и пустое
+        draw_text(rt, r.x + 10, r.y + 40, "|", 1, 0x000000);
+    }
+}
+
+// Текст по центру узла
+void draw_centered_text(RenderTarget *rt, const DisplayManager *dm, Rect r, const char *text, unsigned long color) {
+    int width = text_width(dm, text, strlen(text));
+    draw_text(rt, r.x + r.width/2 - width/2, r.y + 30, text, strlen(text), color);
+}
+
+void draw_notification(RenderTarget *rt, const DisplayManager *dm, int slot, Rect r) {
+    if (slot == 0) {
+        draw_rounded_rect(rt, r.x, r.y, r.width, r.height, 15, 0xff4444);
+        draw_text(rt, r.x + 10, r.y + 25, "Error:", 6, 0xffffff);
+        draw_text(rt, r.x + 10, r.y + 45, dm->error_message, strlen(dm->error_message), 0xffffff);
+    } else {
+        draw_rounded_rect(rt, r.x, r.y, r.width, r.height, 15, 0xffcc00);
+        draw_text(rt, r.x + 10, r.y + 25, "Warning:", 8, 0x000000);
+        draw_text(rt, r.x + 10, r.y + 45, dm->warning_message, strlen(dm->warning_message), 0x000000);
+    }
+}
+
+// Обход сцены в порядке отрисовки; узлы вне области отсечения пропускаются
+void draw_interface(RenderTarget *rt, const DisplayManager *dm) {
+    // Рисуем градиентный фон
+    draw_gradient_background(rt, dm);
+
+    for (int i = 0; i < dm->scene.count; i++) {
+        const Widget *w = &dm->scene.widgets[i];
+        Rect r = w->bounds;
+        if (!rects_touch(&r, &rt->clip)) {
+            continue;
+        }
+
+        switch (w->type) {
+            case WIDGET_USER_LIST:
+                break;
+            case WIDGET_STATUS:
+                draw_status(rt, dm, r);
+                break;
+            case WIDGET_USER_CARD:
+                draw_user_card(rt, dm, w->index, r);
+                break;
+            case WIDGET_LOGIN_PANEL:
+                draw_rounded_rect(rt, r.x, r.y, r.width, r.height, 30, plan.colors.pass_bg);
+                break;
+            case WIDGET_PROMPT:
+                draw_text(rt, r.x, r.y + 20,
+                          dm->auth_prompting ? dm->auth_prompt : "Enter Password:",
+                          dm->auth_prompting ? strlen(dm->auth_prompt) : 15, plan.colors.text);
+                break;
+            case WIDGET_PASSWORD_FIELD:
+                draw_password_field(rt, dm, r);
+                break;
+            case WIDGET_SPINNER:
+                draw_spinner(rt, dm, r);
+                break;
+            case WIDGET_SESSION_BUTTON: {
+                // Кнопка выбора сессии
+                draw_rounded_rect(rt, r.x, r.y, r.width, r.height, 20, plan.colors.accent1);
+                char session_text[SESSION_NAME_MAX + 16];
+                if (dm->session_count > 0) {
+                    snprintf(session_text, sizeof(session_text), "Session: %s ▼",
+                             dm->sessions[dm->selected_session].name);
+                } else {
+                    strcpy(session_text, "No sessions available");
+                }
+                draw_centered_text(rt, dm, r, session_text, plan.colors.text);
+                break;
+            }
+            case WIDGET_SESSION_LIST:
+                draw_rounded_rect(rt, r.x, r.y, r.width, r.height, 20, 0xffffff);
+                break;
+            case WIDGET_SESSION_ITEM: {
+                int selected = w->index == dm->selected_session;
+                if (selected) {
+                    draw_rounded_rect(rt, r.x, r.y, r.width, r.height, 20, plan.colors.highlight);
+                }
+                draw_centered_text(rt, dm, r, dm->sessions[w->index].name, selected ? 0xffffff : 0x000000);
+                break;
+            }
+            case WIDGET_NOTIFICATION:
+                draw_notification(rt, dm, w->index, r);
+                break;
+        }
+    }
+
+    // Программный курсор мыши
+    if (dm->software_cursor) {
+        draw_mouse_cursor(rt, dm->mouse_x, dm->mouse_y);
+    }
+    
+    XFlush(rt->display);
+}
+
+// Следим за заменой /etc/passwd (useradd, vipw пишут новый файл и переименовывают)
+int watch_passwd(void) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (inotify_add_watch(fd, "/etc", IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Каталог общий для всех мест: после его изменения пересчитываются списки каждого места
+static void seats_users_changed(void) {
+    for (int i = 0; i < seats.count; i++) {
+        DisplayManager *dm = seats.seats[i];
+        if (dm->opened) {
+            restore_selected_user(dm);
+            update_user_view(dm);
+            dm->wake = 1;
+        }
+    }
+}
+
+void handle_passwd_change(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+
+    while ((len = read(seats.passwd_watch.fd, buf, sizeof(buf))) > 0) {
+        for (char *ptr = buf; ptr < buf + len; ) {
+            const struct inotify_event *event = (const struct inotify_event*)ptr;
+            if (event->len && strcmp(event->name, "passwd") == 0) {
+                changed = 1;
+            }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    if (!changed) {
+        return;
+    }
+
+    // getpwent хранит одно глобальное состояние - начатое перечисление начинаем заново
+    if (seats.users.loading) {
+        // Выбор восстановится по имени, когда пользователь снова попадёт в каталог
+        endpwent();
+        user_directory_free(&seats.users);
+        user_directory_begin(&seats.users);
+        seats_users_changed();
+    } else {
+        if (seats.users_pending.loading) {
+            endpwent();
+        }
+        user_directory_free(&seats.users_pending);
+        user_directory_begin(&seats.users_pending);
+    }
+}
+
+// Очередная порция перечисления пользователей; возвращает 1, пока работа не закончена
+int continue_user_loading(void) {
+    if (seats.users.loading) {
+        if (user_directory_step(&seats.users, USER_LOAD_BATCH)) {
+            seats_users_changed();
+        }
+        if (!seats.users.loading) {
+            timeline_mark("users: enumeration complete");
+        }
+        return seats.users.loading;
+    }
+
+    if (seats.users_pending.loading) {
+        user_directory_step(&seats.users_pending, USER_LOAD_BATCH);
+        if (!seats.users_pending.loading) {
+            // Новый каталог готов целиком - подменяем на месте, указатели мест остаются верными
+            user_directory_free(&seats.users);
+            seats.users = seats.users_pending;
+            memset(&seats.users_pending, 0, sizeof(UserDirectory));
+            seats_users_changed();
+        }
+        return seats.users_pending.loading;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Пул задних буферов. Размеры округляются вверх до класса BUFFER_SIZE_CLASS,
+// поэтому серия изменений размера обычно попадает в уже выделенный Pixmap.
+// Пул владеет всеми Pixmap'ами, при переполнении вытесняется давно не нужный.
+// ---------------------------------------------------------------------------
+
+Pixmap buffer_pool_acquire(DisplayManager *dm, int width, int height) {
+    BufferPool *pool = &dm->buffers;
+    int class_width = size_class(width), class_height = size_class(height);
+    pool->clock++;
+
+    // Точное совпадение класса, иначе наименьший подходящий
+    int best = -1;
+    for (int i = 0; i < pool->count; i++) {
+        PooledBuffer *entry = &pool->entries[i];
+        if (entry->width < width || entry->height < height) {
+            continue;
+        }
+        if (entry->width == class_width && entry->height == class_height) {
+            best = i;
+            break;
+        }
+        if (best < 0 || (long)entry->width * entry->height <
+                        (long)pool->entries[best].width * pool->entries[best].height) {
+            best = i;
+        }
+    }
+    if (best >= 0) {
+        pool->entries[best].last_used = pool->clock;
+        return pool->entries[best].pixmap;
+    }
+
+    int index;
+    if (pool->count < BUFFER_POOL_SIZE) {
+        index = pool->count++;
+    } else {
+        index = 0;
+        for (int i = 1; i < pool->count; i++) {
+            if (pool->entries[i].last_used < pool->entries[index].last_used) {
+                index = i;
+            }
+        }
+        XFreePixmap(dm->display, pool->entries[index].pixmap);
+    }
+
+    PooledBuffer *entry = &pool->entries[index];
+    entry->pixmap = XCreatePixmap(dm->display, dm->window, class_width, class_height,
+                                  DefaultDepth(dm->display, dm->screen));
+    entry->width = class_width;
+    entry->height = class_height;
+    entry->last_used = pool->clock;
+    return entry->pixmap;
+}
+
+void buffer_pool_free(DisplayManager *dm) {
+    for (int i = 0; i < dm->buffers.count; i++) {
+        XFreePixmap(dm->display, dm->buffers.entries[i].pixmap);
+    }
+    dm->buffers.count = 0;
+}
+
+// Новый размер окна - один раз за пробуждение, сколько бы ConfigureNotify ни пришло.
+// Фон пересчитается при следующем кадре
+void apply_resize(DisplayManager *dm, int width, int height, Pixmap *buffer) {
+    dm->width = width;
+    dm->height = height;
+
+    Pixmap next = buffer_pool_acquire(dm, width, height);
+    if (next != *buffer) {
+        *buffer = next;
+        if (dm->buffer_draw) {
+            XftDrawChange(dm->buffer_draw, next);
+        }
+    }
+    if (dm->fb) {
+        fb_resize(dm);
+    }
+    dm->background_stale = 1;
+    update_user_view(dm);
+    mark_all_dirty(dm);
+}
+
+
+// Перерисовка накопленных повреждений. Состояние интерфейса передаётся по указателю
+// только для чтения - за кадр ничего не копируется и не выделяется
+void render_damage(DisplayManager *dm, Pixmap buffer, GC buffer_gc) {
+    struct timespec frame_start, start;
+    stats_frame_begin(dm->display);
+    stats_begin(&frame_start);
+
+    if (dm->background_stale) {
+        render_background(dm);
+        dm->background_stale = 0;
+    }
+
+    RenderTarget rt;
+    rt.display = dm->display;
+    rt.clip = damage_bounds(dm);
+    rt.text = dm->text;
+    rt.font = dm->font;
+    rt.xft = NULL;
+
+    if (dm->fb) {
+        // Растеризуем охватывающую область повреждений и выводим её одним XShmPutImage
+        rt.drawable = dm->window;
+        rt.gc = dm->gc;
+        rt.fb = dm->fb;
+        dm->fb->clip = rt.clip;
+        stats_begin(&start);
+        draw_interface(&rt, dm);
+        stats_end(STAT_DRAW, &start);
+
+        stats_begin(&start);
+        fb_present(dm, rt.clip);
+        stats_end(STAT_PRESENT, &start);
+        dm->damage.count = 0;
+        stats_frame_end(dm->display, &frame_start);
+        return;
+    }
+
+    // Отрисовываем в буфер только грязные области
+    XRectangle clip[MAX_DIRTY_RECTS];
+    for (int i = 0; i < dm->damage.count; i++) {
+        clip[i].x = dm->damage.rects[i].x;
+        clip[i].y = dm->damage.rects[i].y;
+        clip[i].width = dm->damage.rects[i].width;
+        clip[i].height = dm->damage.rects[i].height;
+    }
+    XSetClipRectangles(dm->display, buffer_gc, 0, 0, clip, dm->damage.count, Unsorted);
+    // Xft рисует через XRender и отсечение GC не видит
+    if (dm->buffer_draw) {
+        XftDrawSetClipRectangles(dm->buffer_draw, 0, 0, clip, dm->damage.count);
+    }
+
+    rt.drawable = buffer;
+    rt.gc = buffer_gc;
+    rt.fb = NULL;
+    rt.xft = dm->buffer_draw;
+    stats_begin(&start);
+    draw_interface(&rt, dm);
+    stats_end(STAT_DRAW, &start);
+    XSetClipMask(dm->display, buffer_gc, None);
+
+    // Копируем на экран только изменившиеся области
+    stats_begin(&start);
+    for (int i = 0; i < dm->damage.count; i++) {
+        Rect *r = &dm->damage.rects[i];
+        XCopyArea(dm->display, buffer, dm->window, dm->gc,
+                  r->x, r->y, r->width, r->height, r->x, r->y);
+    }
+    dm->damage.count = 0;
+    XFlush(dm->display);
+    stats_end(STAT_PRESENT, &start);
+    stats_frame_end(dm->display, &frame_start);
+}
+
+// ---------------------------------------------------------------------------
+// Режим замера (--bench): сценарий вводится через XTest, для каждого шага
+// меряется время от подачи ввода до выведенного кадра.
+//
+// Формат сценария, по команде на строку (# - комментарий):
+//   move X Y                  - перевести указатель
+//   sweep X1 Y1 X2 Y2 STEPS   - протянуть указатель по прямой
+//   click X Y [BUTTON]        - нажать и отпустить кнопку мыши
+//   type TEXT                 - набрать текст
+//   key KEYSYM                - нажать клавишу (Return, BackSpace, Escape...)
+//   resize W H                - изменить размер окна
+//   storm W1 H1 W2 H2 COUNT   - COUNT изменений размера подряд без ожидания, попеременно
+//   wait MS                   - пауза (таймеры, помощник сессии)
+//   repeat N ... end          - повторить блок N раз
+// ---------------------------------------------------------------------------
+
+static int bench_add_step(Bench *bench, const BenchStep *step) {
+    if (bench->count == bench->capacity) {
+        int capacity = bench->capacity ? bench->capacity * 2 : 64;
+        BenchStep *steps = realloc(bench->steps, capacity * sizeof(BenchStep));
+        if (!steps) {
+            return 0;
+        }
+        bench->steps = steps;
+        bench->capacity = capacity;
+    }
+    bench->steps[bench->count++] = *step;
+    return 1;
+}
+
+int bench_load(Bench *bench, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open benchmark script %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    int repeat_start[BENCH_REPEAT_DEPTH], repeat_count[BENCH_REPEAT_DEPTH];
+    int depth = 0;
+    int line_number = 0;
+    char line[256];
+    int ok = 1;
+
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_number++;
+        line[strcspn(line, "#\n")] = '\0';
+
+        char command[16];
+        int consumed = 0;
+        if (sscanf(line, "%15s %n", command, &consumed) != 1) {
+            continue;
+        }
+        const char *rest = line + consumed;
+
+        BenchStep step;
+        memset(&step, 0, sizeof(step));
+        int *a = step.args;
+        int valid = 1;
+
+        if (strcmp(command, "move") == 0) {
+            step.op = BENCH_MOVE;
+            valid = sscanf(rest, "%d %d", &a[0], &a[1]) == 2;
+        } else if (strcmp(command, "sweep") == 0) {
+            step.op = BENCH_SWEEP;
+            valid = sscanf(rest, "%d %d %d %d %d", &a[0], &a[1], &a[2], &a[3], &a[4]) == 5 && a[4] > 0;
+        } else if (strcmp(command, "click") == 0) {
+            step.op = BENCH_CLICK;
+            a[2] = Button1;
+            valid = sscanf(rest, "%d %d %d", &a[0], &a[1], &a[2]) >= 2;
+        } else if (strcmp(command, "type") == 0) {
+            step.op = BENCH_TYPE;
+            snprintf(step.text, sizeof(step.text), "%s", rest);
+            valid = step.text[0] != '\0';
+        } else if (strcmp(command, "key") == 0) {
+            step.op = BENCH_KEY;
+            valid = sscanf(rest, "%63s", step.text) == 1 && XStringToKeysym(step.text) != NoSymbol;
+        } else if (strcmp(command, "resize") == 0) {
+            step.op = BENCH_RESIZE;
+            valid = sscanf(rest, "%d %d", &a[0], &a[1]) == 2 && a[0] > 0 && a[1] > 0;
+        } else if (strcmp(command, "storm") == 0) {
+            step.op = BENCH_STORM;
+            valid = sscanf(rest, "%d %d %d %d %d", &a[0], &a[1], &a[2], &a[3], &a[4]) == 5 &&
+                    a[0] > 0 && a[1] > 0 && a[2] > 0 && a[3] > 0 && a[4] > 0;
+        } else if (strcmp(command, "wait") == 0) {
+            step.op = BENCH_WAIT;
+            // Отрицательная пауза стала бы бесконечным таймаутом epoll
+            valid = sscanf(rest, "%d", &a[0]) == 1 && a[0] >= 0;
+        } else if (strcmp(command, "repeat") == 0) {
+            valid = depth < BENCH_REPEAT_DEPTH && sscanf(rest, "%d", &repeat_count[depth]) == 1 &&
+                    repeat_count[depth] >= 1;
+            if (valid) {
+                repeat_start[depth++] = bench->count;
+            }
+            goto check;
+        } else if (strcmp(command, "end") == 0) {
+            valid = depth > 0;
+            if (valid) {
+                // Разворачиваем блок сразу: исполнитель видит плоский список шагов
+                depth--;
+                int start = repeat_start[depth];
+                int length = bench->count - start;
+                for (int r = 1; r < repeat_count[depth] && ok; r++) {
+                    for (int i = 0; i < length && ok; i++) {
+                        BenchStep copy = bench->steps[start + i];
+                        ok = bench_add_step(bench, &copy);
+                    }
+                }
+            }
+            goto check;
+        } else {
+            valid = 0;
+        }
+
+        if (valid) {
+            ok = bench_add_step(bench, &step);
+        }
+    check:
+        if (!valid) {
+            fprintf(stderr, "%s:%d: invalid benchmark command\n", path, line_number);
+            ok = 0;
+        }
+    }
+    fclose(file);
+
+    if (ok && depth > 0) {
+        fprintf(stderr, "%s: 'repeat' without 'end'\n", path);
+        ok = 0;
+    }
+    return ok;
+}
+
+void bench_free(Bench *bench) {
+    free(bench->steps);
+    free(bench->latencies);
+    memset(bench, 0, sizeof(Bench));
+}
+
+static void bench_type_char(Display *display, char c) {
+    KeySym sym = c == ' ' ? XK_space : (KeySym)(unsigned char)c;
+    KeyCode code = XKeysymToKeycode(display, sym);
+    KeyCode shift = XKeysymToKeycode(display, XK_Shift_L);
+    int shifted = isupper((unsigned char)c) || strchr("~!@#$%^&*()_+{}|:\"<>?", c) != NULL;
+    if (code == 0) {
+        return;
+    }
+    if (shifted) XTestFakeKeyEvent(display, shift, True, CurrentTime);
+    XTestFakeKeyEvent(display, code, True, CurrentTime);
+    XTestFakeKeyEvent(display, code, False, CurrentTime);
+    if (shifted) XTestFakeKeyEvent(display, shift, False, CurrentTime);
+}
+
+// Подаёт следующую порцию ввода. Возвращает таймаут poll: 0 - ввод подан,
+// >0 - идёт пауза; по концу сценария выставляет bench->done
+int bench_next(DisplayManager *dm, Bench *bench) {
+    if (bench->pending) {
+        return 0;
+    }
+    if (bench->resume.tv_sec || bench->resume.tv_nsec) {
+        double left = -elapsed_ms(&bench->resume);
+        if (left > 0) {
+            return (int)ceil(left);
+        }
+        bench->resume.tv_sec = bench->resume.tv_nsec = 0;
+    }
+    if (bench->current >= bench->count) {
+        bench->done = 1;
+        return 0;
+    }
+
+    const BenchStep *step = &bench->steps[bench->current];
+    const int *a = step->args;
+    Display *display = dm->display;
+    int finished = 1;
+
+    stats_begin(&bench->injected);
+    switch (step->op) {
+        case BENCH_MOVE:
+            XTestFakeMotionEvent(display, dm->screen, a[0], a[1], CurrentTime);
+            break;
+        case BENCH_SWEEP: {
+            int i = ++bench->progress;
+            XTestFakeMotionEvent(display, dm->screen, a[0] + (a[2] - a[0]) * i / a[4],
+                                 a[1] + (a[3] - a[1]) * i / a[4], CurrentTime);
+            finished = i >= a[4];
+            break;
+        }
+        case BENCH_CLICK:
+            XTestFakeMotionEvent(display, dm->screen, a[0], a[1], CurrentTime);
+            XTestFakeButtonEvent(display, a[2], True, CurrentTime);
+            XTestFakeButtonEvent(display, a[2], False, CurrentTime);
+            break;
+        case BENCH_TYPE:
+            bench_type_char(display, step->text[bench->progress++]);
+            finished = step->text[bench->progress] == '\0';
+            break;
+        case BENCH_KEY: {
+            KeyCode code = XKeysymToKeycode(display, XStringToKeysym(step->text));
+            XTestFakeKeyEvent(display, code, True, CurrentTime);
+            XTestFakeKeyEvent(display, code, False, CurrentTime);
+            break;
+        }
+        case BENCH_RESIZE:
+            XResizeWindow(display, dm->window, a[0], a[1]);
+            break;
+        case BENCH_STORM:
+            // Все события придут в одно пробуждение и должны свестись к одному кадру
+            for (int i = 0; i < a[4]; i++) {
+                XResizeWindow(display, dm->window, i % 2 ? a[2] : a[0], i % 2 ? a[3] : a[1]);
+            }
+            break;
+        case BENCH_WAIT:
+            stats_begin(&bench->resume);
+            bench->resume.tv_sec += a[0] / 1000;
+            bench->resume.tv_nsec += (a[0] % 1000) * 1000000L;
+            if (bench->resume.tv_nsec >= 1000000000L) {
+                bench->resume.tv_sec++;
+                bench->resume.tv_nsec -= 1000000000L;
+            }
+            break;
+    }
+
+    if (finished) {
+        bench->current++;
+        bench->progress = 0;
+    }
+    if (step->op == BENCH_WAIT) {
+        return a[0];
+    }
+
+    // После ответа на XSync порождённые вводом события уже лежат в очереди Xlib
+    XSync(display, False);
+    stats_round_trip();
+    bench->pending = 1;
+    return 0;
+}
+
+// Вызывается после обработки событий: кадр по поданному вводу выведен или не понадобился
+void bench_frame_done(Bench *bench, int rendered) {
+    if (!bench->pending) {
+        return;
+    }
+    bench->pending = 0;
+    if (!rendered) {
+        bench->no_frame++;
+        return;
+    }
+
+    if (bench->latency_count == bench->latency_capacity) {
+        int capacity = bench->latency_capacity ? bench->latency_capacity * 2 : 256;
+        double *latencies = realloc(bench->latencies, capacity * sizeof(double));
+        if (!latencies) {
+            return;
+        }
+        bench->latencies = latencies;
+        bench->latency_capacity = capacity;
+    }
+    bench->latencies[bench->latency_count++] = elapsed_ms(&bench->injected);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int count, double p) {
+    if (count == 0) {
+        return 0;
+    }
+    int rank = (int)ceil(p / 100.0 * count);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void bench_report(Bench *bench, FILE *out) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    qsort(bench->latencies, bench->latency_count, sizeof(double), compare_doubles);
+
+    const double *l = bench->latencies;
+    int n = bench->latency_count;
+    fprintf(out, "Benchmark: %d frames, %d inputs without a frame, %.1f ms wall\n",
+            n, bench->no_frame, elapsed_ms(&bench->started));
+    fprintf(out, "  latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+            percentile(l, n, 50), percentile(l, n, 90), percentile(l, n, 99), n ? l[n - 1] : 0.0);
+    fprintf(out, "  cpu s: user %.3f  system %.3f\n",
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+    fprintf(out, "  x: %lu requests (max %lu per frame), %lu bytes, %lu round trips\n",
+            stats.x_requests, stats.max_requests_per_frame, stats.x_bytes_flushed, stats.x_round_trips);
+}
+
+// Первый кадр на экране - конец хронологии запуска
+void first_frame(DisplayManager *dm) {
+    if (dm->first_frame_done) {
+        return;
+    }
+    dm->first_frame_done = 1;
+    splash_release(dm);
+    XSync(dm->display, False);
+    stats_round_trip();
+    stats_first_pixel("first frame");
+    // Хронология общая для процесса - печатаем по первому месту
+    static int timeline_printed;
+    if (!timeline_printed) {
+        timeline_printed = 1;
+        timeline_print(stdout);
+        fflush(stdout);
+    }
+}
+
+static volatile sig_atomic_t stop_requested;
+
+// Только флаг: stdio, malloc и запись статистики в обработчике могли бы застать их посреди работы.
+// Цикл выйдет сам и уберёт места как обычно
+void signal_handler(int sig) {
+    stop_requested = 1;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--config PATH] [--display NAME[,NAME...]] [--pam-service NAME] [--bench SCRIPT]\n"
+                    "       [--autologin USER [--session ID] [--autologin-timeout SECONDS]] [--xdmcp | --xdmcp-only]\n", program);
+}
+
+// Сессия автовхода по id без построения всего списка
+int autologin_find_session(Session *session) {
+    if (!options.autologin_session) {
+        Session *sessions = NULL;
+        int count = get_sessions(&sessions);
+        if (count > 0) {
+            *session = sessions[0];
+        }
+        free(sessions);
+        return count > 0;
+    }
+    for (int i = 0; i < SESSION_DIR_COUNT; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s.desktop", session_dirs[i], options.autologin_session);
+        memset(session, 0, sizeof(Session));
+        if (parse_session_file(path, options.autologin_session, session)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Автовход: от готовности X сразу к сессии PAM, без окна, шрифтов и списка пользователей.
+// Учётную запись проверяет помощник сессии; откажет - он выйдет, и session_reap откроет окно входа
+int autologin(DisplayManager *dm) {
+    Session session;
+    if (!autologin_find_session(&session)) {
+        fprintf(stderr, "Autologin: session %s not found\n",
+                options.autologin_session ? options.autologin_session : "(any)");
+        return 0;
+    }
+
+    AuthRequest request;
+    memset(&request, 0, sizeof(request));
+    snprintf(request.username, sizeof(request.username), "%s", options.autologin_user);
+    request.autologin = 1;
+    int fd;
+    pid_t pid = session_child_start(&request, &fd);
+    if (pid < 0) {
+        perror("Autologin");
+        return 0;
+    }
+    // Оба запроса уже в очереди помощника: канал ему больше не нужен
+    SessionRequest session_request;
+    session_request_fill(&session_request, dm, &session);
+    if (send(fd, &session_request, sizeof(session_request), MSG_NOSIGNAL) != sizeof(session_request)) {
+        perror("Autologin");
+    }
+    close(fd);
+
+    printf("Autologin as %s, session %s\n", options.autologin_user, session.id);
+    timeline_mark("session started");
+    timeline_print(stdout);
+    fflush(stdout);
+
+    // Ждём выхода не здесь, а в общем цикле: остальные места, logind и XDMCP не стоят
+    session_track(dm, pid);
+    return 1;
+}
+
+// Останавливает запущенный нами X (при --display его нет)
+void stop_servers(DisplayManager *dm) {
+    if (dm->xserver_pid > 0) {
+        kill(dm->xserver_pid, SIGTERM);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Места (multi-seat). Один процесс ведёт все места logind из общего epoll:
+// у каждого места свой X, окно, буферы и таймер, а каталог пользователей,
+// список сессий, тема и фон общие. Места появляются и исчезают вместе с
+// файлами в /run/systemd/seats; без logind работает одно место seat0.
+// ---------------------------------------------------------------------------
+
+DisplayManager *seat_find(const char *seat) {
+    for (int i = 0; i < seats.count; i++) {
+        if (!seats.seats[i]->removed && strcmp(seats.seats[i]->seat, seat) == 0) {
+            return seats.seats[i];
+        }
+    }
+    return NULL;
+}
+
+// Общие данные загружаются при открытии первого окна, уже после показа заставки
+static void seats_load_shared(void) {
+    if (seats.shared_loaded) {
+        return;
+    }
+    seats.shared_loaded = 1;
+
+    // Первая порция пользователей - до первого кадра, остальное догружается в цикле
+    user_directory_begin(&seats.users);
+    user_directory_step(&seats.users, USER_LOAD_BATCH);
+    timeline_mark("users: first batch loaded");
+    watch_set(&seats.passwd_watch, watch_passwd());
+
+    seats.session_count = get_sessions(&seats.sessions);
+    timeline_mark("sessions loaded");
+}
+
+// Вместо exit() в Xlib: дисплей больше не отвечает, место уберёт цикл событий.
+// Дальнейшие запросы к этому Display Xlib молча отбрасывает
+static void seat_io_error(Display *display, void *data) {
+    DisplayManager *dm = data;
+    if (!dm->io_error) {
+        fprintf(stderr, "Lost connection to X server %s\n", dm->display_name);
+    }
+    dm->io_error = 1;
+}
+
+// Общий обработчик только глушит сообщение Xlib: место сообщит о потере само
+static int x_io_error(Display *display) {
+    return 0;
+}
+
+// Окно приветствия на готовом сервере места; 0 - дисплей не открылся
+int greeter_open(DisplayManager *dm) {
+    // Cookie из Accept действует только на это подключение
+    if (dm->has_cookie) {
+        XSetAuthorization(XDMCP_COOKIE_NAME, sizeof(XDMCP_COOKIE_NAME) - 1,
+                          (char*)dm->cookie, XDMCP_COOKIE_SIZE);
+    }
+    dm->display = XOpenDisplay(dm->display_name);
+    if (dm->has_cookie) {
+        XSetAuthorization(NULL, 0, NULL, 0);
+    }
+    if (!dm->display) {
+        fprintf(stderr, "Cannot open X display: %s\n", dm->display_name);
+        return 0;
+    }
+    
+    timeline_mark("display opened");
+    stats_attach(dm->display);
+    // Потеря сервера (выключенный терминал, упавший X) убирает место, а не весь процесс
+    XSetIOErrorExitHandler(dm->display, seat_io_error, dm);
+
+    int xtest_event, xtest_error, xtest_major, xtest_minor;
+    if (options.bench_script &&
+        !XTestQueryExtension(dm->display, &xtest_event, &xtest_error, &xtest_major, &xtest_minor)) {
+        fprintf(stderr, "XTest extension is required for --bench\n");
+        XCloseDisplay(dm->display);
+        dm->display = NULL;
+        return 0;
+    }
+    
+    dm->screen = DefaultScreen(dm->display);
+    outputs_init(dm);
+    
+    dm->window = XCreateSimpleWindow(dm->display, RootWindow(dm->display, dm->screen),
+                                     dm->primary_output.x, dm->primary_output.y, dm->width, dm->height, 0,
+                                     BlackPixel(dm->display, dm->screen),
+                                     BlackPixel(dm->display, dm->screen));
+    
+    XStoreName(dm->display, dm->window, "Modern Display Manager");
+     // Устанавливаем события
+    XSelectInput(dm->display, dm->window,
+                ExposureMask | KeyPressMask | ButtonPressMask |
+                ButtonReleaseMask | PointerMotionMask | StructureNotifyMask);
+
+    XSetWindowAttributes attrs;
+    attrs.override_redirect = True;
+    XChangeWindowAttributes(dm->display, dm->window, CWOverrideRedirect, &attrs);
+
+    cursor_init(dm);
+    if (!greeter_motion_mask(dm)) {
+        XSelectInput(dm->display, dm->window,
+                    ExposureMask | KeyPressMask | ButtonPressMask | ButtonReleaseMask | StructureNotifyMask);
+    }
+
+    dm->gc = XCreateGC(dm->display, dm->window, 0, NULL);
+    // Кадр прошлой загрузки - фон окна, сервер покажет его при отображении.
+    // Удалённому терминалу целый кадр по линии дороже, чем живое окно
+    dm->splash = options.bench_script || dm->remote ? None : splash_present(dm);
+
+    XMapWindow(dm->display, dm->window);
+    XRaiseWindow(dm->display, dm->window);
+    if (dm->splash != None) {
+        XFlush(dm->display);
+        stats_first_pixel("splash presented");
+    }
+
+    greeter_grab(dm);
+
+    XSetForeground(dm->display, dm->gc, WhitePixel(dm->display, dm->screen));
+    XSetBackground(dm->display, dm->gc, BlackPixel(dm->display, dm->screen));
+
+    // Загружаем большой шрифт DejaVu Sans Mono 18
+    dm->font = XLoadQueryFont(dm->display, plan.core_font);
+    if (!dm->font) {
+        dm->font = XLoadQueryFont(dm->display, "9x15");
+    }
+    if (dm->font) {
+        XSetFont(dm->display, dm->gc, dm->font->fid);
+    }
+    dm->text = text_init(dm);
+
+    // Получаем данные: у второго и следующих мест они уже готовы
+    seats_load_shared();
+    dm->sessions = seats.sessions;
+    dm->session_count = seats.session_count;
+    dm->selected_user = 0;
+    dm->password_active = 0;
+    dm->selected_session = 0;
+    dm->show_sessions = 0;
+    update_user_view(dm);
+
+    dm->avatars = avatar_init();
+
+    // Двойная буферизация для избежания мерцания
+    dm->buffer = buffer_pool_acquire(dm, dm->width, dm->height);
+    dm->buffer_gc = XCreateGC(dm->display, dm->buffer, 0, NULL);
+    // Без шрифта серверный текст в буфере рисовался бы шрифтом по умолчанию
+    if (dm->font) {
+        XSetFont(dm->display, dm->buffer_gc, dm->font->fid);
+    }
+    if (dm->text && dm->text->xft) {
+        dm->buffer_draw = XftDrawCreate(dm->display, dm->buffer, DefaultVisual(dm->display, dm->screen),
+                                        DefaultColormap(dm->display, dm->screen));
+    }
+    dm->gradient = plan.background;
+
+    // SHM через сеть не работает, а программный кадр пришлось бы слать целиком:
+    // удалённым дисплеям - серверная отрисовка, по линии идут только команды
+    if (!dm->remote && fb_init(dm)) {
+        printf("Using MIT-SHM software renderer\n");
+        stats.renderer = "shm";
+    } else {
+        stats.renderer = "xlib";
+        printf("MIT-SHM unavailable, using Xlib renderer\n");
+    }
+    render_background(dm);
+    outputs_update(dm);
+    mark_all_dirty(dm);
+
+    watch_set(&dm->watches[WATCH_X], ConnectionNumber(dm->display));
+    watch_set(&dm->watches[WATCH_AVATARS], dm->avatars ? dm->avatars->event_fd : -1);
+    dm->opened = 1;
+    dm->wake = 1;
+    return 1;
+}
+
+// Освобождает всё, что создал greeter_open; X места не трогает
+void greeter_close(DisplayManager *dm) {
+    if (!dm->display) {
+        return;
+    }
+    watch_set(&dm->watches[WATCH_X], -1);
+    watch_set(&dm->watches[WATCH_AVATARS], -1);
+    auth_cancel(dm);
+
+    free(dm->visible_users);
+    dm->visible_users = NULL;
+    scene_free(&dm->scene);
+    fb_destroy(dm);
+    outputs_free(dm);
+    if (dm->background != None) {
+        XFreePixmap(dm->display, dm->background);
+    }
+    splash_release(dm);
+    if (dm->buffer_draw) {
+        XftDrawDestroy(dm->buffer_draw);
+    }
+    text_free(dm->display, dm->text);
+    avatar_free(dm);
+    buffer_pool_free(dm);
+    if (dm->buffer_gc) {
+        XFreeGC(dm->display, dm->buffer_gc);
+    }
+
+    if (dm->font) {
+        XFreeFont(dm->display, dm->font);
+    }
+    XFreeGC(dm->display, dm->gc);
+    XFreeCursor(dm->display, dm->cursor);
+    XDestroyWindow(dm->display, dm->window);
+    XCloseDisplay(dm->display);
+    dm->display = NULL;
+    dm->opened = 0;
+}
+
+// Один проход места: события X, таймеры и кадр. Возвращает 1, если кадр нарисован;
+// в *timeout - срок для epoll, если таймеры не на timerfd (-1 - не нужен)
+int greeter_step(DisplayManager *dm, int *timeout) {
+    XEvent event;
+    int configured_width = dm->width, configured_height = dm->height;
+
+    // Обрабатываем все события
+    while (XPending(dm->display)) {
+        XNextEvent(dm->display, &event);
+
+        switch (event.type) {
+            case Expose:
+                mark_dirty(dm, event.xexpose.x, event.xexpose.y,
+                           event.xexpose.width, event.xexpose.height);
+                break;
+
+            case MotionNotify:
+                // Из накопившихся движений нужно только последнее
+                while (XCheckTypedWindowEvent(dm->display, dm->window, MotionNotify, &event)) {
+                }
+                dm->mouse_x = event.xmotion.x;
+                dm->mouse_y = event.xmotion.y;
+                break;
+
+            case ButtonPress:
+                dm->mouse_x = event.xbutton.x;
+                dm->mouse_y = event.xbutton.y;
+                dm->mouse_buttons |= (1 << (event.xbutton.button - 1));
+                handle_mouse_click(dm, event.xbutton.x, event.xbutton.y, event.xbutton.button);
+                break;
+
+            case ButtonRelease:
+                dm->mouse_x = event.xbutton.x;
+                dm->mouse_y = event.xbutton.y;
+                dm->mouse_buttons &= ~(1 << (event.xbutton.button - 1));
+                break;
+
+            case KeyPress:
+                handle_key_press(dm, &event.xkey);
+                break;
+
+            case ConfigureNotify:
+                // Запоминаем только последний размер, применяем после разбора очереди
+                configured_width = event.xconfigure.width;
+                configured_height = event.xconfigure.height;
+                break;
+
+            default:
+                if (dm->randr_event_base >= 0 &&
+                    event.type == dm->randr_event_base + RRScreenChangeNotify) {
+                    XRRUpdateConfiguration(&event);
+                    outputs_update(dm);
+                }
+                break;
+        }
+    }
+
+    if (configured_width != dm->width || configured_height != dm->height) {
+        apply_resize(dm, configured_width, configured_height, &dm->buffer);
+    }
+    update_cursor_damage(dm);
+
+    // Таймеры только помечают области; сроки следующих срабатываний ведёт timerfd
+    *timeout = update_timers(dm);
+    if (dm->timer_fd >= 0) {
+        arm_timer(dm->timer_fd, *timeout);
+        *timeout = -1;
+    }
+
+    // Раскладка пересчитывается только после изменений структуры интерфейса
+    scene_update(dm);
+
+    // Отклик на ввод выводим сразу, до фоновой работы
+    // Пока идёт сессия, окна приветствия скрыты - рисовать некуда
+    int rendered = dm->damage.count > 0 && dm->session_pid <= 0;
+    if (rendered) {
+        render_damage(dm, dm->buffer, dm->buffer_gc);
+        first_frame(dm);
+    }
+
+    // Спокойное окно входа сохраняем заставкой для следующей загрузки
+    if (!dm->splash_saved && !options.bench_script && !dm->remote && splash_idle(dm)) {
+        splash_save(dm, dm->buffer);
+        dm->splash_saved = 1;
+    }
+    return rendered;
+}
+
+// Окно отсчёта на сервере места; 0 - дисплей не открылся
+static int countdown_open(DisplayManager *dm) {
+    Countdown *c = &dm->countdown;
+    c->display = XOpenDisplay(dm->display_name);
+    if (!c->display) {
+        return 0;
+    }
+    XSetIOErrorExitHandler(c->display, seat_io_error, dm);
+    int screen = DefaultScreen(c->display);
+    c->width = DisplayWidth(c->display, screen);
+    c->height = DisplayHeight(c->display, screen);
+
+    XSetWindowAttributes attrs;
+    attrs.override_redirect = True;
+    attrs.background_pixel = BlackPixel(c->display, screen);
+    c->window = XCreateWindow(c->display, RootWindow(c->display, screen), 0, 0, c->width, c->height, 0,
+                              CopyFromParent, InputOutput, CopyFromParent,
+                              CWOverrideRedirect | CWBackPixel, &attrs);
+    XSelectInput(c->display, c->window, ExposureMask | KeyPressMask | ButtonPressMask);
+    XMapRaised(c->display, c->window);
+    XGrabKeyboard(c->display, c->window, True, GrabModeAsync, GrabModeAsync, CurrentTime);
+
+    c->gc = XCreateGC(c->display, c->window, 0, NULL);
+    XSetForeground(c->display, c->gc, plan.colors.text);
+    c->font = XLoadQueryFont(c->display, "fixed");
+    if (c->font) {
+        XSetFont(c->display, c->gc, c->font->fid);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &c->start);
+    c->shown = -1;
+    watch_set(&dm->watches[WATCH_X], ConnectionNumber(c->display));
+    return 1;
+}
+
+static void countdown_close(DisplayManager *dm) {
+    Countdown *c = &dm->countdown;
+    if (!c->display) {
+        return;
+    }
+    watch_set(&dm->watches[WATCH_X], -1);
+    arm_timer(dm->timer_fd, -1);
+    if (c->font) {
+        XFreeFont(c->display, c->font);
+    }
+    XFreeGC(c->display, c->gc);
+    XCloseDisplay(c->display);
+    memset(c, 0, sizeof(Countdown));
+}
+
+// Шаг отсчёта по событию X или таймеру: ввод отменяет автовход, по истечении - сессия
+static void countdown_step(DisplayManager *dm) {
+    Countdown *c = &dm->countdown;
+    int cancelled = 0;
+    while (!dm->io_error && XPending(c->display)) {
+        XEvent event;
+        XNextEvent(c->display, &event);
+        if (event.type == KeyPress || event.type == ButtonPress) {
+            cancelled = 1;
+        } else if (event.type == Expose && event.xexpose.count == 0) {
+            c->shown = -1;
+        }
+    }
+    if (dm->io_error) {
+        countdown_close(dm);
+        seat_remove(dm);
+        return;
+    }
+
+    int remaining = options.autologin_timeout * 1000 - (int)elapsed_ms(&c->start);
+    if (cancelled || remaining <= 0) {
+        countdown_close(dm);
+        if ((cancelled || !autologin(dm)) && !dm->opened && !greeter_open(dm)) {
+            seat_remove(dm);
+        }
+        return;
+    }
+
+    int seconds = (remaining + 999) / 1000;
+    if (seconds != c->shown) {
+        char text[160];
+        int len = snprintf(text, sizeof(text), "Starting session for %s in %d s - press any key to log in",
+                           options.autologin_user, seconds);
+        int text_w = c->font ? XTextWidth(c->font, text, len) : len * 6;
+        XClearWindow(c->display, c->window);
+        XDrawString(c->display, c->window, c->gc, c->width / 2 - text_w / 2, c->height / 2, text, len);
+        XFlush(c->display);
+        c->shown = seconds;
+    }
+    // Следующая смена секунды
+    arm_timer(dm->timer_fd, remaining - (seconds - 1) * 1000);
+}
+
+// X места готов: автовход (только когда место одно) и окно приветствия
+void seat_x_started(DisplayManager *dm) {
+    // Окно входа появится только после выхода из сессии автовхода или при отмене отсчёта
+    if (options.autologin_user && !seats.autologin_done && !dm->remote) {
+        seats.autologin_done = 1;
+        if (seats.count > 1) {
+            fprintf(stderr, "Autologin is ignored with several seats\n");
+        } else if (options.autologin_timeout > 0 && dm->timer_fd >= 0 && countdown_open(dm)) {
+            countdown_step(dm);
+            return;
+        } else if (autologin(dm)) {
+            // Без отсчёта (или без timerfd и дисплея для него) - сразу сессия
+            return;
+        }
+    }
+
+    if (!greeter_open(dm)) {
+        seat_remove(dm);
+    }
+}
+
+// Новое место: для готового дисплея из --display окно открывает seat_x_started, иначе
+// запускается свой X, а окно откроется по событию готовности из трубы -displayfd
+DisplayManager *seat_add(const char *seat, const char *display_name, int vt) {
+    if (seats.count == MAX_SEATS) {
+        fprintf(stderr, "Too many seats, %s ignored\n", seat);
+        return NULL;
+    }
+    DisplayManager *dm = calloc(1, sizeof(DisplayManager));
+    if (!dm) {
+        return NULL;
+    }
+    snprintf(dm->seat, sizeof(dm->seat), "%s", seat);
+    dm->vt = vt;
+    dm->users = &seats.users;
+    dm->mouse_x = 100;
+    dm->mouse_y = 100;
+    dm->cursor_x = dm->mouse_x;
+    dm->cursor_y = dm->mouse_y;
+    dm->auth_fd = -1;
+    dm->session_fd = -1;
+    dm->exec_fd = -1;
+    dm->x_ready_fd = -1;
+    dm->connect_fd = -1;
+    for (int i = 0; i < WATCH_SEAT_COUNT; i++) {
+        dm->watches[i].type = i;
+        dm->watches[i].dm = dm;
+        dm->watches[i].fd = -1;
+    }
+    seats.seats[seats.count++] = dm;
+
+    // Таймеры интерфейса; пока X стартует - срок ожидания его готовности.
+    // Без timerfd сроки интерфейса уходят в таймаут epoll
+    dm->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    watch_set(&dm->watches[WATCH_TIMER], dm->timer_fd);
+
+    if (display_name) {
+        // Сервер уже запущен (Xvfb, Xephyr): свой X не поднимаем, окно откроет вызывающий
+        dm->attached = 1;
+        snprintf(dm->display_name, sizeof(dm->display_name), "%s", display_name);
+        printf("Attaching to display %s\n", display_name);
+        return dm;
+    }
+
+    // Готовность X приходит событием через трубу; шина пользователя появится только при входе
+    printf("Starting X server for %s...\n", seat);
+    stats_begin(&dm->x_started);
+    dm->xserver_pid = start_x_server(seat, vt, &dm->x_ready_fd);
+    if (dm->xserver_pid < 0) {
+        fprintf(stderr, "Failed to start X server for %s\n", seat);
+        seat_remove(dm);
+        return NULL;
+    }
+    timeline_mark("X server spawned");
+    watch_set(&dm->watches[WATCH_X_READY], dm->x_ready_fd);
+    if (dm->timer_fd >= 0) {
+        arm_timer(dm->timer_fd, STARTUP_TIMEOUT_MS);
+    }
+    return dm;
+}
+
+// Данные из трубы -displayfd: номер дисплея целиком или EOF
+void seat_x_ready(DisplayManager *dm) {
+    int r = read_ready_line(dm->x_ready_fd, dm->x_ready, sizeof(dm->x_ready), &dm->x_ready_len);
+    if (r == 0) {
+        return;
+    }
+    watch_set(&dm->watches[WATCH_X_READY], -1);
+    close(dm->x_ready_fd);
+    dm->x_ready_fd = -1;
+    if (dm->timer_fd >= 0) {
+        arm_timer(dm->timer_fd, -1);
+    }
+
+    if (r > 0) {
+        snprintf(dm->display_name, sizeof(dm->display_name), ":%s", dm->x_ready);
+        timeline_mark("X server ready");
+        printf("X server ready on display %s (%s)\n", dm->display_name, dm->seat);
+    } else {
+        // Сервер без поддержки -displayfd закрыл трубу молча - проверяем по-старому;
+        // номер известен только у seat0
+        snprintf(dm->display_name, sizeof(dm->display_name), ":0");
+        if (dm->vt == 0 || !wait_for_x_server(dm->display_name)) {
+            fprintf(stderr, "X server failed to start on %s\n", dm->seat);
+            seat_remove(dm);
+            return;
+        }
+        timeline_mark("X server ready (polled)");
+    }
+    stats_end(STAT_STARTUP, &dm->x_started);
+    seat_x_started(dm);
+}
+
+// Место убрано или его X не поднялся. Структура освобождается в seats_purge, после разбора
+// всей пачки событий epoll: в ней ещё могут быть указатели на дескрипторы места
+void seat_remove(DisplayManager *dm) {
+    if (dm->removed) {
+        return;
+    }
+    printf("Removing seat %s\n", dm->seat[0] ? dm->seat : dm->display_name);
+    countdown_close(dm);
+    greeter_close(dm);
+
+    // Сессия и X доживают сами
+    seats_orphan(dm->session_pid);
+    dm->session_pid = 0;
+    session_unwatch(dm);
+    stop_servers(dm);
+    seats_orphan(dm->xserver_pid);
+    dm->xserver_pid = 0;
+
+    watch_set(&dm->watches[WATCH_X_READY], -1);
+    if (dm->x_ready_fd >= 0) {
+        close(dm->x_ready_fd);
+        dm->x_ready_fd = -1;
+    }
+    watch_set(&dm->watches[WATCH_CONNECT], -1);
+    if (dm->connect_fd >= 0) {
+        close(dm->connect_fd);
+        dm->connect_fd = -1;
+    }
+    watch_set(&dm->watches[WATCH_TIMER], -1);
+    if (dm->timer_fd >= 0) {
+        close(dm->timer_fd);
+        dm->timer_fd = -1;
+    }
+    dm->removed = 1;
+}
+
+void seats_purge(void) {
+    int n = 0;
+    for (int i = 0; i < seats.count; i++) {
+        if (seats.seats[i]->removed) {
+            free(seats.seats[i]);
+        } else {
+            seats.seats[n++] = seats.seats[i];
+        }
+    }
+    seats.count = n;
+}
+
+void seats_reap_orphans(void) {
+    int n = 0;
+    for (int i = 0; i < seats.orphan_count; i++) {
+        if (waitpid(seats.orphans[i], NULL, WNOHANG) == 0) {
+            seats.orphans[n++] = seats.orphans[i];
+        }
+    }
+    seats.orphan_count = n;
+}
+
+// Место logind с графикой: в его файле CAN_GRAPHICAL=1
+static int seat_can_graphical(const char *seat) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", SEATS_DIR, seat);
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        return 0;
+    }
+    char line[128];
+    int graphical = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "CAN_GRAPHICAL=1", 15) == 0) {
+            graphical = 1;
+        }
+    }
+    fclose(fp);
+    return graphical;
+}
+
+// Сверка мест с /run/systemd/seats: новые графические места запускаются, места без файла
+// (logind их убрал) останавливаются. Возвращает число графических мест, -1 без logind
+int seats_scan(void) {
+    DIR *dir = opendir(SEATS_DIR);
+    if (!dir) {
+        return -1;
+    }
+    char present[MAX_SEATS * 2][32];
+    int present_count = 0, graphical = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // Временные файлы logind начинаются с точки
+        if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(present[0])) {
+            continue;
+        }
+        if (present_count < MAX_SEATS * 2) {
+            snprintf(present[present_count++], sizeof(present[0]), "%s", entry->d_name);
+        }
+        if (!seat_can_graphical(entry->d_name)) {
+            continue;
+        }
+        graphical++;
+        if (!seat_find(entry->d_name)) {
+            seat_add(entry->d_name, NULL, strcmp(entry->d_name, "seat0") == 0 ? 1 : 0);
+        }
+    }
+    closedir(dir);
+
+    for (int i = 0; i < seats.count; i++) {
+        DisplayManager *dm = seats.seats[i];
+        int found = 0;
+        for (int j = 0; j < present_count && !found; j++) {
+            found = strcmp(dm->seat, present[j]) == 0;
+        }
+        if (!found && !dm->attached) {
+            seat_remove(dm);
+        }
+    }
+    return graphical;
+}
+
+int watch_seats(void) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (inotify_add_watch(fd, SEATS_DIR, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void handle_seats_change(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(seats.seats_watch.fd, buf, sizeof(buf)) > 0) {
+    }
+    seats_scan();
+}
+
+// ---------------------------------------------------------------------------
+// XDMCP: X-терминалы и Xephyr -query находят менеджер по UDP и получают
+// приветствие как ещё одно место. Поддерживается только IPv4 и
+// MIT-MAGIC-COOKIE-1; XDM-AUTHENTICATION-1 отклоняется через Decline.
+// ---------------------------------------------------------------------------
+
+enum {
+    XDMCP_BROADCAST_QUERY = 1,
+    XDMCP_QUERY = 2,
+    XDMCP_INDIRECT_QUERY = 3,
+    XDMCP_WILLING = 5,
+    XDMCP_UNWILLING = 6,
+    XDMCP_REQUEST = 7,
+    XDMCP_ACCEPT = 8,
+    XDMCP_DECLINE = 9,
+    XDMCP_MANAGE = 10,
+    XDMCP_REFUSE = 11,
+    XDMCP_FAILED = 12,
+    XDMCP_KEEPALIVE = 13,
+    XDMCP_ALIVE = 14
+};
+
+// Разбор пакета: все поля big-endian, при выходе за конец ok сбрасывается
+typedef struct {
+    const unsigned char *data;
+    int size;
+    int pos;
+    int ok;
+} XdmcpReader;
+
+static unsigned xdmcp_card8(XdmcpReader *r) {
+    if (r->pos + 1 > r->size) {
+        r->ok = 0;
+        return 0;
+    }
+    return r->data[r->pos++];
+}
+
+static unsigned xdmcp_card16(XdmcpReader *r) {
+    unsigned hi = xdmcp_card8(r);
+    return hi << 8 | xdmcp_card8(r);
+}
+
+static uint32_t xdmcp_card32(XdmcpReader *r) {
+    uint32_t hi = xdmcp_card16(r);
+    return hi << 16 | xdmcp_card16(r);
+}
+
+// ARRAY8 без копирования; *len - длина, указатель внутрь пакета
+static const unsigned char *xdmcp_array8(XdmcpReader *r, int *len) {
+    *len = xdmcp_card16(r);
+    if (!r->ok || r->pos + *len > r->size) {
+        r->ok = 0;
+        *len = 0;
+        return NULL;
+    }
+    const unsigned char *p = r->data + r->pos;
+    r->pos += *len;
+    return p;
+}
+
+// Сборка ответа; заголовок (версия 1, код, длина) дописывает xdmcp_send
+typedef struct {
+    unsigned char data[XDMCP_PACKET_MAX];
+    int size;
+} XdmcpWriter;
+
+static void xdmcp_put8(XdmcpWriter *w, unsigned value) {
+    if (w->size < XDMCP_PACKET_MAX) {
+        w->data[w->size++] = value;
+    }
+}
+
+static void xdmcp_put16(XdmcpWriter *w, unsigned value) {
+    xdmcp_put8(w, value >> 8 & 0xff);
+    xdmcp_put8(w, value & 0xff);
+}
+
+static void xdmcp_put32(XdmcpWriter *w, uint32_t value) {
+    xdmcp_put16(w, value >> 16);
+    xdmcp_put16(w, value & 0xffff);
+}
+
+static void xdmcp_put_array8(XdmcpWriter *w, const void *data, int len) {
+    xdmcp_put16(w, len);
+    for (int i = 0; i < len; i++) {
+        xdmcp_put8(w, ((const unsigned char*)data)[i]);
+    }
+}
+
+static void xdmcp_put_string(XdmcpWriter *w, const char *text) {
+    xdmcp_put_array8(w, text, strlen(text));
+}
+
+static void xdmcp_begin(XdmcpWriter *w) {
+    w->size = 6;
+}
+
+static void xdmcp_send(XdmcpWriter *w, int opcode, const struct sockaddr_in *peer) {
+    int length = w->size - 6;
+    w->data[0] = 0;
+    w->data[1] = 1;
+    w->data[2] = opcode >> 8;
+    w->data[3] = opcode & 0xff;
+    w->data[4] = length >> 8;
+    w->data[5] = length & 0xff;
+    if (sendto(xdmcp.watch.fd, w->data, w->size, 0,
+               (const struct sockaddr*)peer, sizeof(*peer)) < 0) {
+        fprintf(stderr, "XDMCP: sendto failed: %s\n", strerror(errno));
+    }
+}
+
+static void xdmcp_allow_add(uint32_t address, uint32_t mask) {
+    if (xdmcp.allow_count < XDMCP_ALLOW_MAX) {
+        xdmcp.allow[xdmcp.allow_count].address = address & mask;
+        xdmcp.allow[xdmcp.allow_count].mask = mask;
+        xdmcp.allow_count++;
+    }
+}
+
+// Список "адрес[/длина]" через пробел или запятую; без списка - только loopback и
+// сети, в которые смотрят собственные интерфейсы. 0 - в списке ошибка
+static int xdmcp_allow_load(const char *list) {
+    xdmcp.allow_count = 0;
+    if (!list[0]) {
+        xdmcp_allow_add(INADDR_LOOPBACK, 0xff000000);
+        struct ifaddrs *interfaces;
+        if (getifaddrs(&interfaces) == 0) {
+            for (struct ifaddrs *i = interfaces; i; i = i->ifa_next) {
+                if (i->ifa_addr && i->ifa_netmask && i->ifa_addr->sa_family == AF_INET) {
+                    xdmcp_allow_add(ntohl(((struct sockaddr_in*)i->ifa_addr)->sin_addr.s_addr),
+                                    ntohl(((struct sockaddr_in*)i->ifa_netmask)->sin_addr.s_addr));
+                }
+            }
+            freeifaddrs(interfaces);
+        }
+        return 1;
+    }
+
+    char copy[sizeof(config.xdmcp_allow)];
+    snprintf(copy, sizeof(copy), "%s", list);
+    char *saveptr = NULL;
+    for (char *entry = strtok_r(copy, " ,", &saveptr); entry; entry = strtok_r(NULL, " ,", &saveptr)) {
+        int bits = 32;
+        char *slash = strchr(entry, '/');
+        if (slash) {
+            char *end;
+            bits = strtol(slash + 1, &end, 10);
+            *slash = '\0';
+            if (end == slash + 1 || *end || bits < 0 || bits > 32) {
+                fprintf(stderr, "XDMCP: invalid network %s in xdmcp_allow\n", entry);
+                return 0;
+            }
+        }
+        struct in_addr address;
+        if (inet_pton(AF_INET, entry, &address) != 1) {
+            fprintf(stderr, "XDMCP: invalid address %s in xdmcp_allow\n", entry);
+            return 0;
+        }
+        xdmcp_allow_add(ntohl(address.s_addr), bits ? 0xffffffffu << (32 - bits) : 0);
+    }
+    return 1;
+}
+
+static int xdmcp_allowed(struct in_addr address) {
+    uint32_t host = ntohl(address.s_addr);
+    for (int i = 0; i < xdmcp.allow_count; i++) {
+        if ((host & xdmcp.allow[i].mask) == xdmcp.allow[i].address) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int xdmcp_init(int port, const char *allow) {
+    if (!xdmcp_allow_load(allow)) {
+        return 0;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "XDMCP: socket failed: %s\n", strerror(errno));
+        return 0;
+    }
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "XDMCP: cannot bind UDP port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    if (gethostname(xdmcp.hostname, sizeof(xdmcp.hostname) - 1) < 0) {
+        snprintf(xdmcp.hostname, sizeof(xdmcp.hostname), "miayDE");
+    }
+    watch_set(&xdmcp.watch, fd);
+    printf("XDMCP: listening on UDP port %d\n", port);
+    return 1;
+}
+
+void xdmcp_shutdown(void) {
+    if (xdmcp.watch.fd >= 0) {
+        int fd = xdmcp.watch.fd;
+        watch_set(&xdmcp.watch, -1);
+        close(fd);
+    }
+}
+
+// Терминал, не приславший Manage за XDMCP_PENDING_TIMEOUT, слот больше не держит
+static void xdmcp_expire(void) {
+    time_t now = time(NULL);
+    int n = 0;
+    for (int i = 0; i < xdmcp.pending_count; i++) {
+        if (now - xdmcp.pending[i].created < XDMCP_PENDING_TIMEOUT) {
+            xdmcp.pending[n++] = xdmcp.pending[i];
+        }
+    }
+    xdmcp.pending_count = n;
+}
+
+static int xdmcp_remote_count(void) {
+    int count = 0;
+    for (int i = 0; i < seats.count; i++) {
+        if (seats.seats[i]->remote && !seats.seats[i]->removed) {
+            count++;
+        }
+    }
+    return count;
+}
+
+static int xdmcp_free_slots(void) {
+    int slots = xdmcp.max_displays - xdmcp.pending_count - xdmcp_remote_count();
+    if (seats.count + xdmcp.pending_count >= MAX_SEATS) {
+        return 0;
+    }
+    return slots > 0 ? slots : 0;
+}
+
+// Query/BroadcastQuery/IndirectQuery: готовы ли мы обслужить ещё один дисплей.
+// IndirectQuery без выбора хоста отвечаем как на прямой запрос, как и xdm
+static void xdmcp_query(int opcode, const struct sockaddr_in *peer) {
+    XdmcpWriter w;
+    char status[64];
+    xdmcp_begin(&w);
+    int busy = xdmcp_remote_count() + xdmcp.pending_count;
+    snprintf(status, sizeof(status), "%d of %d displays", busy, xdmcp.max_displays);
+    if (xdmcp_free_slots() > 0) {
+        // Аутентификация менеджера не требуется - пустое имя
+        xdmcp_put_array8(&w, NULL, 0);
+        xdmcp_put_string(&w, xdmcp.hostname);
+        xdmcp_put_string(&w, status);
+        xdmcp_send(&w, XDMCP_WILLING, peer);
+    } else if (opcode != XDMCP_BROADCAST_QUERY) {
+        // На широковещательный запрос занятый менеджер молчит - ответят другие
+        xdmcp_put_string(&w, xdmcp.hostname);
+        xdmcp_put_string(&w, status);
+        xdmcp_send(&w, XDMCP_UNWILLING, peer);
+    }
+}
+
+static void xdmcp_decline(const struct sockaddr_in *peer, const char *status) {
+    XdmcpWriter w;
+    xdmcp_begin(&w);
+    xdmcp_put_string(&w, status);
+    xdmcp_put_array8(&w, NULL, 0);
+    xdmcp_put_array8(&w, NULL, 0);
+    xdmcp_send(&w, XDMCP_DECLINE, peer);
+}
+
+static void xdmcp_request(XdmcpReader *r, const struct sockaddr_in *peer) {
+    int display_number = xdmcp_card16(r);
+
+    // Адрес, по которому откроем дисплей: первый IPv4 из списка терминала
+    int type_count = xdmcp_card8(r);
+    int internet = -1;
+    for (int i = 0; i < type_count && r->ok; i++) {
+        if (xdmcp_card16(r) == 0 && internet < 0) {
+            internet = i;
+        }
+    }
+    struct in_addr address = peer->sin_addr;
+    int address_count = xdmcp_card8(r);
+    for (int i = 0; i < address_count && r->ok; i++) {
+        int len;
+        const unsigned char *data = xdmcp_array8(r, &len);
+        if (i == internet && len == 4) {
+            memcpy(&address, data, 4);
+        }
+    }
+
+    int authentication_len, data_len;
+    xdmcp_array8(r, &authentication_len);
+    xdmcp_array8(r, &data_len);
+
+    int cookie_offered = 0;
+    int name_count = xdmcp_card8(r);
+    for (int i = 0; i < name_count && r->ok; i++) {
+        int len;
+        const unsigned char *name = xdmcp_array8(r, &len);
+        if (len == sizeof(XDMCP_COOKIE_NAME) - 1 &&
+            memcmp(name, XDMCP_COOKIE_NAME, len) == 0) {
+            cookie_offered = 1;
+        }
+    }
+    if (!r->ok) {
+        return;
+    }
+    // Иначе разрешённый терминал мог бы направить приветствие на чужой X
+    if (!xdmcp_allowed(address)) {
+        xdmcp_decline(peer, "Display address is not allowed");
+        return;
+    }
+    if (authentication_len > 0) {
+        xdmcp_decline(peer, "Authentication is not supported");
+        return;
     }
-    return pid;
-}
 
-int wait_for_x_server() {
-    int attempts = 0;
-    while (attempts < 50) {
-        Display *test_display = XOpenDisplay(":0");
-        if (test_display) {
-            XCloseDisplay(test_display);
-            return 1;
+    // Повторный Request (потерялся Accept) получает ту же сессию
+    XdmcpPending *pending = NULL;
+    for (int i = 0; i < xdmcp.pending_count; i++) {
+        if (xdmcp.pending[i].display_number == display_number &&
+            xdmcp.pending[i].peer.sin_addr.s_addr == peer->sin_addr.s_addr &&
+            xdmcp.pending[i].peer.sin_port == peer->sin_port) {
+            pending = &xdmcp.pending[i];
         }
-        usleep(100000);
-        attempts++;
     }
-    return 0;
-}
-
-int wait_for_dbus() {
-    int attempts = 0;
-    while (attempts < 30) {
-        if (access("/tmp/dbus-address", F_OK) == 0) {
-            return 1;
+    if (!pending) {
+        if (xdmcp_free_slots() == 0 || xdmcp.pending_count == XDMCP_PENDING_MAX) {
+            xdmcp_decline(peer, "Maximum number of displays reached");
+            return;
+        }
+        pending = &xdmcp.pending[xdmcp.pending_count++];
+        memset(pending, 0, sizeof(*pending));
+        if (getrandom(&pending->session_id, sizeof(pending->session_id), 0) != sizeof(pending->session_id)) {
+            pending->session_id = (uint32_t)time(NULL) ^ (uint32_t)getpid() << 16;
+        }
+        if (pending->session_id == 0) {
+            pending->session_id = 1;
+        }
+        pending->display_number = display_number;
+        pending->peer = *peer;
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &address, ip, sizeof(ip));
+        snprintf(pending->host, sizeof(pending->host), "%s", ip);
+        if (cookie_offered) {
+            pending->has_cookie =
+                getrandom(pending->cookie, XDMCP_COOKIE_SIZE, 0) == XDMCP_COOKIE_SIZE;
         }
-        usleep(100000);
-        attempts++;
     }
-    return 0;
-}
+    pending->created = time(NULL);
 
-void draw_gradient_background(DisplayManager *dm) {
-    // Рисуем градиентный фон
-    for (int y = 0; y < dm->height; y++) {
-        double ratio = (double)y / dm->height;
-        int r1 = (COLOR_BG1 >> 16) & 0xFF;
-        int g1 = (COLOR_BG1 >> 8) & 0xFF;
-        int b1 = COLOR_BG1 & 0xFF;
-        int r2 = (COLOR_BG2 >> 16) & 0xFF;
-        int g2 = (COLOR_BG2 >> 8) & 0xFF;
-        int b2 = COLOR_BG2 & 0xFF;
-        
-        int r = r1 + (r2 - r1) * ratio;
-        int g = g1 + (g2 - g1) * ratio;
-        int b = b1 + (b2 - b1) * ratio;
-        
-        unsigned long color = (r << 16) | (g << 8) | b;
-        XSetForeground(dm->display, dm->gc, color);
-        XDrawLine(dm->display, dm->window, dm->gc, 0, y, dm->width, y);
+    XdmcpWriter w;
+    xdmcp_begin(&w);
+    xdmcp_put32(&w, pending->session_id);
+    xdmcp_put_array8(&w, NULL, 0);
+    xdmcp_put_array8(&w, NULL, 0);
+    if (pending->has_cookie) {
+        xdmcp_put_string(&w, XDMCP_COOKIE_NAME);
+        xdmcp_put_array8(&w, pending->cookie, XDMCP_COOKIE_SIZE);
+    } else {
+        xdmcp_put_array8(&w, NULL, 0);
+        xdmcp_put_array8(&w, NULL, 0);
     }
+    xdmcp_send(&w, XDMCP_ACCEPT, peer);
+    printf("XDMCP: accepted %s:%d\n", pending->host, display_number);
 }
 
-void draw_rounded_rect(DisplayManager *dm, int x, int y, int width, int height, int radius, unsigned long color) {
-    XSetForeground(dm->display, dm->gc, color);
-    
-    // Основной прямоугольник
-    XFillRectangle(dm->display, dm->window, dm->gc, x + radius, y, width - 2 * radius, height);
-    XFillRectangle(dm->display, dm->window, dm->gc, x, y + radius, width, height - 2 * radius);
-    
-    // Углы
-    XFillArc(dm->display, dm->window, dm->gc, x, y, 2 * radius, 2 * radius, 90 * 64, 90 * 64);
-    XFillArc(dm->display, dm->window, dm->gc, x + width - 2 * radius, y, 2 * radius, 2 * radius, 0, 90 * 64);
-    XFillArc(dm->display, dm->window, dm->gc, x, y + height - 2 * radius, 2 * radius, 2 * radius, 180 * 64, 90 * 64);
-    XFillArc(dm->display, dm->window, dm->gc, x + width - 2 * radius, y + height - 2 * radius, 2 * radius, 2 * radius, 270 * 64, 90 * 64);
+static void xdmcp_failed(uint32_t session_id, const struct sockaddr_in *peer, const char *status) {
+    XdmcpWriter w;
+    xdmcp_begin(&w);
+    xdmcp_put32(&w, session_id);
+    xdmcp_put_string(&w, status);
+    xdmcp_send(&w, XDMCP_FAILED, peer);
 }
 
-void draw_user_avatar(DisplayManager *dm, int x, int y, int selected) {
-    int radius = AVATAR_SIZE / 2;
-    
-    // Фон аватарки
-    XSetForeground(dm->display, dm->gc, selected ? COLOR_USER_SELECTED : COLOR_USER_BG);
-    XFillArc(dm->display, dm->window, dm->gc, x, y, AVATAR_SIZE, AVATAR_SIZE, 0, 360 * 64);
-    
-    // Обводка если выбрано
-    if (selected) {
-        XSetForeground(dm->display, dm->gc, COLOR_HIGHLIGHT);
-        XSetLineAttributes(dm->display, dm->gc, 3, LineSolid, CapRound, JoinRound);
-        XDrawArc(dm->display, dm->window, dm->gc, x, y, AVATAR_SIZE, AVATAR_SIZE, 0, 360 * 64);
-        XSetLineAttributes(dm->display, dm->gc, 1, LineSolid, CapRound, JoinRound);
+static DisplayManager *xdmcp_seat(uint32_t session_id) {
+    for (int i = 0; i < seats.count; i++) {
+        DisplayManager *dm = seats.seats[i];
+        if (dm->remote && !dm->removed && dm->xdmcp_session == session_id) {
+            return dm;
+        }
     }
-    
-    // Смайлик
-    XSetForeground(dm->display, dm->gc, COLOR_TEXT);
-    
-    // Глаза
-    XFillArc(dm->display, dm->window, dm->gc, x + radius - 15, y + radius - 10, 10, 10, 0, 360 * 64);
-    XFillArc(dm->display, dm->window, dm->gc, x + radius + 5, y + radius - 10, 10, 10, 0, 360 * 64);
-    
-    // Улыбка
-    XDrawArc(dm->display, dm->window, dm->gc, x + radius - 15, y + radius, 30, 20, 0, 180 * 64);
+    return NULL;
 }
 
-void draw_mouse_cursor(DisplayManager *dm) {
-    XSetForeground(dm->display, dm->gc, COLOR_HIGHLIGHT);
-    XSetLineAttributes(dm->display, dm->gc, 2, LineSolid, CapRound, JoinRound);
-    
-    // Крестик без пересечения
-    XDrawLine(dm->display, dm->window, dm->gc, dm->mouse_x - 8, dm->mouse_y, dm->mouse_x - 2, dm->mouse_y);
-    XDrawLine(dm->display, dm->window, dm->gc, dm->mouse_x + 2, dm->mouse_y, dm->mouse_x + 8, dm->mouse_y);
-    XDrawLine(dm->display, dm->window, dm->gc, dm->mouse_x, dm->mouse_y - 8, dm->mouse_x, dm->mouse_y - 2);
-    XDrawLine(dm->display, dm->window, dm->gc, dm->mouse_x, dm->mouse_y + 2, dm->mouse_x, dm->mouse_y + 8);
-    
-    // Точка в центре
-    XFillArc(dm->display, dm->window, dm->gc, dm->mouse_x - 2, dm->mouse_y - 2, 4, 4, 0, 360 * 64);
-    
-    XSetLineAttributes(dm->display, dm->gc, 1, LineSolid, CapRound, JoinRound);
+// Дисплей терминала не открылся: место убираем, терминал получит Failed и спросит снова
+static void xdmcp_connect_fail(DisplayManager *dm, const char *status) {
+    fprintf(stderr, "XDMCP: %s: %s\n", dm->display_name, status);
+    xdmcp_failed(dm->xdmcp_session, &dm->xdmcp_peer, status);
+    seat_remove(dm);
 }
 
-int point_in_rect(int x, int y, int rect_x, int rect_y, int width, int height) {
-    return (x >= rect_x && x <= rect_x + width && y >= rect_y && y <= rect_y + height);
+static void xdmcp_connect_close(DisplayManager *dm) {
+    watch_set(&dm->watches[WATCH_CONNECT], -1);
+    close(dm->connect_fd);
+    dm->connect_fd = -1;
+    if (dm->timer_fd >= 0) {
+        arm_timer(dm->timer_fd, -1);
+    }
 }
 
-void handle_mouse_click(DisplayManager *dm, int x, int y, int button) {
-    // Клик по пользователям
-    for (int i = 0; i < dm->user_count; i++) {
-        int user_y = 120 + i * 140;
-        int avatar_x = 80;
-        int avatar_y = user_y;
-        
-        if (point_in_rect(x, y, avatar_x - 10, avatar_y - 10, AVATAR_SIZE + 20, AVATAR_SIZE + 20)) {
-            for (int j = 0; j < dm->user_count; j++) {
-                dm->users[j].selected = 0;
-            }
-            dm->users[i].selected = 1;
-            dm->selected_user = i;
-            dm->password_active = 1;
-            dm->password_focus = 1;
-            dm->show_sessions = 0;
-            memset(dm->password, 0, sizeof(dm->password));
-            return;
-        }
+// Порт X терминала ответил: теперь XOpenDisplay соединится сразу, а не будет ждать
+// повторов SYN к выключенному или закрытому файрволом хосту
+static void xdmcp_connect_done(DisplayManager *dm) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(dm->connect_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        err = errno;
     }
-    
-    if (dm->password_active && dm->selected_user >= 0) {
-        // Клик по полю пароля
-        int pass_field_x = dm->width/2 - 230;
-        int pass_field_y = dm->height/2 - 30;
-        
-        if (point_in_rect(x, y, pass_field_x, pass_field_y, 460, 60)) {
-            dm->password_focus = 1;
-            return;
-        }
-        
-        // Клик по кнопке сессии
-        int session_button_x = dm->width/2 - 230;
-        int session_button_y = dm->height/2 + 70;
-        
-        if (point_in_rect(x, y, session_button_x, session_button_y, 460, 50)) {
-            dm->password_focus = 0;
-            dm->show_sessions = !dm->show_sessions;
-            return;
-        }
-        
-        // Клик по элементам выпадающего списка сессий
-        if (dm->show_sessions) {
-            for (int i = 0; i < dm->session_count; i++) {
-                int item_y = dm->height/2 + 130 + i * 50;
-                if (point_in_rect(x, y, session_button_x, item_y, 460, 50)) {
-                    dm->selected_session = i;
-                    dm->show_sessions = 0;
-                    return;
-                }
-            }
-        }
-        
-        // Клик вне элементов - снимаем фокус
-        dm->password_focus = 0;
+    xdmcp_connect_close(dm);
+    if (err != 0) {
+        xdmcp_connect_fail(dm, strerror(err));
+        return;
+    }
+    seat_x_started(dm);
+    if (dm->removed) {
+        xdmcp_failed(dm->xdmcp_session, &dm->xdmcp_peer, "Cannot open display");
     }
 }
 
-void show_error(DisplayManager *dm, const char *message) {
-    strncpy(dm->error_message, message, sizeof(dm->error_message)-1);
-    dm->error_time = time(NULL);
-    dm->show_error = 1;
+static void xdmcp_connect_timeout(DisplayManager *dm) {
+    xdmcp_connect_close(dm);
+    xdmcp_connect_fail(dm, "Display did not answer");
 }
 
-void show_warning(DisplayManager *dm, const char *message) {
-    strncpy(dm->warning_message, message, sizeof(dm->warning_message)-1);
-    dm->warning_time = time(NULL);
-    dm->show_warning = 1;
+// XOpenDisplay блокирует до установки TCP: к недоступному терминалу это минуты, и все места
+// стояли бы. Сначала проверочный неблокирующий connect к 6000+N в общем epoll, со сроком
+// на timerfd места; Xlib не принимает готовый дескриптор, поэтому сокет потом закрывается
+static void xdmcp_connect_start(DisplayManager *dm, int display_number) {
+    struct sockaddr_in addr = { 0 };
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(X_TCP_PORT + display_number);
+    if (inet_pton(AF_INET, dm->remote_host, &addr.sin_addr) != 1) {
+        xdmcp_connect_fail(dm, "Bad display address");
+        return;
+    }
+    dm->connect_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (dm->connect_fd < 0) {
+        xdmcp_connect_fail(dm, strerror(errno));
+        return;
+    }
+    if (connect(dm->connect_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        int err = errno;
+        close(dm->connect_fd);
+        dm->connect_fd = -1;
+        xdmcp_connect_fail(dm, strerror(err));
+        return;
+    }
+    // Уже соединённый сокет сразу готов к записи - его разберёт тот же обработчик
+    watch_set(&dm->watches[WATCH_CONNECT], dm->connect_fd);
+    if (dm->timer_fd >= 0) {
+        arm_timer(dm->timer_fd, XDMCP_CONNECT_TIMEOUT_MS);
+    }
 }
 
-void draw_notifications(DisplayManager *dm) {
-    time_t current_time = time(NULL);
-    
-    if (dm->show_error && (current_time - dm->error_time < 5)) {
-        draw_rounded_rect(dm, dm->width - 380, 30, 350, 70, 15, 0xff4444);
-        
-        XSetForeground(dm->display, dm->gc, 0xffffff);
-        XDrawString(dm->display, dm->window, dm->gc, 
-                   dm->width - 370, 55, "Error:", 6);
-        XDrawString(dm->display, dm->window, dm->gc, 
-                   dm->width - 370, 75, dm->error_message, strlen(dm->error_message));
-    } else {
-        dm->show_error = 0;
+// Manage: терминал ждёт подключения. Окно откроется, когда ответит его порт X;
+// до того место живёт без дисплея, повтор Manage ничего не меняет
+static void xdmcp_manage(XdmcpReader *r, const struct sockaddr_in *peer) {
+    uint32_t session_id = xdmcp_card32(r);
+    int display_number = xdmcp_card16(r);
+    if (!r->ok) {
+        return;
     }
-    
-    if (dm->show_warning && (current_time - dm->warning_time < 5)) {
-        draw_rounded_rect(dm, dm->width - 380, 110, 350, 70, 15, 0xffcc00);
-        
-        XSetForeground(dm->display, dm->gc, 0x000000);
-        XDrawString(dm->display, dm->window, dm->gc, 
-                   dm->width - 370, 135, "Warning:", 8);
-        XDrawString(dm->display, dm->window, dm->gc, 
-                   dm->width - 370, 155, dm->warning_message, strlen(dm->warning_message));
-    } else {
-        dm->show_warning = 0;
+    if (xdmcp_seat(session_id)) {
+        // Повтор Manage, пока окно уже открыто
+        return;
+    }
+
+    int index = -1;
+    for (int i = 0; i < xdmcp.pending_count; i++) {
+        if (xdmcp.pending[i].session_id == session_id &&
+            xdmcp.pending[i].display_number == display_number) {
+            index = i;
+        }
     }
+    if (index < 0) {
+        XdmcpWriter w;
+        xdmcp_begin(&w);
+        xdmcp_put32(&w, session_id);
+        xdmcp_send(&w, XDMCP_REFUSE, peer);
+        return;
+    }
+    XdmcpPending pending = xdmcp.pending[index];
+    xdmcp.pending[index] = xdmcp.pending[--xdmcp.pending_count];
+
+    char name[sizeof(pending.host) + 8];
+    snprintf(name, sizeof(name), "%s:%d", pending.host, display_number);
+    DisplayManager *dm = seat_add(name, name, 0);
+    if (!dm) {
+        xdmcp_failed(session_id, peer, "Too many seats");
+        return;
+    }
+    dm->remote = 1;
+    dm->xdmcp_session = session_id;
+    snprintf(dm->remote_host, sizeof(dm->remote_host), "%s", pending.host);
+    memcpy(dm->cookie, pending.cookie, XDMCP_COOKIE_SIZE);
+    dm->has_cookie = pending.has_cookie;
+    dm->xdmcp_peer = *peer;
+    xdmcp_connect_start(dm, display_number);
 }
 
-void handle_key_press(DisplayManager *dm, XKeyEvent *event) {
-    if (dm->password_active && dm->selected_user >= 0 && dm->password_focus) {
-        char keybuf[8];
-        KeySym key;
-        XLookupString(event, keybuf, sizeof(keybuf), &key, NULL);
-        
-        if (key == XK_Return) {
-            if (authenticate(dm->users[dm->selected_user].username, dm->password)) {
-                printf("Authentication successful! Starting session...\n");
-                
-                // Освобождаем ресурсы X11 перед запуском сессии
-                XUngrabPointer(dm->display, CurrentTime);
-                XUngrabKeyboard(dm->display, CurrentTime);
-                
-                if (dm->font) {
-                    XFreeFont(dm->display, dm->font);
-                }
-                XFreeGC(dm->display, dm->gc);
-                XDestroyWindow(dm->display, dm->window);
-                XCloseDisplay(dm->display);
-                
-                // Запускаем сессию
-                start_session(dm->users[dm->selected_user].username, 
-                             dm->sessions[dm->selected_session].exec);
-                
-                // Если сессия завершилась, выходим
-                exit(0);
-            } else {
-                printf("Authentication failed!\n");
-                show_error(dm, "Invalid password");
-                memset(dm->password, 0, sizeof(dm->password));
-            }
-        } else if (key == XK_BackSpace) {
-            if (strlen(dm->password) > 0) {
-                dm->password[strlen(dm->password)-1] = '\0';
-            }
-        } else if (keybuf[0] >= 32 && keybuf[0] <= 126) {
-            if (strlen(dm->password) < sizeof(dm->password)-1) {
-                strncat(dm->password, keybuf, 1);
-            }
+// KeepAlive: жива ли сессия; иначе терминал сбросится и спросит снова
+static void xdmcp_keepalive(XdmcpReader *r, const struct sockaddr_in *peer) {
+    xdmcp_card16(r);
+    uint32_t session_id = xdmcp_card32(r);
+    if (!r->ok) {
+        return;
+    }
+    XdmcpWriter w;
+    xdmcp_begin(&w);
+    xdmcp_put8(&w, xdmcp_seat(session_id) != NULL);
+    xdmcp_put32(&w, session_id);
+    xdmcp_send(&w, XDMCP_ALIVE, peer);
+}
+
+void xdmcp_handle(void) {
+    unsigned char packet[XDMCP_PACKET_MAX];
+    struct sockaddr_in peer;
+    socklen_t peer_len;
+    ssize_t size;
+
+    xdmcp_expire();
+    while (peer_len = sizeof(peer),
+           (size = recvfrom(xdmcp.watch.fd, packet, sizeof(packet), 0,
+                            (struct sockaddr*)&peer, &peer_len)) >= 0) {
+        XdmcpReader r = { packet, size, 0, 1 };
+        int version = xdmcp_card16(&r);
+        int opcode = xdmcp_card16(&r);
+        int length = xdmcp_card16(&r);
+        if (!r.ok || version != 1 || length > size - 6 || peer.sin_family != AF_INET) {
+            continue;
+        }
+        // Хостам вне xdmcp_allow не отвечаем вовсе, как xdm без записи в Xaccess
+        if (!xdmcp_allowed(peer.sin_addr)) {
+            continue;
+        }
+        r.size = 6 + length;
+
+        switch (opcode) {
+        case XDMCP_BROADCAST_QUERY:
+        case XDMCP_QUERY:
+        case XDMCP_INDIRECT_QUERY:
+            xdmcp_query(opcode, &peer);
+            break;
+        case XDMCP_REQUEST:
+            xdmcp_request(&r, &peer);
+            break;
+        case XDMCP_MANAGE:
+            xdmcp_manage(&r, &peer);
+            break;
+        case XDMCP_KEEPALIVE:
+            xdmcp_keepalive(&r, &peer);
+            break;
+        default:
+            break;
         }
     }
 }
 
-void draw_interface(DisplayManager *dm) {
-    // Рисуем градиентный фон
-    draw_gradient_background(dm);
-    
-    // Рисуем список пользователей слева
-    for (int i = 0; i < dm->user_count; i++) {
-        int y = 120 + i * 140;
-        
-        // Фон пользователя
-        draw_rounded_rect(dm, 50, y - 15, 300, 110, 20, 
-                         dm->users[i].selected ? COLOR_USER_SELECTED : COLOR_USER_BG);
-        
-        // Аватарка
-        draw_user_avatar(dm, 80, y, dm->users[i].selected);
-        
-        // Имя пользователя
-        XSetForeground(dm->display, dm->gc, COLOR_TEXT);
-        XDrawString(dm->display, dm->window, dm->gc, 
-                   150, y + AVATAR_SIZE/2 + 5, 
-                   dm->users[i].display_name, strlen(dm->users[i].display_name));
+// Событие дескриптора из общего epoll
+void seats_dispatch(Watch *watch) {
+    DisplayManager *dm = watch->dm;
+    if (watch->fd < 0 || (dm && dm->removed)) {
+        // Дескриптор снят раньше в этой же пачке
+        return;
     }
-    
-    // Поле ввода пароля
-    if (dm->password_active && dm->selected_user >= 0) {
-        // Основное поле
-        draw_rounded_rect(dm, dm->width/2 - 250, dm->height/2 - 60, 500, 240, 30, COLOR_PASS_BG);
-        
-        // Заголовок
-        XSetForeground(dm->display, dm->gc, COLOR_TEXT);
-        XDrawString(dm->display, dm->window, dm->gc, 
-                   dm->width/2 - 230, dm->height/2 - 85, 
-                   "Enter Password:", 15);
-        
-        // Поле ввода (подсвечиваем если в фокусе)
-        unsigned long pass_color = dm->password_focus ? COLOR_PASS_FOCUS : 0xffffff;
-        draw_rounded_rect(dm, dm->width/2 - 230, dm->height/2 - 30, 460, 60, 20, pass_color);
-        
-        // Текст пароля
-        XSetForeground(dm->display, dm->gc, 0x000000);
-        if (strlen(dm->password) > 0) {
-            char stars[strlen(dm->password) + 1];
-            for (int i = 0; i < strlen(dm->password); i++) {
-                stars[i] = '*';
-            }
-            stars[strlen(dm->password)] = '\0';
-            
-            // Центрируем текст пароля
-            int text_width = XTextWidth(dm->font, stars, strlen(stars));
-            int x_pos = dm->width/2 - text_width/2;
-            XDrawString(dm->display, dm->window, dm->gc, 
-                       x_pos, dm->height/2 + 10, stars, strlen(stars));
-        } else if (dm->password_focus) {
-            // Мигающий курсор когда поле в фокусе и пустое
-            time_t current_time = time(NULL);
-            if (current_time % 2 == 0) {
-                XDrawString(dm->display, dm->window, dm->gc, 
-                           dm->width/2 - 220, dm->height/2 + 10, "|", 1);
+    if (dm) {
+        dm->wake = 1;
+    }
+
+    switch (watch->type) {
+        case WATCH_X:
+            // События приветствия разберёт greeter_step
+            if (dm->countdown.display) {
+                countdown_step(dm);
             }
+            break;
+
+        case WATCH_X_READY:
+            seat_x_ready(dm);
+            break;
+
+        case WATCH_AUTH:
+            if (dm->auth_fd >= 0) {
+                auth_handle_message(dm);
+            }
+            break;
+
+        case WATCH_TIMER: {
+            uint64_t expirations;
+            if (read(dm->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                perror("timerfd");
+            }
+            if (dm->x_ready_fd >= 0) {
+                fprintf(stderr, "Timed out waiting for X server on %s\n", dm->seat);
+                seat_remove(dm);
+            } else if (dm->connect_fd >= 0) {
+                xdmcp_connect_timeout(dm);
+            } else if (dm->countdown.display) {
+                countdown_step(dm);
+            }
+            break;
         }
-        
-        // Кнопка выбора сессии
-        draw_rounded_rect(dm, dm->width/2 - 230, dm->height/2 + 70, 460, 50, 20, COLOR_ACCENT1);
-        
-        XSetForeground(dm->display, dm->gc, COLOR_TEXT);
-        char session_text[64];
-        if (dm->session_count > 0) {
-            snprintf(session_text, sizeof(session_text), "Session: %s ▼", 
-                    dm->sessions[dm->selected_session].name);
-        } else {
-            strcpy(session_text, "No sessions available");
-        }
-        
-        // Центрируем текст сессии
-        int text_width = XTextWidth(dm->font, session_text, strlen(session_text));
-        int x_pos = dm->width/2 - text_width/2;
-        XDrawString(dm->display, dm->window, dm->gc, 
-                   x_pos, dm->height/2 + 100, session_text, strlen(session_text));
-        
-        // Выпадающий список сессий
-        if (dm->show_sessions) {
-            draw_rounded_rect(dm, dm->width/2 - 230, dm->height/2 + 130, 460, dm->session_count * 50, 20, 0xffffff);
-            
-            for (int i = 0; i < dm->session_count; i++) {
-                if (i == dm->selected_session) {
-                    draw_rounded_rect(dm, dm->width/2 - 230, dm->height/2 + 130 + i * 50, 460, 50, 20, COLOR_HIGHLIGHT);
+
+        case WATCH_SESSION:
+            // Один SIGCHLD на signalfd может означать выход сессии любого места
+            if (dm->session_fd_is_signalfd) {
+                for (int i = 0; i < seats.count; i++) {
+                    if (!seats.seats[i]->removed && session_reap(seats.seats[i])) {
+                        seats.seats[i]->wake = 1;
+                    }
                 }
-                
-                XSetForeground(dm->display, dm->gc, i == dm->selected_session ? 0xffffff : 0x000000);
-                
-                // Центрируем текст сессии
-                text_width = XTextWidth(dm->font, dm->sessions[i].name, strlen(dm->sessions[i].name));
-                x_pos = dm->width/2 - text_width/2;
-                XDrawString(dm->display, dm->window, dm->gc, 
-                           x_pos, dm->height/2 + 160 + i * 50, 
-                           dm->sessions[i].name, strlen(dm->sessions[i].name));
+            } else {
+                session_reap(dm);
             }
-        }
+            break;
+
+        case WATCH_EXEC:
+            session_exec_done(dm);
+            break;
+
+        case WATCH_CONNECT:
+            xdmcp_connect_done(dm);
+            break;
+
+        case WATCH_AVATARS:
+            avatar_collect(dm);
+            break;
+
+        case WATCH_PASSWD:
+            handle_passwd_change();
+            break;
+
+        case WATCH_SEATS:
+            handle_seats_change();
+            break;
+
+        case WATCH_XDMCP:
+            xdmcp_handle();
+            break;
     }
-    
-    // Уведомления
-    draw_notifications(dm);
-    
-    // Курсор мыши
-    draw_mouse_cursor(dm);
-    
-    XFlush(dm->display);
 }
 
-void signal_handler(int sig) {
-    exit(0);
-}
+int main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], SESSION_CHILD_ARG) == 0) {
+        return session_child(atoi(argv[2]));
+    }
 
-int main() {
-    DisplayManager dm;
-    memset(&dm, 0, sizeof(DisplayManager));
-    
-    dm.mouse_x = 100;
-    dm.mouse_y = 100;
-    dm.mouse_buttons = 0;
-    dm.show_error = 0;
-    dm.show_warning = 0;
-    dm.error_time = 0;
-    dm.warning_time = 0;
-    dm.password_focus = 0;
-    
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
-    
-    printf("Starting DBus session bus...\n");
-    
-    dm.dbus_pid = start_dbus_session();
-    if (dm.dbus_pid < 0) {
-        fprintf(stderr, "Failed to start DBus\n");
-        return 1;
+    static const struct option long_options[] = {
+        { "display", required_argument, NULL, 'd' },
+        { "pam-service", required_argument, NULL, 'p' },
+        { "bench", required_argument, NULL, 'b' },
+        { "autologin", required_argument, NULL, 'a' },
+        { "session", required_argument, NULL, 's' },
+        { "autologin-timeout", required_argument, NULL, 't' },
+        { "config", required_argument, NULL, 'c' },
+        { "xdmcp", no_argument, NULL, 'x' },
+        { "xdmcp-only", no_argument, NULL, 'X' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    options.autologin_timeout = -1;
+    while ((opt = getopt_long(argc, argv, "d:p:b:a:s:t:c:xX", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'c': options.config_path = optarg; break;
+            case 'd': options.display = optarg; break;
+            case 'p': options.pam_service = optarg; break;
+            case 'b': options.bench_script = optarg; break;
+            case 'a': options.autologin_user = optarg; break;
+            case 's': options.autologin_session = optarg; break;
+            case 't': options.autologin_timeout = atoi(optarg); break;
+            case 'x': options.xdmcp = 1; break;
+            case 'X': options.xdmcp = 2; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
     }
-    
-    printf("Waiting for DBus to start...\n");
-    if (!wait_for_dbus()) {
-        fprintf(stderr, "DBus failed to start\n");
-        kill(dm.dbus_pid, SIGTERM);
+    if (options.bench_script && !options.display) {
+        fprintf(stderr, "--bench requires --display\n");
         return 1;
     }
-    
-    if (get_dbus_address(dm.dbus_address, sizeof(dm.dbus_address))) {
-        printf("DBus address: %s\n", dm.dbus_address);
-        setenv("DBUS_SESSION_BUS_ADDRESS", dm.dbus_address, 1);
-    }
-    
-    printf("Starting X server...\n");
-    dm.xserver_pid = start_x_server();
-    if (dm.xserver_pid < 0) {
-        fprintf(stderr, "Failed to start X server\n");
-        kill(dm.dbus_pid, SIGTERM);
+    if (options.bench_script && strchr(options.display, ',')) {
+        fprintf(stderr, "--bench takes a single display\n");
         return 1;
     }
-    
-    printf("Waiting for X server to start...\n");
-    if (!wait_for_x_server()) {
-        fprintf(stderr, "X server failed to start\n");
-        kill(dm.xserver_pid, SIGTERM);
-        kill(dm.dbus_pid, SIGTERM);
+    if (options.bench_script && options.autologin_user) {
+        fprintf(stderr, "--bench and --autologin are mutually exclusive\n");
         return 1;
     }
-    
-    printf("X server started successfully\n");
-    setenv("DISPLAY", ":0", 1);
-    
-    dm.display = XOpenDisplay(":0");
-    if (!dm.display) {
-        fprintf(stderr, "Cannot open X display: :0\n");
-        kill(dm.xserver_pid, SIGTERM);
-        kill(dm.dbus_pid, SIGTERM);
+    if (options.bench_script && options.xdmcp) {
+        fprintf(stderr, "--bench and --xdmcp are mutually exclusive\n");
         return 1;
     }
-    
-    dm.screen = DefaultScreen(dm.display);
-    dm.width = DisplayWidth(dm.display, dm.screen);
-    dm.height = DisplayHeight(dm.display, dm.screen);
-    
-    dm.window = XCreateSimpleWindow(dm.display, RootWindow(dm.display, dm.screen),
-                                   0, 0, dm.width, dm.height, 0,
-                                   BlackPixel(dm.display, dm.screen),
-                                   BlackPixel(dm.display, dm.screen));
-    
-    XStoreName(dm.display, dm.window, "Modern Display Manager");
-     // Устанавливаем события
-    XSelectInput(dm.display, dm.window,
-                ExposureMask | KeyPressMask | ButtonPressMask |
-                ButtonReleaseMask | PointerMotionMask | StructureNotifyMask);
-
-    XSetWindowAttributes attrs;
-    attrs.override_redirect = True;
-    XChangeWindowAttributes(dm.display, dm.window, CWOverrideRedirect, &attrs);
 
-    XMapWindow(dm.display, dm.window);
-    XRaiseWindow(dm.display, dm.window);
-
-    XGrabPointer(dm.display, dm.window, True,
-                ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
-                GrabModeAsync, GrabModeAsync, dm.window, None, CurrentTime);
-    XGrabKeyboard(dm.display, dm.window, True, GrabModeAsync, GrabModeAsync, CurrentTime);
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    if (options.bench_script && !bench_load(&bench, options.bench_script)) {
+        return 1;
+    }
 
-    dm.gc = XCreateGC(dm.display, dm.window, 0, NULL);
-    XSetForeground(dm.display, dm.gc, WhitePixel(dm.display, dm.screen));
-    XSetBackground(dm.display, dm.gc, BlackPixel(dm.display, dm.screen));
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, stats_signal_handler);
+    atexit(stats_dump);
+    // Сигналы доставляются только внутри epoll_pwait: флаг, выставленный между проверкой
+    // и сном, не пролежит до следующего события
+    sigset_t loop_signals;
+    sigemptyset(&loop_signals);
+    sigaddset(&loop_signals, SIGINT);
+    sigaddset(&loop_signals, SIGTERM);
+    sigaddset(&loop_signals, SIGUSR1);
+    // SIGCHLD блокируется до создания потоков (аватары, разбор сессий): иначе ядро может
+    // отдать его потоку, где он пропадёт, и signalfd сессии так и не сработает
+    sigaddset(&loop_signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &loop_signals, NULL);
+    XSetIOErrorHandler(x_io_error);
+    
+    timeline_mark("start");
 
-    // Загружаем большой шрифт DejaVu Sans Mono 18
-    dm.font = XLoadQueryFont(dm.display, "-misc-dejavu sans mono-medium-r-normal--18-0-0-0-m-0-iso10646-1");
-    if (!dm.font) {
-        dm.font = XLoadQueryFont(dm.display, "9x15");
+    // Тема и настройки из конфига; параметры командной строки важнее
+    theme_load(options.config_path);
+    if (!options.pam_service) {
+        options.pam_service = config.pam_service[0] ? config.pam_service : "login";
     }
-    if (dm.font) {
-        XSetFont(dm.display, dm.gc, dm.font->fid);
+    if (!options.autologin_user && config.autologin_user[0] && !options.bench_script) {
+        options.autologin_user = config.autologin_user;
+    }
+    if (!options.autologin_session && config.autologin_session[0]) {
+        options.autologin_session = config.autologin_session;
+    }
+    if (options.autologin_timeout < 0) {
+        options.autologin_timeout = config.autologin_timeout;
+    }
+    if (!options.xdmcp && config.xdmcp && !options.bench_script) {
+        options.xdmcp = config.xdmcp;
     }
 
-    // Получаем данные
-    dm.user_count = get_users(dm.users);
-    dm.selected_user = 0;
-    dm.password_active = 0;
-
-    dm.session_count = get_sessions(dm.sessions);
-    dm.selected_session = 0;
-    dm.show_sessions = 0;
-
-    XEvent event;
-    int running = 1;
+    // Ждём событий всех мест в одном epoll: соединения X, каналы помощников сессии,
+    // таймеры, сессии, аватары, изменения /etc/passwd и списка мест logind
+    seats.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (seats.epoll_fd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
 
-    // Устанавливаем высокую частоту обновления
-    struct timespec frame_time;
-    frame_time.tv_sec = 0;
-    frame_time.tv_nsec = 1000000000 / FPS;
+    if (options.xdmcp) {
+        xdmcp.max_displays = config.xdmcp_max_displays;
+        if (!xdmcp_init(config.xdmcp_port, config.xdmcp_allow) && options.xdmcp == 2) {
+            return 1;
+        }
+    }
 
-    // Двойная буферизация для избежания мерцания
-    Pixmap buffer = XCreatePixmap(dm.display, dm.window, dm.width, dm.height, DefaultDepth(dm.display, dm.screen));
-    GC buffer_gc = XCreateGC(dm.display, buffer, 0, NULL);
+    if (options.xdmcp == 2) {
+        // Только удалённые терминалы: локального X и мест logind нет
+    } else if (options.display) {
+        // --display :1,:2 - несколько готовых серверов, по месту на каждый
+        char displays[256];
+        snprintf(displays, sizeof(displays), "%s", options.display);
+        int several = strchr(displays, ',') != NULL;
+        char *saveptr = NULL;
+        for (char *name = strtok_r(displays, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+            seat_add(several ? name : "", name, 0);
+        }
+        // Окна - когда все места известны: автовход смотрит на их число
+        for (int i = 0; i < seats.count; i++) {
+            seat_x_started(seats.seats[i]);
+        }
+    } else {
+        watch_set(&seats.seats_watch, watch_seats());
+        if (seats_scan() <= 0) {
+            // Без logind (или пока он не видит графики) - одно место со своим X на :0 и vt1
+            seat_add("seat0", NULL, 1);
+        }
+    }
+    seats_purge();
 
+    int running = 1, status = 0;
     while (running) {
-        // Обрабатываем все события
-        while (XPending(dm.display)) {
-            XNextEvent(dm.display, &event);
-
-            switch (event.type) {
-                case MotionNotify:
-                    dm.mouse_x = event.xmotion.x;
-                    dm.mouse_y = event.xmotion.y;
-                    break;
+        if (seats.count == 0 && seats.seats_watch.fd < 0 && xdmcp.watch.fd < 0) {
+            // Единственный сервер не поднялся или не открылся, удалённых ждать неоткуда
+            status = 1;
+            break;
+        }
 
-                case ButtonPress:
-                    dm.mouse_x = event.xbutton.x;
-                    dm.mouse_y = event.xbutton.y;
-                    dm.mouse_buttons |= (1 << (event.xbutton.button - 1));
-                    handle_mouse_click(&dm, event.xbutton.x, event.xbutton.y, event.xbutton.button);
-                    break;
+        int timeout = -1, bench_rendered = 0;
+        int stepped[MAX_SEATS] = { 0 };
 
-                case ButtonRelease:
-                    dm.mouse_x = event.xbutton.x;
-                    dm.mouse_y = event.xbutton.y;
-                    dm.mouse_buttons &= ~(1 << (event.xbutton.button - 1));
-                    break;
+        // Проходим только места, у которых были события; без timerfd - каждый раз
+        for (int i = 0; i < seats.count; i++) {
+            DisplayManager *dm = seats.seats[i];
+            if (!dm->opened || (!dm->wake && dm->timer_fd >= 0)) {
+                continue;
+            }
+            dm->wake = 0;
+            stepped[i] = 1;
+            int seat_timeout;
+            int rendered = greeter_step(dm, &seat_timeout);
+            if (dm->io_error) {
+                seat_remove(dm);
+                continue;
+            }
+            if (i == 0) {
+                bench_rendered = rendered;
+            }
+            if (seat_timeout >= 0 && (timeout < 0 || seat_timeout < timeout)) {
+                timeout = seat_timeout;
+            }
+        }
 
-                case KeyPress:
-                    handle_key_press(&dm, &event.xkey);
-                    break;
+        // Порция перечисления пользователей - только когда ввод ни одного места не ждёт обработки
+        if (seats.users.loading || seats.users_pending.loading) {
+            int input_pending = 0;
+            for (int i = 0; i < seats.count; i++) {
+                if (seats.seats[i]->opened && XPending(seats.seats[i]->display)) {
+                    seats.seats[i]->wake = 1;
+                    input_pending = 1;
+                }
+            }
+            if (!input_pending) {
+                continue_user_loading();
+            }
+            // Каталог ещё перечисляется - не засыпаем
+            timeout = 0;
+        }
 
-                case ConfigureNotify:
-                    dm.width = event.xconfigure.width;
-                    dm.height = event.xconfigure.height;
-                    XFreePixmap(dm.display, buffer);
-                    buffer = XCreatePixmap(dm.display, dm.window, dm.width, dm.height, DefaultDepth(dm.display, dm.screen));
-                    break;
+        if (options.bench_script && seats.count > 0 && seats.seats[0]->opened) {
+            DisplayManager *dm = seats.seats[0];
+            if (bench.started.tv_sec == 0 && bench.started.tv_nsec == 0) {
+                stats_begin(&bench.started);
+            }
+            bench_frame_done(&bench, bench_rendered);
+            int bench_timeout = bench_next(dm, &bench);
+            if (bench.done) {
+                running = 0;
+                continue;
+            }
+            if (timeout < 0 || bench_timeout < timeout) {
+                timeout = bench_timeout;
+            }
+            // Сценарий ведёт место каждый проход, а не только по событиям
+            dm->wake = 1;
+        }
+
+        // Очередь Xlib epoll не видит: у пройденных мест сбрасываем запросы и проверяем её,
+        // места, разбуженные без событий X (каталог, сессия), проходим без сна
+        for (int i = 0; i < seats.count; i++) {
+            DisplayManager *dm = seats.seats[i];
+            if (!dm->opened) {
+                continue;
+            }
+            int bench_seat = options.bench_script && i == 0;
+            if ((stepped[i] || bench_seat) && XPending(dm->display)) {
+                dm->wake = 1;
+                timeout = 0;
+            } else if (dm->wake && !bench_seat) {
+                timeout = 0;
             }
         }
 
-        // Отрисовываем в буфер
-        DisplayManager dm_buffer = dm;
-        dm_buffer.display = dm.display;
-        dm_buffer.window = buffer;
-        dm_buffer.gc = buffer_gc;
+        if (seats.orphan_count > 0) {
+            seats_reap_orphans();
+        }
 
-        draw_interface(&dm_buffer);
+        if (stats_dump_requested) {
+            stats_dump_requested = 0;
+            stats_dump();
+        }
+        if (stop_requested) {
+            running = 0;
+            continue;
+        }
 
-        // Копируем буфер на экран
-        XCopyArea(dm.display, buffer, dm.window, dm.gc, 0, 0, dm.width, dm.height, 0, 0);
+        // Спим до события любого места или ближайшего таймера. SIGCHLD остаётся
+        // заблокированным: о нём сообщает signalfd сессии
+        sigset_t wait_mask;
+        sigprocmask(SIG_SETMASK, NULL, &wait_mask);
+        sigdelset(&wait_mask, SIGINT);
+        sigdelset(&wait_mask, SIGTERM);
+        sigdelset(&wait_mask, SIGUSR1);
+        struct epoll_event events[MAX_SEATS * 2];
+        int n = epoll_pwait(seats.epoll_fd, events, MAX_SEATS * 2, timeout, &wait_mask);
+        for (int i = 0; i < n; i++) {
+            seats_dispatch(events[i].data.ptr);
+        }
+        seats_purge();
+    }
 
-        // Задержка для поддержания FPS
-        nanosleep(&frame_time, NULL);
+    if (options.bench_script) {
+        bench_report(&bench, stdout);
+        bench_free(&bench);
     }
 
     // Cleanup
-    XFreePixmap(dm.display, buffer);
-    XFreeGC(dm.display, buffer_gc);
-
-    if (dm.font) {
-        XFreeFont(dm.display, dm.font);
+    for (int i = 0; i < seats.count; i++) {
+        countdown_close(seats.seats[i]);
+        greeter_close(seats.seats[i]);
+        stop_servers(seats.seats[i]);
+        if (seats.seats[i]->timer_fd >= 0) {
+            close(seats.seats[i]->timer_fd);
+        }
+        if (seats.seats[i]->connect_fd >= 0) {
+            close(seats.seats[i]->connect_fd);
+        }
+        free(seats.seats[i]);
     }
-    XFreeGC(dm.display, dm.gc);
-    XDestroyWindow(dm.display, dm.window);
-    XCloseDisplay(dm.display);
-
-    kill(dm.xserver_pid, SIGTERM);
-    kill(dm.dbus_pid, SIGTERM);
-
-    unlink("/tmp/dbus-address");
+    seats.count = 0;
+    user_directory_free(&seats.users);
+    user_directory_free(&seats.users_pending);
+    free(seats.sessions);
+    if (seats.passwd_watch.fd >= 0) {
+        close(seats.passwd_watch.fd);
+    }
+    if (seats.seats_watch.fd >= 0) {
+        close(seats.seats_watch.fd);
+    }
+    xdmcp_shutdown();
+    close(seats.epoll_fd);
 
-    return 0;
+    return status;
 }